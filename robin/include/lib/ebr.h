@@ -0,0 +1,50 @@
+/*
+ * ebr.h
+ *
+ * Header file containing the epoch-based reclamation interface: objects
+ * unpublished by writers are freed only when no reader can still see them.
+ *
+ * Luca Zulberti <l.zulberti@studenti.unipi.it>
+ */
+
+#ifndef EBR_H
+#define EBR_H
+
+#include <stdint.h>
+
+/* embedded in the objects to reclaim */
+typedef struct ebr_node {
+    struct ebr_node *next;
+    uint64_t epoch;
+    void (*free_fn)(struct ebr_node *node);
+} ebr_node_t;
+
+/**
+ * @brief Enter a read-side critical section
+ *
+ * Pointers loaded inside the section stay valid until ebr_exit(). Sections
+ * can be nested and must not block for long.
+ */
+void ebr_enter(void);
+
+/**
+ * @brief Exit a read-side critical section
+ */
+void ebr_exit(void);
+
+/**
+ * @brief Free an object once no reader can see it anymore
+ *
+ * The object must already be unreachable for new readers.
+ *
+ * @param node    the node embedded in the object
+ * @param free_fn function freeing the object
+ */
+void ebr_retire(ebr_node_t *node, void (*free_fn)(ebr_node_t *node));
+
+/**
+ * @brief Free every retired object, no reader must be in a section
+ */
+void ebr_free_all(void);
+
+#endif  /* EBR_H */
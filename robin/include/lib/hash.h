@@ -0,0 +1,41 @@
+/*
+ * hash.h
+ *
+ * Header file containing the hash functions shared by the in-memory indexes.
+ *
+ * Luca Zulberti <l.zulberti@studenti.unipi.it>
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Hash a NUL-terminated string (32-bit FNV-1a)
+ *
+ * @param s        the string
+ * @return uint32_t its hash
+ */
+uint32_t hash_str(const char *s);
+
+/**
+ * @brief Hash a memory area (32-bit FNV-1a), same result as hash_str() on
+ *        the characters of a string
+ *
+ * @param buf      the memory area
+ * @param len      its length
+ * @return uint32_t its hash
+ */
+uint32_t hash_mem(const void *buf, size_t len);
+
+/**
+ * @brief Hash a 32-bit integer (murmur3 finalizer)
+ *
+ * @param x        the integer
+ * @return uint32_t its hash
+ */
+uint32_t hash_u32(uint32_t x);
+
+#endif  /* HASH_H */
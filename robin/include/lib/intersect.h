@@ -0,0 +1,31 @@
+/*
+ * intersect.h
+ *
+ * Header file containing the intersection of sorted arrays of user ids.
+ *
+ * Luca Zulberti <l.zulberti@studenti.unipi.it>
+ */
+
+#ifndef INTERSECT_H
+#define INTERSECT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Intersect two strictly ascending arrays of uids
+ *
+ * Arrays of similar size are merged, four uids at a time with SSE2 when
+ * available; the uids of a much smaller array are searched by galloping.
+ *
+ * @param a      first array
+ * @param na     its length
+ * @param b      second array
+ * @param nb     its length
+ * @param out    the common uids, ascending; room for the shorter array
+ * @return size_t the number of common uids
+ */
+size_t intersect_u32(const uint32_t *a, size_t na, const uint32_t *b,
+                     size_t nb, uint32_t *out);
+
+#endif  /* INTERSECT_H */
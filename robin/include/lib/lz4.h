@@ -0,0 +1,58 @@
+/*
+ * lz4.h
+ *
+ * Header file containing the compression of buffers in the LZ4 block format.
+ *
+ * Luca Zulberti <l.zulberti@studenti.unipi.it>
+ */
+
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZ4_HASH_LOG 12
+
+/* state of the compressor, reused by every block */
+typedef struct lz4_ctx {
+    uint32_t table[1 << LZ4_HASH_LOG]; /* last position of 4 byte sequences */
+} lz4_ctx_t;
+
+/**
+ * @brief Get the room needed by a compressed block in the worst case
+ *
+ * @param n       the length of the data
+ * @return size_t the maximum length of the compressed block
+ */
+static inline size_t lz4_bound(size_t n)
+{
+    return n + n / 255 + 16;
+}
+
+/**
+ * @brief Compress the data into one block
+ *
+ * The context need not be reset between blocks: what it remembers of the
+ * previous ones is checked before use.
+ *
+ * @param ctx     the context
+ * @param src     the data
+ * @param n       its length
+ * @param dst     the block, room for lz4_bound(n) bytes
+ * @return size_t the length of the block
+ */
+size_t lz4_compress(lz4_ctx_t *ctx, const char *src, size_t n, char *dst);
+
+/**
+ * @brief Decompress a block, checking it does not read or write out of bounds
+ *
+ * @param src  the block
+ * @param n    its length
+ * @param dst  the data
+ * @param len  room for the data in dst; return argument, its length
+ * @return int 0 on success; -1 on malformed block or not enough room
+ */
+int lz4_decompress(const char *src, size_t n, char *dst, size_t *len);
+
+#endif  /* LZ4_H */
@@ -1,6 +1,10 @@
 #ifndef PASSWORD_H
 #define PASSWORD_H
 
+#include <crypt.h>
+
 int password_hash(char *psw_hashed, const char *psw, const char *salt);
+int password_hash_r(char *psw_hashed, const char *psw, const char *salt,
+                    struct crypt_data *data);
 
 #endif  /* PASSWORD_H */
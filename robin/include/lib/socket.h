@@ -9,10 +9,36 @@
 #ifndef SOCKET_H
 #define SOCKET_H
 
+#include <stddef.h>
+
+/* bytes of the length prefixed to every packet, big-endian */
+#define SOCKET_HDR_LEN 4
+
+/* length flag of a packet holding compressed packets, where negotiated */
+#define SOCKET_HDR_ZIP 0x80000000U
+
+/*
+ * Packets are received in a buffer allocated by socket_recv(), which returns
+ * their length or 0 on connection closed, or in buf of max + 1 bytes by
+ * socket_recv_into(), which skips longer ones: 0 on success, 1 on connection
+ * closed, 2 on packet skipped (len is its length), -1 on error.
+ * socket_recv_raw() reads exactly n bytes, with the same codes.
+ */
 int socket_recv(int fd, char **buf);
+int socket_recv_into(int fd, char *buf, size_t max, size_t *len);
+int socket_recv_raw(int fd, void *buf, size_t n);
 int socket_send(int fd, const void *buf, int n);
+int socket_send_raw(int fd, const void *buf, size_t n);
+
+/*
+ * Listening and connecting over TCP (host and port) or over a local socket
+ * (path, a stale socket file is replaced). Connections accepted from either
+ * kind of listener carry the same packets.
+ */
 int socket_open_listen(const char *host, unsigned short port, int *s_listen);
+int socket_open_listen_unix(const char *path, int *s_listen);
 int socket_open_connect(const char *host, unsigned short port, int *s_connect);
+int socket_open_connect_unix(const char *path, int *s_connect);
 int socket_accept_connection(int s_listen, int *s_connect);
 int socket_close(int s);
 
@@ -0,0 +1,76 @@
+/*
+ * uidset.h
+ *
+ * Header file containing the compact set of user ids used for the follow
+ * graph adjacency.
+ *
+ * Small sets are kept as sorted vectors (binary search), once they reach
+ * UIDSET_HASH_THRESHOLD elements they are converted to open-addressing hash
+ * sets. Storage grows geometrically: there is no allocation per element.
+ *
+ * Luca Zulberti <l.zulberti@studenti.unipi.it>
+ */
+
+#ifndef UIDSET_H
+#define UIDSET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define UIDSET_HASH_THRESHOLD 128
+
+typedef struct uidset {
+    uint32_t *v;  /* sorted uids, or hash slots if hashed */
+    uint32_t len; /* number of uids in the set */
+    uint32_t cap; /* number of allocated slots */
+    int hashed;
+} uidset_t;
+
+#define UIDSET_INIT { .v = NULL, .len = 0, .cap = 0, .hashed = 0 }
+
+/**
+ * @brief Add an uid to the set
+ *
+ * @param s    the set
+ * @param uid  the uid
+ * @return int 0 on success; 1 if already present; -1 on error
+ */
+int uidset_add(uidset_t *s, uint32_t uid);
+
+/**
+ * @brief Remove an uid from the set
+ *
+ * @param s    the set
+ * @param uid  the uid
+ * @return int 0 on success; 1 if not present
+ */
+int uidset_remove(uidset_t *s, uint32_t uid);
+
+/**
+ * @brief Test if the uid is in the set
+ *
+ * @param s    the set
+ * @param uid  the uid
+ * @return int 1 if present; 0 otherwise
+ */
+int uidset_contains(const uidset_t *s, uint32_t uid);
+
+/**
+ * @brief Copy the uids in the set to a vector
+ *
+ * The order of the uids is ascending only if the set is not hashed.
+ *
+ * @param s       the set
+ * @param out     vector of at least s->len elements
+ * @return size_t number of uids copied
+ */
+size_t uidset_copy(const uidset_t *s, uint32_t *out);
+
+/**
+ * @brief Free the storage of the set, leaving it empty
+ *
+ * @param s the set
+ */
+void uidset_free(uidset_t *s);
+
+#endif  /* UIDSET_H */
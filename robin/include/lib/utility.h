@@ -9,14 +9,21 @@
 #ifndef UTILITY_H
 #define UTILITY_H
 
+#include <stddef.h>
+
 /**
- * @brief build (argc, argv) parameters from line
+ * @brief build (argc, argv) parameters from line, in place
+ *
+ * Arguments are separated by spaces, a double quoted one can contain spaces.
+ * They are terminated in src, nothing is allocated.
  *
  * @param src  the line to parse
+ * @param argv the arguments, room for max
+ * @param argl the length of each argument, room for max; can be NULL
+ * @param max  capacity of argv and argl
  * @param argc number of argument found
- * @param argv the arguments
- * @return int 0 on success, -1 on error
+ * @return int 0 on success, -1 if the line has more than max arguments
  */
-int argv_parse(char *src, int *argc, char ***argv);
+int argv_parse(char *src, char **argv, size_t *argl, int max, int *argc);
 
 #endif  /* UTILITY_H */
@@ -0,0 +1,204 @@
+/*
+ * wire.h
+ *
+ * Header file containing the encoding of the typed fields of binary frames:
+ * varints and length-prefixed strings.
+ *
+ * Luca Zulberti <l.zulberti@studenti.unipi.it>
+ */
+
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* growable buffer the fields are appended to */
+typedef struct wire_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+} wire_buf_t;
+
+/* cursor over the fields of a received frame */
+typedef struct wire_rd {
+    char *p;
+    char *end;
+} wire_rd_t;
+
+/**
+ * @brief Make room for n more bytes, to be written in place
+ *
+ * @param buf  the buffer
+ * @param n    the number of bytes
+ * @return int 0 on success; -1 on error
+ */
+int wire_reserve(wire_buf_t *buf, size_t n);
+
+/**
+ * @brief Append a byte
+ *
+ * @param buf  the buffer
+ * @param v    the byte
+ * @return int 0 on success; -1 on error
+ */
+int wire_put_u8(wire_buf_t *buf, uint8_t v);
+
+/**
+ * @brief Append an unsigned integer as a varint (7 bits per byte, LSB first)
+ *
+ * @param buf  the buffer
+ * @param v    the integer
+ * @return int 0 on success; -1 on error
+ */
+int wire_put_uint(wire_buf_t *buf, uint64_t v);
+
+/**
+ * @brief Append a signed integer as a zigzag varint
+ *
+ * @param buf  the buffer
+ * @param v    the integer
+ * @return int 0 on success; -1 on error
+ */
+int wire_put_int(wire_buf_t *buf, int64_t v);
+
+/**
+ * @brief Append a string: its length as a varint, the bytes and a '\0'
+ *
+ * The terminator lets the receiver use the string in place.
+ *
+ * @param buf  the buffer
+ * @param s    the string
+ * @param len  its length
+ * @return int 0 on success; -1 on error
+ */
+int wire_put_str(wire_buf_t *buf, const char *s, size_t len);
+
+/**
+ * @brief Append bytes as they are
+ *
+ * @param buf  the buffer
+ * @param s    the bytes
+ * @param len  their number
+ * @return int 0 on success; -1 on error
+ */
+int wire_put_bytes(wire_buf_t *buf, const void *s, size_t len);
+
+/**
+ * @brief Append an integer as decimal digits
+ *
+ * @param buf  the buffer
+ * @param v    the integer
+ * @return int 0 on success; -1 on error
+ */
+int wire_put_dec(wire_buf_t *buf, int64_t v);
+
+/**
+ * @brief Append a printf-like formatted string
+ *
+ * The string is formatted in place, twice only if it does not fit the spare
+ * capacity, so a reused buffer formats once. A '\0' follows the string but
+ * is not counted in the length.
+ *
+ * @param buf  the buffer
+ * @param fmt  the format
+ * @param args its arguments
+ * @return int 0 on success; -1 on error
+ */
+int wire_put_vfmt(wire_buf_t *buf, const char *fmt, va_list args);
+
+/**
+ * @brief Get the length of an unsigned integer encoded as a varint
+ *
+ * @param v       the integer
+ * @return size_t its length in bytes
+ */
+static inline size_t wire_len_uint(uint64_t v)
+{
+    size_t n = 1;
+
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+
+    return n;
+}
+
+/**
+ * @brief Get the length of an encoded string
+ *
+ * @param len     the length of the string
+ * @return size_t its encoded length in bytes
+ */
+static inline size_t wire_len_str(size_t len)
+{
+    return wire_len_uint(len) + len + 1;
+}
+
+/**
+ * @brief Free the memory of the buffer
+ *
+ * @param buf the buffer
+ */
+void wire_buf_free(wire_buf_t *buf);
+
+/**
+ * @brief Start reading the fields of a frame
+ *
+ * @param rd    the cursor
+ * @param frame the frame
+ * @param len   its length
+ */
+void wire_rd_init(wire_rd_t *rd, char *frame, size_t len);
+
+/**
+ * @brief Read a byte
+ *
+ * @param rd   the cursor
+ * @param v    return argument, the byte
+ * @return int 0 on success; -1 on truncated frame
+ */
+int wire_get_u8(wire_rd_t *rd, uint8_t *v);
+
+/**
+ * @brief Read an unsigned varint
+ *
+ * @param rd   the cursor
+ * @param v    return argument, the integer
+ * @return int 0 on success; -1 on malformed frame
+ */
+int wire_get_uint(wire_rd_t *rd, uint64_t *v);
+
+/**
+ * @brief Read a signed (zigzag) varint
+ *
+ * @param rd   the cursor
+ * @param v    return argument, the integer
+ * @return int 0 on success; -1 on malformed frame
+ */
+int wire_get_int(wire_rd_t *rd, int64_t *v);
+
+/**
+ * @brief Read a string, pointing into the frame
+ *
+ * @param rd   the cursor
+ * @param s    return argument, the string ('\0' terminated)
+ * @param len  return argument, its length, can be NULL
+ * @return int 0 on success; -1 on malformed frame
+ */
+int wire_get_str(wire_rd_t *rd, char **s, size_t *len);
+
+/**
+ * @brief Check if all the fields of the frame were read
+ *
+ * @param rd   the cursor
+ * @return int 1 if at the end of the frame; 0 otherwise
+ */
+static inline int wire_rd_end(const wire_rd_t *rd)
+{
+    return rd->p >= rd->end;
+}
+
+#endif  /* WIRE_H */
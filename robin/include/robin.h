@@ -34,6 +34,13 @@
 #define ROBIN_RELEASE_STRING ROBIN_VERSION_CORE_STRING
 
 
+/*
+ * Robin Session tokens (hex string, without terminator)
+ */
+
+#define ROBIN_SESSION_TOKEN_LEN 32
+
+
 /*
  * Utility macros
  */
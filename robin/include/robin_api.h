@@ -16,6 +16,9 @@
 typedef struct robin_reply {
     int n;
     void *data;
+
+    /* Used to free content shared by the items, can be NULL */
+    void *free_ptr;
 } robin_reply_t;
 
 typedef struct robin_cip {
@@ -36,19 +39,43 @@ typedef struct robin_hashtag {
 } robin_hashtag_t;
 
 
-/* Connection handling */
+/*
+ * Connection handling: connect to "<host>" and port or to "unix:<path>" (a
+ * server on this machine, port unused); init negotiates the binary protocol
+ * if available
+ */
+int robin_api_connect(const char *target, unsigned short port, int *fd);
 int robin_api_init(int fd);
 void robin_api_free(void);
 
 /* API interface */
 int robin_api_register(const char *email, const char *password);
 int robin_api_login(const char *email, const char *password);
+int robin_api_login_session(const char *email, const char *password,
+                            char *token);
+int robin_api_resume(const char *token, char *email, size_t len);
 int robin_api_logout(void);
 int robin_api_follow(const char *emails, robin_reply_t *reply);
 int robin_api_cip(const char *msg);
 int robin_api_followers(robin_reply_t *reply);
 int robin_api_cips_since(time_t since, robin_reply_t *reply);
 int robin_api_hashtags_since(time_t since, robin_reply_t *reply);
+int robin_api_subscribe(void);
 int robin_api_quit(void);
 
+/*
+ * followers, cips_since and hashtags_since in one round trip: 0 on success,
+ * the code of the first one failed (no reply to free), -1 on error
+ */
+int robin_api_home(time_t cips_since, time_t hashtags_since,
+                   robin_reply_t *followers, robin_reply_t *cips,
+                   robin_reply_t *hashtags);
+
+/*
+ * Cips pushed after robin_api_subscribe(), waiting up to timeout ms (-1 for
+ * ever): 1 on cip got (free cip->free_ptr), 0 on none, 2 on cips lost by the
+ * server since the last call, -1 on error
+ */
+int robin_api_push_get(robin_cip_t *cip, int timeout);
+
 #endif /* ROBIN_API_H */
@@ -22,27 +22,50 @@ typedef struct robin_hashtag_exported {
     unsigned int count;
 } robin_hashtag_exp_t;
 
+/* cursor over the cips of a query, see robin_cip_since() */
+typedef struct robin_cip_iter {
+    const struct robin_cip *next; /* NULL at the end */
+    const struct robin_cip *last;
+    char **users;
+    int ulen;
+} robin_cip_iter_t;
+
 
 /**
  * @brief Add a cip sent by an user to the system
  *
  * @param user name of the user
  * @param msg  cip message
+ * @param cip  return argument, the cip as stored (its strings are valid until
+ *             robin_cip_free_all()), can be NULL
  * @return int 0 on success; -1 on error
  */
-int robin_cip_add(const char *user, const char *msg);
+int robin_cip_add(const char *user, const char *msg, robin_cip_exp_t *cip);
 
 /**
- * @brief Get all cips sent after specified timestamp
+ * @brief Start visiting the cips sent after specified timestamp, oldest first
+ *
+ * Only the cips stored at this time are visited. The lock is taken here and
+ * not while visiting, which allocates nothing: a copy of the iterator visits
+ * the same cips again.
  *
+ * @param it    return argument, the iterator
  * @param ts    timestamp
- * @param users array of users to filter
+ * @param users array of users to filter, must live as long as the iterator
  * @param ulen  number of users in the filter
- * @param cips  returned cips
- * @param nums  returned number of cips
- * @return int  0 on success; -1 on error
  */
-int robin_cip_get_since(time_t ts, char **users, int ulen, list_t **cips, unsigned int *nums);
+void robin_cip_since(robin_cip_iter_t *it, time_t ts, char **users, int ulen);
+
+/**
+ * @brief Visit the next cip
+ *
+ * The strings of the cip are valid until robin_cip_free_all().
+ *
+ * @param it   the iterator
+ * @param cip  return argument, the cip
+ * @return int 1 on cip visited; 0 at the end
+ */
+int robin_cip_next(robin_cip_iter_t *it, robin_cip_exp_t *cip);
 
 /**
  * @brief Get all hashtags sent after specified timestamp
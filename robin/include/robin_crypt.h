@@ -0,0 +1,42 @@
+/*
+ * robin_crypt.h
+ *
+ * Header file containing public interface for the Robin Crypt Pool, the
+ * bounded set of workers that run the password hashing.
+ *
+ * Luca Zulberti <l.zulberti@studenti.unipi.it>
+ */
+
+#ifndef ROBIN_CRYPT_H
+#define ROBIN_CRYPT_H
+
+/**
+ * @brief Create and spawn all Robin Crypt workers.
+ *
+ * @return int 0 on success, -1 on failure.
+ */
+int robin_crypt_pool_init(void);
+
+/**
+ * @brief Hash the password on a Robin Crypt worker and wait for the result
+ *
+ * The function blocks while the request queue is full and until a worker has
+ * hashed the password. Callers must not hold any lock needed by other
+ * threads.
+ *
+ * @param psw_hashed return argument, the hashed password
+ * @param psw        the clear text password
+ * @param salt       the salt (hashed password to check against), NULL for a
+ *                   new random salt
+ * @return int       0 on success; -1 on error
+ */
+int robin_crypt_hash(char *psw_hashed, const char *psw, const char *salt);
+
+/**
+ * @brief Terminate all the Robin Crypt workers gracefully
+ *
+ * No thread must be waiting in robin_crypt_hash() when this is called.
+ */
+void robin_crypt_pool_free(void);
+
+#endif /* ROBIN_CRYPT_H */
@@ -0,0 +1,83 @@
+/*
+ * robin_graph.h
+ *
+ * Header file containing the public interface for persisting the Robin
+ * follow graph: a CSR snapshot plus a journal of the edges changed since.
+ *
+ * Luca Zulberti <l.zulberti@studenti.unipi.it>
+ */
+
+#ifndef ROBIN_GRAPH_H
+#define ROBIN_GRAPH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef enum robin_graph_op {
+    ROBIN_GRAPH_FOLLOW = 'F',
+    ROBIN_GRAPH_UNFOLLOW = 'U'
+} robin_graph_op_t;
+
+/*
+ * Callbacks into the owner of the in-memory graph
+ */
+typedef struct robin_graph_ops {
+    /* number of users, i.e. valid uids are [0, users()) */
+    uint32_t (*users)(void);
+    /* copy the followers of uid in *buf, growing it; count or -1 on error */
+    ssize_t (*followers)(uint32_t uid, uint32_t **buf, size_t *cap);
+    /* set the state of an edge, must be idempotent; 0 or -1 on error */
+    int (*apply)(robin_graph_op_t op, uint32_t follower, uint32_t followee);
+
+    /*
+     * Optional, both or none: the owner persists the graph itself instead of
+     * the snapshot file, which is only loaded if nothing was saved yet and
+     * only written on close, for the runs without the owner store.
+     */
+    /* load the graph, *journal_off as saved; 0, 1 if never saved, -1 */
+    int (*restore)(uint64_t *journal_off);
+    /* save the graph, journal records before journal_off are reflected */
+    int (*save)(uint64_t journal_off);
+} robin_graph_ops_t;
+
+/**
+ * @brief Rebuild the graph from file system and open its journal
+ *
+ * The snapshot is loaded (or ops->restore called) and the journal replayed
+ * through ops->apply; then the graph is saved if the journal was not empty.
+ *
+ * @param snapshot path of the snapshot file
+ * @param journal  path of the journal file
+ * @param ops      callbacks into the in-memory graph
+ * @return int     0 on success; -1 on error
+ */
+int robin_graph_open(const char *snapshot, const char *journal,
+                     const robin_graph_ops_t *ops);
+
+/**
+ * @brief Record a batch of edge changes already applied in memory
+ *
+ * Changes to the same edge must be recorded in the order they are applied.
+ * A compaction is started in background once enough records accumulate.
+ *
+ * @param op        the change, the same for the whole batch
+ * @param follower  the follower uid
+ * @param followees the followed uids
+ * @param n         the number of followees
+ * @return int      0 on success (or if the graph is not open); -1 on error
+ */
+int robin_graph_log(robin_graph_op_t op, uint32_t follower,
+                    const uint32_t *followees, size_t n);
+
+/**
+ * @brief Compact the graph and close its journal
+ *
+ * The snapshot file is written even if the owner saves the graph itself.
+ *
+ * Must be called when no more changes are recorded, before freeing the
+ * in-memory graph.
+ */
+void robin_graph_close(void);
+
+#endif /* ROBIN_GRAPH_H */
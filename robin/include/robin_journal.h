@@ -0,0 +1,93 @@
+/*
+ * robin_journal.h
+ *
+ * Header file containing the public interface of Robin Journals: append-only
+ * files written in the background by a dedicated writer thread.
+ *
+ * Luca Zulberti <l.zulberti@studenti.unipi.it>
+ */
+
+#ifndef ROBIN_JOURNAL_H
+#define ROBIN_JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct robin_journal robin_journal_t;
+
+typedef struct robin_journal_opts {
+    size_t flush_size;     /* write as soon as this many bytes are pending */
+    unsigned int flush_ms; /* write pending bytes at least this often */
+    int sync;              /* fdatasync after each group write */
+} robin_journal_opts_t;
+
+/**
+ * @brief Open (create if needed) a journal and start its writer
+ *
+ * @param path              path of the journal file
+ * @param opts              flush policy
+ * @return robin_journal_t* the journal on success; NULL on error
+ */
+robin_journal_t *robin_journal_open(const char *path,
+                                    const robin_journal_opts_t *opts);
+
+/**
+ * @brief Append a record to the journal
+ *
+ * The record is copied in memory, it reaches the file later. The function
+ * only blocks while the in-memory buffer is full.
+ *
+ * @param j    the journal
+ * @param buf  the record
+ * @param len  its length
+ * @return int 0 on success; -1 on error
+ */
+int robin_journal_append(robin_journal_t *j, const void *buf, size_t len);
+
+/**
+ * @brief Wait until every record appended so far has been written
+ *
+ * @param j    the journal
+ * @return int 0 on success; -1 if the writer failed
+ */
+int robin_journal_flush(robin_journal_t *j);
+
+/**
+ * @brief Discard the content of the journal
+ *
+ * Records appended before the call are flushed and then dropped.
+ *
+ * @param j    the journal
+ * @return int 0 on success; -1 on error
+ */
+int robin_journal_truncate(robin_journal_t *j);
+
+/**
+ * @brief Drop the records before an offset, keeping the following ones
+ *
+ * The kept records are copied into a new file that replaces the journal.
+ * Appenders only wait while the records appended during the copy are copied
+ * too. On error the journal is left as it was.
+ *
+ * @param j    the journal
+ * @param off  the offset, as got from robin_journal_size()
+ * @return int 0 on success; -1 on error
+ */
+int robin_journal_rotate(robin_journal_t *j, uint64_t off);
+
+/**
+ * @brief Get the size of the file once every record appended is written
+ *
+ * @param j         the journal
+ * @return uint64_t the size, in bytes
+ */
+uint64_t robin_journal_size(robin_journal_t *j);
+
+/**
+ * @brief Flush the journal, stop its writer and free its resources
+ *
+ * @param j the journal
+ */
+void robin_journal_close(robin_journal_t *j);
+
+#endif /* ROBIN_JOURNAL_H */
@@ -69,6 +69,11 @@ typedef enum robin_log_id {
     ROBIN_LOG_ID_SOCKET,
     ROBIN_LOG_ID_PASSWORD,
     ROBIN_LOG_ID_UTILITY,
+    ROBIN_LOG_ID_CRYPT,
+    ROBIN_LOG_ID_SESSION,
+    ROBIN_LOG_ID_JOURNAL,
+    ROBIN_LOG_ID_GRAPH,
+    ROBIN_LOG_ID_STORE,
     ROBIN_LOG_ID_RT_BASE = 1000
 } robin_log_id_t;
 
@@ -0,0 +1,99 @@
+/*
+ * robin_proto.h
+ *
+ * Header file containing the protocol versions and the opcodes shared by
+ * Robin Server and Robin API.
+ *
+ * Every frame is a 4 bytes big-endian length followed by the payload.
+ *
+ * Version 1 (text), the default: requests are command lines, replies are a
+ * first line "<n> msg" followed by n lines, one frame each; n < 0 is an
+ * error code.
+ *
+ * Version 2 (binary), after "hello 2" got "0 ..." (the reply to hello is in
+ * the version in use when it was sent):
+ *  - request: opcode (1 byte), then the arguments as strings;
+ *  - reply:   one frame, n (signed varint), msg (string), then the n records
+ *             of the command as typed fields:
+ *               following, followers, mutuals, common: email
+ *               suggest:          email, shared (varint)
+ *               follow, unfollow: email, result (signed varint), reason
+ *               cips_since:       ts (varint), user, msg
+ *               hashtags_since:   tag, count (varint)
+ *               others:           the lines of the text reply
+ * Strings are a varint length, the bytes and a '\0'.
+ *
+ * After "subscribe", new cips of the followed users are pushed between the
+ * replies in either version, as replies with a reserved n:
+ *  - ROBIN_PUSH_CIP:  msg "cip", then one cips_since record;
+ *  - ROBIN_PUSH_LOST: msg "<count> cips lost" and nothing else, sent when
+ *                     the connection fell behind and cips were dropped.
+ *
+ * "batch <k>" is followed by k requests, sent together: its reply "0 ..."
+ * is followed by the k replies, in order, sent together too. A batch cannot
+ * contain "hello" or another batch.
+ *
+ * After "hello <version> lz4" got "0 ...", the server can send its replies
+ * compressed: a frame with SOCKET_HDR_ZIP set in the length holds the length
+ * of the original bytes (varint) and their LZ4 block. The original bytes are
+ * reply frames, and the last one can go on in the next compressed frame.
+ * Requests are never compressed.
+ *
+ * Luca Zulberti <l.zulberti@studenti.unipi.it>
+ */
+
+#ifndef ROBIN_PROTO_H
+#define ROBIN_PROTO_H
+
+#include <stddef.h>
+
+#define ROBIN_PROTO_TEXT   1
+#define ROBIN_PROTO_BINARY 2
+
+#define ROBIN_PUSH_CIP  -100
+#define ROBIN_PUSH_LOST -101
+
+typedef enum robin_op {
+    ROBIN_OP_HELP = 0,
+    ROBIN_OP_HELLO,
+    ROBIN_OP_REGISTER,
+    ROBIN_OP_LOGIN,
+    ROBIN_OP_RESUME,
+    ROBIN_OP_LOGOUT,
+    ROBIN_OP_FOLLOW,
+    ROBIN_OP_UNFOLLOW,
+    ROBIN_OP_FOLLOWING,
+    ROBIN_OP_FOLLOWERS,
+    ROBIN_OP_SUGGEST,
+    ROBIN_OP_MUTUALS,
+    ROBIN_OP_COMMON,
+    ROBIN_OP_CIP,
+    ROBIN_OP_CIPS_SINCE,
+    ROBIN_OP_HASHTAGS_SINCE,
+    ROBIN_OP_QUIT,
+    ROBIN_OP_SUBSCRIBE,
+    ROBIN_OP_BATCH,
+    ROBIN_OP_MAX
+} robin_op_t;
+
+/**
+ * @brief Get the opcode of a command name
+ *
+ * Constant time: the length and at most one byte of the name select the only
+ * candidate, which is then compared.
+ *
+ * @param name        the command name, need not be '\0' terminated
+ * @param len         its length
+ * @return robin_op_t the opcode; ROBIN_OP_MAX if no command has that name
+ */
+robin_op_t robin_op_lookup(const char *name, size_t len);
+
+/**
+ * @brief Get the name of a command
+ *
+ * @param op           the opcode
+ * @return const char* the command name; NULL if op is not a command
+ */
+const char *robin_op_name(robin_op_t op);
+
+#endif /* ROBIN_PROTO_H */
@@ -0,0 +1,48 @@
+/*
+ * robin_session.h
+ *
+ * Header file containing the public interface of Robin Sessions, the tokens
+ * that allow a client to restore its login without sending the password.
+ *
+ * Luca Zulberti <l.zulberti@studenti.unipi.it>
+ */
+
+#ifndef ROBIN_SESSION_H
+#define ROBIN_SESSION_H
+
+#include "robin.h"
+
+/**
+ * @brief Create a new session for the user
+ *
+ * @param uid   the user id
+ * @param token return argument, ROBIN_SESSION_TOKEN_LEN + 1 characters
+ * @return int  0 on success
+ *             -1 on error
+ *              1 on too many open sessions
+ */
+int robin_session_create(int uid, char *token);
+
+/**
+ * @brief Look up a session and extend its expiration
+ *
+ * @param token the session token
+ * @param uid   return argument, the user id of the session
+ * @return int  0 on success
+ *              1 on invalid or expired token
+ */
+int robin_session_resume(const char *token, int *uid);
+
+/**
+ * @brief Invalidate a session
+ *
+ * @param token the session token
+ */
+void robin_session_revoke(const char *token);
+
+/**
+ * @brief Free up the resources to terminate gracefully
+ */
+void robin_session_free_all(void);
+
+#endif /* ROBIN_SESSION_H */
@@ -0,0 +1,77 @@
+/*
+ * robin_store.h
+ *
+ * Header file containing the public interface of the Robin Store: the
+ * adjacency lists of the follow graph kept on file system, read and written
+ * one user at a time.
+ *
+ * Luca Zulberti <l.zulberti@studenti.unipi.it>
+ */
+
+#ifndef ROBIN_STORE_H
+#define ROBIN_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef enum robin_store_list {
+    ROBIN_STORE_FOLLOWING = 0,
+    ROBIN_STORE_FOLLOWERS,
+    ROBIN_STORE_LISTS
+} robin_store_list_t;
+
+/**
+ * @brief Open (create if needed) the store
+ *
+ * The lists are left on file system, only their index is loaded.
+ *
+ * @param path        path of the index file, lists go in path.<generation>
+ * @param journal_off return argument, as passed to the last checkpoint
+ * @return int        0 on success; 1 if the store was created; -1 on error
+ */
+int robin_store_open(const char *path, uint64_t *journal_off);
+
+/**
+ * @brief Read a list of a user, sorted
+ *
+ * @param uid     the user
+ * @param list    which list
+ * @param buf     buffer for the uids, grown with realloc if needed
+ * @param cap     capacity of the buffer, updated if grown
+ * @return ssize_t the number of uids read; -1 on error
+ */
+ssize_t robin_store_read(uint32_t uid, robin_store_list_t list,
+                         uint32_t **buf, size_t *cap);
+
+/**
+ * @brief Replace a list of a user
+ *
+ * The new list is written at the end of the lists file, it becomes durable
+ * with the next checkpoint.
+ *
+ * @param uid  the user
+ * @param list which list
+ * @param uids the new list, sorted
+ * @param n    the number of uids
+ * @return int 0 on success; -1 on error
+ */
+int robin_store_write(uint32_t uid, robin_store_list_t list,
+                      const uint32_t *uids, size_t n);
+
+/**
+ * @brief Make the lists written so far durable
+ *
+ * @param journal_off offset of the graph journal reflected by the lists
+ * @return int        0 on success; -1 on error
+ */
+int robin_store_checkpoint(uint64_t journal_off);
+
+/**
+ * @brief Close the store, rewriting the lists file if mostly garbage
+ *
+ * Must be called after the last checkpoint.
+ */
+void robin_store_close(void);
+
+#endif /* ROBIN_STORE_H */
@@ -8,8 +8,46 @@
 #ifndef ROBIN_USER_H
 #define ROBIN_USER_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include "robin.h"
 
+/*
+ * Immutable snapshot of a set of users, consistent at the time it was taken
+ * and shared without locks by all the readers
+ */
+typedef struct robin_user_adj {
+    size_t len;
+    const uint32_t *uids; /* ascending */
+    char **emails;        /* emails[i] is the email of uids[i], read-only */
+} robin_user_adj_t;
+
+/*
+ * Who-to-follow suggestions, best first, shared by the readers like the
+ * snapshots
+ */
+typedef struct robin_user_sugg {
+    size_t len;
+    const uint32_t *uids;
+    char **emails;          /* emails[i] is the email of uids[i], read-only */
+    const uint32_t *shared; /* followed users which follow uids[i] */
+} robin_user_sugg_t;
+
+/**
+ * @brief Keep the follow graph on file system instead of in memory
+ *
+ * Must be called before robin_users_load(). The sets of the users are loaded
+ * on first use and dropped from memory, least recently used first, beyond
+ * cache_max users; acquired users are always kept. The graph is saved in the
+ * store and path.<n> files, credentials are mapped from path.cred.
+ *
+ * @param path      path to the store index file
+ * @param cache_max number of users kept in memory
+ * @return int      0 on success; -1 on error
+ */
+int robin_user_store_init(const char *path, size_t cache_max);
+
 /**
  * @brief Load users and password from file in memory
  *
@@ -18,6 +56,18 @@
  */
 int robin_users_load(const char *filename);
 
+/**
+ * @brief Load the follow graph and record its changes from now on
+ *
+ * Must be called after robin_users_load(). Follow and unfollow changes are
+ * journaled and compacted into the snapshot, also by robin_user_free_all().
+ *
+ * @param snapshot path to the graph snapshot file
+ * @param journal  path to the graph journal file
+ * @return int     0 on success; -1 on error
+ */
+int robin_user_graph_load(const char *snapshot, const char *journal);
+
 /**
  * @brief Acquire (exclusive access) the user if email:psw are valid
  *
@@ -31,6 +81,18 @@ int robin_users_load(const char *filename);
  */
 int robin_user_acquire(const char *email, const char *psw, int *user);
 
+/**
+ * @brief Acquire (exclusive access) the user by uid, without credentials
+ *
+ * Used to restore a login already verified by a Robin Session.
+ *
+ * @param uid  the user id
+ * @return int 0 on success
+ *            -1 on error
+ *             1 user data already acquired
+ */
+int robin_user_acquire_uid(int uid);
+
 /**
  * @brief Release (exclusive access) the user
  *
@@ -59,30 +121,78 @@ int robin_user_add(const char *email, const char *psw);
 const char *robin_user_email_get(int uid);
 
 /**
- * @brief Get a vector with followed users
+ * @brief Get the users followed by the user
  *
- * The returned pointer 'following' must be freed by the caller.
+ * The snapshot is immutable and must be released with robin_user_adj_put().
  *
- * @param uid       the user id
- * @param following the vector of emails (return)
- * @param len       the vector len (return)
- * @return int      0 on success
- *                 -1 on error
+ * @param uid                     the user id
+ * @return const robin_user_adj_t* the snapshot; NULL on error
  */
-int robin_user_following_get(int uid, char ***following, size_t *len);
+const robin_user_adj_t *robin_user_following_snap(int uid);
 
 /**
- * @brief Get a vector of followers
+ * @brief Get the users following the user
+ *
+ * The snapshot is immutable and must be released with robin_user_adj_put().
  *
- * The returned pointer 'followers' must be freed by the caller.
+ * @param uid                     the user id
+ * @return const robin_user_adj_t* the snapshot; NULL on error
+ */
+const robin_user_adj_t *robin_user_followers_snap(int uid);
+
+/**
+ * @brief Get the users followed by the user which follow it back
+ *
+ * The snapshot is immutable and must be released with robin_user_adj_put().
+ *
+ * @param uid                     the user id
+ * @return const robin_user_adj_t* the snapshot; NULL on error
+ */
+const robin_user_adj_t *robin_user_mutuals(int uid);
+
+/**
+ * @brief Get the users followed (or following) by both the user and the one
+ *        identified by email
+ *
+ * The snapshot is immutable and must be released with robin_user_adj_put().
  *
  * @param uid       the user id
- * @param followers the vector of emails (return)
- * @param len       the vector len (return)
+ * @param email     email of the other user
+ * @param followers compare the followers instead of the followed users
+ * @param common    return argument, the snapshot
  * @return int      0 on success
  *                 -1 on error
+ *                  1 on user identified by email does not exist
+ */
+int robin_user_common(int uid, const char *email, int followers,
+                      const robin_user_adj_t **common);
+
+/**
+ * @brief Release a snapshot got from the user store
+ *
+ * @param adj the snapshot, can be NULL
+ */
+void robin_user_adj_put(const robin_user_adj_t *adj);
+
+/**
+ * @brief Suggest users to follow to the user
+ *
+ * Users followed by the followed ones, ranked by how many of them follow
+ * each; cached until the user follows or unfollows somebody. The suggestions
+ * must be released with robin_user_sugg_put().
+ *
+ * @param uid                      the user id
+ * @param k                        the maximum number of suggestions
+ * @return const robin_user_sugg_t* the suggestions; NULL on error
  */
-int robin_user_followers_get(int uid, char ***followers, size_t *len);
+const robin_user_sugg_t *robin_user_suggest(int uid, size_t k);
+
+/**
+ * @brief Release the suggestions got from robin_user_suggest()
+ *
+ * @param sugg the suggestions, can be NULL
+ */
+void robin_user_sugg_put(const robin_user_sugg_t *sugg);
 
 /**
  * @brief Make the user follow the one identified by email
@@ -96,6 +206,20 @@ int robin_user_followers_get(int uid, char ***followers, size_t *len);
  */
 int robin_user_follow(int uid, const char *email);
 
+/**
+ * @brief Make the user follow all the users identified by emails
+ *
+ * Emails are resolved and edges recorded in one pass for the whole batch:
+ * the user is locked once for all the edges, each followed user once.
+ *
+ * @param uid     the user id
+ * @param emails  emails of the users that will be followed
+ * @param n       the number of emails
+ * @param results return argument, the robin_user_follow() code of each email
+ * @return int    0 on success; -1 if any email failed with an error
+ */
+int robin_user_follow_many(int uid, const char **emails, int n, int *results);
+
 /**
  * @brief Make the user unfollow the one identified by email
  *
@@ -107,6 +231,21 @@ int robin_user_follow(int uid, const char *email);
  */
 int robin_user_unfollow(int uid, const char *email);
 
+/**
+ * @brief Make the user unfollow all the users identified by emails
+ *
+ * Emails are resolved and edges recorded in one pass for the whole batch:
+ * the user is locked once for all the edges, each unfollowed user once.
+ *
+ * @param uid     the user id
+ * @param emails  emails of the users that will be unfollowed
+ * @param n       the number of emails
+ * @param results return argument, the robin_user_unfollow() code of each email
+ * @return int    0 on success; -1 if any email failed with an error
+ */
+int robin_user_unfollow_many(int uid, const char **emails, int n,
+                             int *results);
+
 /**
  * @brief Free up the resources to terminate gracefully
  *
@@ -0,0 +1,209 @@
+/*
+ * ebr.c
+ *
+ * Epoch-based reclamation. Readers publish in their slot the global epoch
+ * seen when entering a section; the epoch advances only when every reader in
+ * a section has seen the current one. An object retired at epoch e cannot be
+ * seen by readers once the epoch reaches e + 2, and it is freed then.
+ *
+ * Threads get a slot at their first section and give it back when they exit.
+ *
+ * Luca Zulberti <l.zulberti@studenti.unipi.it>
+ */
+
+#include <stdlib.h>
+
+#include <pthread.h>
+
+#include "robin.h"
+#include "lib/ebr.h"
+
+
+/*
+ * Log shortcuts
+ */
+
+#define err(fmt, args...)  robin_log_err(ROBIN_LOG_ID_UTILITY, fmt, ## args)
+#define warn(fmt, args...) robin_log_warn(ROBIN_LOG_ID_UTILITY, fmt, ## args)
+#define info(fmt, args...) robin_log_info(ROBIN_LOG_ID_UTILITY, fmt, ## args)
+#define dbg(fmt, args...)  robin_log_dbg(ROBIN_LOG_ID_UTILITY, fmt, ## args)
+
+
+/*
+ * Local types and macros
+ */
+
+#define EBR_SLOTS_MAX 256
+
+typedef struct ebr_slot {
+    uint64_t epoch; /* epoch seen at section entry, 0 if outside */
+    int used;
+} __attribute__((aligned(64))) ebr_slot_t;
+
+
+/*
+ * Local data
+ */
+
+static ebr_slot_t ebr_slots[EBR_SLOTS_MAX];
+static int ebr_slots_len = 0; /* slots ever used */
+static uint64_t ebr_epoch = 1;
+
+/* retired objects, in epoch order */
+static ebr_node_t *ebr_limbo_head = NULL;
+static ebr_node_t *ebr_limbo_tail = NULL;
+static pthread_mutex_t ebr_limbo_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t ebr_key;
+static pthread_once_t ebr_key_once = PTHREAD_ONCE_INIT;
+
+static __thread ebr_slot_t *ebr_self = NULL;
+static __thread int ebr_depth = 0;
+
+
+/*
+ * Local functions
+ */
+
+static void ebr_slot_release(void *slot)
+{
+    __atomic_store_n(&((ebr_slot_t *) slot)->used, 0, __ATOMIC_RELEASE);
+}
+
+static void ebr_key_create(void)
+{
+    if (pthread_key_create(&ebr_key, ebr_slot_release))
+        err("pthread_key_create: cannot release slots of exited threads");
+}
+
+static ebr_slot_t *ebr_slot_get(void)
+{
+    int len;
+
+    if (ebr_self)
+        return ebr_self;
+
+    pthread_once(&ebr_key_once, ebr_key_create);
+
+    for (int i = 0; i < EBR_SLOTS_MAX; i++) {
+        if (__atomic_exchange_n(&ebr_slots[i].used, 1, __ATOMIC_ACQUIRE))
+            continue;
+
+        ebr_self = &ebr_slots[i];
+        pthread_setspecific(ebr_key, ebr_self);
+
+        len = __atomic_load_n(&ebr_slots_len, __ATOMIC_RELAXED);
+        while (len < i + 1 &&
+               !__atomic_compare_exchange_n(&ebr_slots_len, &len, i + 1, 0,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED))
+            ;
+
+        return ebr_self;
+    }
+
+    /* out of slots: a thread in a section blocks every reclamation */
+    err("ebr: more than " STR(EBR_SLOTS_MAX) " reader threads");
+    abort();
+}
+
+/* advance the epoch if every reader in a section has seen the current one */
+static uint64_t ebr_try_advance(void)
+{
+    uint64_t e = __atomic_load_n(&ebr_epoch, __ATOMIC_SEQ_CST), seen;
+    int len = __atomic_load_n(&ebr_slots_len, __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < len; i++) {
+        seen = __atomic_load_n(&ebr_slots[i].epoch, __ATOMIC_SEQ_CST);
+        if (seen && seen != e)
+            return e;
+    }
+
+    __atomic_compare_exchange_n(&ebr_epoch, &e, e + 1, 0, __ATOMIC_SEQ_CST,
+                                __ATOMIC_SEQ_CST);
+
+    return __atomic_load_n(&ebr_epoch, __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ * Exported functions
+ */
+
+void ebr_enter(void)
+{
+    ebr_slot_t *slot;
+
+    if (ebr_depth++)
+        return;
+
+    slot = ebr_slot_get();
+
+    /* the slot must be visible before any protected pointer is loaded */
+    __atomic_store_n(&slot->epoch, __atomic_load_n(&ebr_epoch,
+                                                   __ATOMIC_SEQ_CST),
+                     __ATOMIC_SEQ_CST);
+}
+
+void ebr_exit(void)
+{
+    if (--ebr_depth)
+        return;
+
+    __atomic_store_n(&ebr_self->epoch, 0, __ATOMIC_RELEASE);
+}
+
+void ebr_retire(ebr_node_t *node, void (*free_fn)(ebr_node_t *node))
+{
+    ebr_node_t *ready = NULL;
+    uint64_t e;
+
+    node->free_fn = free_fn;
+    node->next = NULL;
+
+    pthread_mutex_lock(&ebr_limbo_mutex);
+
+    node->epoch = __atomic_load_n(&ebr_epoch, __ATOMIC_SEQ_CST);
+    if (ebr_limbo_tail)
+        ebr_limbo_tail->next = node;
+    else
+        ebr_limbo_head = node;
+    ebr_limbo_tail = node;
+
+    /* detach the objects no reader can see anymore */
+    e = ebr_try_advance();
+    if (ebr_limbo_head->epoch + 2 <= e) {
+        ready = ebr_limbo_head;
+        while (ebr_limbo_head && ebr_limbo_head->epoch + 2 <= e) {
+            node = ebr_limbo_head;
+            ebr_limbo_head = node->next;
+        }
+        node->next = NULL;
+        if (!ebr_limbo_head)
+            ebr_limbo_tail = NULL;
+    }
+
+    pthread_mutex_unlock(&ebr_limbo_mutex);
+
+    while (ready) {
+        node = ready;
+        ready = node->next;
+        node->free_fn(node);
+    }
+}
+
+void ebr_free_all(void)
+{
+    ebr_node_t *node;
+
+    pthread_mutex_lock(&ebr_limbo_mutex);
+
+    while (ebr_limbo_head) {
+        node = ebr_limbo_head;
+        ebr_limbo_head = node->next;
+        node->free_fn(node);
+    }
+    ebr_limbo_tail = NULL;
+
+    pthread_mutex_unlock(&ebr_limbo_mutex);
+}
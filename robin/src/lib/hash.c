@@ -0,0 +1,58 @@
+/*
+ * hash.c
+ *
+ * Hash functions used by the in-memory indexes.
+ *
+ * Luca Zulberti <l.zulberti@studenti.unipi.it>
+ */
+
+#include "lib/hash.h"
+
+
+/*
+ * Local types and macros
+ */
+
+#define HASH_FNV_OFFSET 2166136261u
+#define HASH_FNV_PRIME  16777619u
+
+
+/*
+ * Exported functions
+ */
+
+uint32_t hash_str(const char *s)
+{
+    uint32_t h = HASH_FNV_OFFSET;
+
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= HASH_FNV_PRIME;
+    }
+
+    return h;
+}
+
+uint32_t hash_mem(const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    uint32_t h = HASH_FNV_OFFSET;
+
+    while (len--) {
+        h ^= *p++;
+        h *= HASH_FNV_PRIME;
+    }
+
+    return h;
+}
+
+uint32_t hash_u32(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x85ebca6bu;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35u;
+    x ^= x >> 16;
+
+    return x;
+}
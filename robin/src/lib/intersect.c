@@ -0,0 +1,165 @@
+/*
+ * intersect.c
+ *
+ * Intersection of sorted arrays of user ids: galloping search when one array
+ * is much smaller than the other, block-wise merge otherwise.
+ *
+ * Luca Zulberti <l.zulberti@studenti.unipi.it>
+ */
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "lib/intersect.h"
+
+
+/*
+ * Local types and macros
+ */
+
+/* gallop when the larger array is at least this many times the smaller */
+#define INTERSECT_GALLOP_RATIO 32
+
+
+/*
+ * Local functions
+ */
+
+static size_t intersect_merge(const uint32_t *a, size_t na,
+                              const uint32_t *b, size_t nb, uint32_t *out)
+{
+    size_t i = 0, j = 0, n = 0;
+
+    while (i < na && j < nb) {
+        if (a[i] < b[j]) {
+            i++;
+        } else if (a[i] > b[j]) {
+            j++;
+        } else {
+            out[n++] = a[i];
+            i++;
+            j++;
+        }
+    }
+
+    return n;
+}
+
+/* index of the first element >= x in b[lo, n) */
+static size_t intersect_gallop_search(const uint32_t *b, size_t n, size_t lo,
+                                      uint32_t x)
+{
+    size_t hi = lo, step = 1, mid;
+
+    /* double the step until past x, then search the last step */
+    while (hi < n && b[hi] < x) {
+        lo = hi + 1;
+        hi += step;
+        step *= 2;
+    }
+    if (hi > n)
+        hi = n;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (b[mid] < x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static size_t intersect_gallop(const uint32_t *small, size_t ns,
+                               const uint32_t *large, size_t nl,
+                               uint32_t *out)
+{
+    size_t j = 0, n = 0;
+
+    for (size_t i = 0; i < ns; i++) {
+        j = intersect_gallop_search(large, nl, j, small[i]);
+        if (j == nl)
+            break;
+
+        if (large[j] == small[i])
+            out[n++] = large[j++];
+    }
+
+    return n;
+}
+
+#ifdef __SSE2__
+/*
+ * Compare blocks of four uids all against all, through the four rotations of
+ * the block of b, and move forward the block with the lower maximum.
+ */
+static size_t intersect_sse2(const uint32_t *a, size_t na,
+                             const uint32_t *b, size_t nb, uint32_t *out)
+{
+    size_t i = 0, j = 0, n = 0;
+    __m128i va, vb, eq;
+    uint32_t amax, bmax;
+    int mask;
+
+    while (i + 4 <= na && j + 4 <= nb) {
+        va = _mm_loadu_si128((const __m128i *) (a + i));
+        vb = _mm_loadu_si128((const __m128i *) (b + j));
+
+        /* rotate the block of b by one lane at a time */
+        eq = _mm_cmpeq_epi32(va, vb);
+        for (int r = 0; r < 3; r++) {
+            vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+            eq = _mm_or_si128(eq, _mm_cmpeq_epi32(va, vb));
+        }
+
+        for (mask = _mm_movemask_ps(_mm_castsi128_ps(eq)); mask;
+             mask &= mask - 1)
+            out[n++] = a[i + __builtin_ctz(mask)];
+
+        amax = a[i + 3];
+        bmax = b[j + 3];
+        if (amax <= bmax)
+            i += 4;
+        if (bmax <= amax)
+            j += 4;
+    }
+
+    return n + intersect_merge(a + i, na - i, b + j, nb - j, out + n);
+}
+#endif
+
+
+/*
+ * Exported functions
+ */
+
+size_t intersect_u32(const uint32_t *a, size_t na, const uint32_t *b,
+                     size_t nb, uint32_t *out)
+{
+    const uint32_t *tmp;
+    size_t ntmp;
+
+    /* a is the smaller one */
+    if (na > nb) {
+        tmp = a;
+        a = b;
+        b = tmp;
+        ntmp = na;
+        na = nb;
+        nb = ntmp;
+    }
+
+    if (!na)
+        return 0;
+
+    if (nb / na >= INTERSECT_GALLOP_RATIO)
+        return intersect_gallop(a, na, b, nb, out);
+
+#ifdef __SSE2__
+    return intersect_sse2(a, na, b, nb, out);
+#else
+    return intersect_merge(a, na, b, nb, out);
+#endif
+}
@@ -0,0 +1,210 @@
+/*
+ * lz4.c
+ *
+ * LZ4 block format: greedy matching of 4 byte sequences found through a hash
+ * table, and a decompressor safe on untrusted blocks.
+ *
+ * Luca Zulberti <l.zulberti@studenti.unipi.it>
+ */
+
+#include <string.h>
+
+#include "lib/lz4.h"
+
+
+/*
+ * Local types and macros
+ */
+
+#define LZ4_MIN_MATCH     4
+#define LZ4_LAST_LITERALS 5     /* the block ends with literals */
+#define LZ4_MF_LIMIT      12    /* no match starts in the last bytes */
+#define LZ4_MAX_OFFSET    65535
+#define LZ4_SKIP_TRIGGER  6     /* step further every 2^6 misses */
+
+
+/*
+ * Local functions
+ */
+
+static inline uint32_t lz4_read32(const char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return v;
+}
+
+static inline uint32_t lz4_hash(uint32_t seq)
+{
+    return (seq * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+/* lengths from 15 on go on in bytes of 255 and a last one */
+static char *lz4_put_len(char *op, size_t len)
+{
+    while (len >= 255) {
+        *op++ = (char) 255;
+        len -= 255;
+    }
+    *op++ = (char) len;
+
+    return op;
+}
+
+/* literals, then a match unless it is the last sequence (mlen 0) */
+static char *lz4_put_seq(char *op, const char *lit, size_t nlit, size_t off,
+                         size_t mlen)
+{
+    char *token = op++;
+
+    *token = (char) ((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15)
+        op = lz4_put_len(op, nlit - 15);
+
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    if (!mlen)
+        return op;
+
+    *op++ = (char) off;
+    *op++ = (char) (off >> 8);
+
+    mlen -= LZ4_MIN_MATCH;
+    *token |= (char) (mlen < 15 ? mlen : 15);
+    if (mlen >= 15)
+        op = lz4_put_len(op, mlen - 15);
+
+    return op;
+}
+
+/* read the rest of a length from 15 on */
+static int lz4_get_len(const uint8_t **ip, const uint8_t *end, size_t *len)
+{
+    uint8_t b;
+
+    do {
+        if (*ip >= end)
+            return -1;
+
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+
+    return 0;
+}
+
+
+/*
+ * Exported functions
+ */
+
+size_t lz4_compress(lz4_ctx_t *ctx, const char *src, size_t n, char *dst)
+{
+    const char *ip = src, *anchor = src, *ref, *mflimit, *matchlimit;
+    char *op = dst;
+    unsigned int misses = 0;
+    uint32_t seq, h, pos;
+    size_t len;
+
+    if (n > LZ4_MF_LIMIT) {
+        mflimit = src + n - LZ4_MF_LIMIT;
+        matchlimit = src + n - LZ4_LAST_LITERALS;
+
+        while (ip <= mflimit) {
+            seq = lz4_read32(ip);
+            h = lz4_hash(seq);
+            pos = ctx->table[h];
+            ctx->table[h] = ip - src;
+
+            /* positions left by previous blocks fail these checks or match */
+            ref = src + pos;
+            if (pos >= (size_t) (ip - src) || ip - ref > LZ4_MAX_OFFSET
+                || lz4_read32(ref) != seq) {
+                ip += 1 + (misses++ >> LZ4_SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+
+            /* extend the match backwards over the literals, then forwards */
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+
+            len = LZ4_MIN_MATCH;
+            while (ip + len < matchlimit && ip[len] == ref[len])
+                len++;
+
+            op = lz4_put_seq(op, anchor, ip - anchor, ip - ref, len);
+            ip += len;
+            anchor = ip;
+        }
+    }
+
+    /* the rest is literals */
+    op = lz4_put_seq(op, anchor, src + n - anchor, 0, 0);
+
+    return op - dst;
+}
+
+int lz4_decompress(const char *src, size_t n, char *dst, size_t *len)
+{
+    const uint8_t *ip = (const uint8_t *) src, *end = ip + n;
+    char *op = dst, *oend = dst + *len;
+    size_t nlit, mlen, off;
+    uint8_t token;
+
+    while (1) {
+        if (ip >= end)
+            return -1;
+
+        token = *ip++;
+
+        nlit = token >> 4;
+        if (nlit == 15 && lz4_get_len(&ip, end, &nlit) < 0)
+            return -1;
+
+        if (nlit > (size_t) (end - ip) || nlit > (size_t) (oend - op))
+            return -1;
+
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+
+        /* the last sequence has no match */
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return -1;
+
+        off = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (!off || off > (size_t) (op - dst))
+            return -1;
+
+        mlen = token & 15;
+        if (mlen == 15 && lz4_get_len(&ip, end, &mlen) < 0)
+            return -1;
+        mlen += LZ4_MIN_MATCH;
+
+        if (mlen > (size_t) (oend - op))
+            return -1;
+
+        /* the match can overlap the bytes it produces */
+        if (off >= mlen) {
+            memcpy(op, op - off, mlen);
+            op += mlen;
+        } else {
+            for (size_t i = 0; i < mlen; i++, op++)
+                *op = *(op - off);
+        }
+    }
+
+    *len = op - dst;
+
+    return 0;
+}
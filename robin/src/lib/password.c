@@ -42,9 +42,9 @@ static char char_for_salt(void)
  * Exported functions
  */
 
-int password_hash(char *psw_hashed, const char *psw, const char *salt)
+int password_hash_r(char *psw_hashed, const char *psw, const char *salt,
+                    struct crypt_data *data)
 {
-    struct crypt_data *data;
     char salt_to_use[3], *tmp;
 
     if (salt) {
@@ -57,12 +57,6 @@ int password_hash(char *psw_hashed, const char *psw, const char *salt)
     }
     salt_to_use[2] = '\0';
 
-    data = malloc(sizeof(struct crypt_data));
-    if (!data) {
-        err("malloc: %s", strerror(errno));
-        return -1;
-    }
-
     tmp = crypt_r(psw, salt_to_use, data);
     if (!tmp || tmp[0] == '*') {
         err("crypt_r: %s", strerror(errno));
@@ -71,7 +65,23 @@ int password_hash(char *psw_hashed, const char *psw, const char *salt)
 
     strcpy(psw_hashed, tmp);
 
+    return 0;
+}
+
+int password_hash(char *psw_hashed, const char *psw, const char *salt)
+{
+    struct crypt_data *data;
+    int ret;
+
+    data = malloc(sizeof(struct crypt_data));
+    if (!data) {
+        err("malloc: %s", strerror(errno));
+        return -1;
+    }
+
+    ret = password_hash_r(psw_hashed, psw, salt, data);
+
     free(data);
 
-    return 0;
+    return ret;
 }
@@ -11,13 +11,23 @@
 #include <netinet/tcp.h>
 #include <stdlib.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include "robin.h"
 #include "lib/socket.h"
 
 
+/*
+ * Local types and macros
+ */
+
+/* oversized packets are skipped this much at once */
+#define SOCKET_SKIP_LEN 4096
+
+
 /*
  * Log shortcut
  */
@@ -28,6 +38,68 @@
 #define dbg(fmt, args...)  robin_log_dbg(ROBIN_LOG_ID_SOCKET, fmt, ## args)
 
 
+/*
+ * Local functions
+ */
+
+/*
+ * Send all the vectors, resuming after partial sends. A peer gone away is an
+ * error, not a SIGPIPE.
+ */
+static int socket_sendv_all(int fd, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+    ssize_t sent;
+
+    memset(&msg, 0, sizeof(msg));
+
+    while (iovcnt) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+
+        sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+
+            err("sendmsg: %s", strerror(errno));
+            return -1;
+        }
+
+        /* skip what was written */
+        while (iovcnt && (size_t) sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt) {
+            iov->iov_base = (char *) iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+
+    return 0;
+}
+
+/* fill the address of a local socket, the path must fit sun_path */
+static int socket_addr_unix(const char *path, struct sockaddr_un *addr)
+{
+    size_t len = strlen(path);
+
+    if (!len || len >= sizeof(addr->sun_path)) {
+        err("invalid socket path: %s", path);
+        return -1;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path, len + 1);
+
+    return 0;
+}
+
+
 /*
  * Exported functions
  */
@@ -42,10 +114,14 @@ int socket_recv(int fd, char **buf)
         return 0;
 
     if ((ret == -1) || (ret < sizeof(dim)) ) {
-        err("recv: %s", ret, strerror(errno));
+        err("recv: %s", strerror(errno));
         return -1;
     }
     dim = ntohl(dim);
+    if (dim < 0) {
+        err("recv: invalid packet length");
+        return -1;
+    }
 
     msg = malloc((dim + 1) * sizeof(char));
     if (!msg) {
@@ -56,6 +132,7 @@ int socket_recv(int fd, char **buf)
     ret = recv(fd, (void *) msg, dim, MSG_WAITALL);
     if((ret == -1) || (ret < dim)) {
         err("recv: %s", strerror(errno));
+        free(msg);
         return -1;
     }
 
@@ -68,30 +145,99 @@ int socket_recv(int fd, char **buf)
     return dim;
 }
 
+int socket_recv_into(int fd, char *buf, size_t max, size_t *len)
+{
+    char skip[SOCKET_SKIP_LEN];
+    uint32_t dim;
+    size_t left, n;
+    int ret;
+
+    ret = socket_recv_raw(fd, &dim, sizeof(dim));
+    if (ret)
+        return ret;
+
+    *len = ntohl(dim);
+
+    /* the length is checked before reading, a longer packet is dropped */
+    if (*len > max) {
+        for (left = *len; left; left -= n) {
+            n = left < sizeof(skip) ? left : sizeof(skip);
+            if (socket_recv_raw(fd, skip, n))
+                return -1;
+        }
+
+        dbg("packet skipped, %zu bytes", *len);
+
+        return 2;
+    }
+
+    if (socket_recv_raw(fd, buf, *len))
+        return -1;
+
+    buf[*len] = '\0';
+
+    dbg("packet received, %zu bytes: %s", *len, buf);
+
+    return 0;
+}
+
+int socket_recv_raw(int fd, void *buf, size_t n)
+{
+    ssize_t ret;
+
+    if (!n)
+        return 0;
+
+    ret = recv(fd, buf, n, MSG_WAITALL);
+    if (ret == 0)
+        return 1;
+
+    if (ret < 0 || (size_t) ret < n) {
+        err("recv: %s", ret < 0 ? strerror(errno) : "connection closed");
+        return -1;
+    }
+
+    dbg("data received, %zu bytes", n);
+
+    return 0;
+}
+
 int socket_send(int fd, const void *buf, int n)
 {
+    struct iovec iov[2];
     int dim;
-    ssize_t sent;
 
 	dim = htonl(n);
 
-    sent = send(fd, &dim, sizeof(dim), 0);
-    if (sent < 0) {
-        err("send: %s", strerror(errno));
-        return -1;
-    }
+    /* length and payload in one segment, not held back by Nagle */
+    iov[0].iov_base = &dim;
+    iov[0].iov_len = sizeof(dim);
+    iov[1].iov_base = (void *) buf;
+    iov[1].iov_len = n;
 
-    sent = send(fd, buf, n, 0);
-    if (sent < 0) {
-        err("send: %s", strerror(errno));
+    if (socket_sendv_all(fd, iov, 2) < 0)
         return -1;
-    }
 
     dbg("packet sent, %d bytes", n);
 
     return 0;
 }
 
+int socket_send_raw(int fd, const void *buf, size_t n)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *) buf;
+    iov.iov_len = n;
+
+    if (socket_sendv_all(fd, &iov, 1) < 0)
+        return -1;
+
+    dbg("data sent, %zu bytes", n);
+
+    return 0;
+}
+
 int socket_open_listen(const char *host, unsigned short port, int *s_listen)
 {
     struct addrinfo hints, *addr;
@@ -141,10 +287,51 @@ open_listen_quit:
     return ret;
 }
 
+int socket_open_listen_unix(const char *path, int *s_listen)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int ret;
+
+    if (socket_addr_unix(path, &addr))
+        return -1;
+
+    /* a socket left by a previous run would make bind fail */
+    if (!lstat(path, &st) && S_ISSOCK(st.st_mode) && unlink(path))
+        warn("unlink: %s", strerror(errno));
+
+    ret = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ret < 0) {
+        err("socket: %s", strerror(errno));
+        return -1;
+    }
+    *s_listen = ret;
+
+    ret = bind(*s_listen, (struct sockaddr *) &addr, sizeof(addr));
+    if (ret < 0) {
+        err("bind: %s", strerror(errno));
+        goto open_listen_unix_quit;
+    }
+
+    ret = listen(*s_listen, 10);
+    if (ret < 0) {
+        err("listen: %s", strerror(errno));
+        goto open_listen_unix_quit;
+    }
+
+    info("server listening for local connections on %s", path);
+
+    return 0;
+
+open_listen_unix_quit:
+    close(*s_listen);
+    return -1;
+}
+
 int socket_accept_connection(int s_listen, int *s_connect)
 {
     char host[NI_MAXHOST], service[NI_MAXSERV];
-    struct sockaddr_in sock_addr;
+    struct sockaddr_storage sock_addr;
     socklen_t sock_addr_len = sizeof(sock_addr);
     int ret, errno_saved;
 
@@ -159,6 +346,18 @@ int socket_accept_connection(int s_listen, int *s_connect)
     }
     *s_connect = ret;
 
+    if (sock_addr.ss_family == AF_UNIX) {
+        info("new local client");
+        return 0;
+    }
+
+    /* replies are written whole, Nagle would only hold back the tail of a
+     * long one until the client acknowledges the rest
+     */
+    ret = 1;
+    if (setsockopt(*s_connect, IPPROTO_TCP, TCP_NODELAY, &ret, sizeof(ret)))
+        warn("setsockopt: %s", strerror(errno));
+
     ret = getnameinfo((struct sockaddr *) &sock_addr, sock_addr_len,
                       host, NI_MAXHOST, service, NI_MAXSERV,
                       NI_NUMERICSERV);
@@ -216,6 +415,33 @@ connect_quit:
     return ret;
 }
 
+int socket_open_connect_unix(const char *path, int *s_connect)
+{
+    struct sockaddr_un addr;
+    int ret;
+
+    if (socket_addr_unix(path, &addr))
+        return -1;
+
+    ret = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ret < 0) {
+        err("socket: %s", strerror(errno));
+        return -1;
+    }
+    *s_connect = ret;
+
+    ret = connect(*s_connect, (struct sockaddr *) &addr, sizeof(addr));
+    if (ret) {
+        err("connect: %s", strerror(errno));
+        close(*s_connect);
+        return -1;
+    }
+
+    info("connected to %s", path);
+
+    return 0;
+}
+
 int socket_close(int s)
 {
     return close(s);
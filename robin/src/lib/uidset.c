@@ -0,0 +1,231 @@
+/*
+ * uidset.c
+ *
+ * Compact set of user ids: sorted vector for small sets, open-addressing hash
+ * set (linear probing, load factor below 1/2) for large ones.
+ *
+ * Luca Zulberti <l.zulberti@studenti.unipi.it>
+ */
+
+#include <stdlib.h>
+
+#include "robin.h"
+#include "lib/hash.h"
+#include "lib/uidset.h"
+
+
+/*
+ * Log shortcuts
+ */
+
+#define err(fmt, args...)  robin_log_err(ROBIN_LOG_ID_UTILITY, fmt, ## args)
+#define warn(fmt, args...) robin_log_warn(ROBIN_LOG_ID_UTILITY, fmt, ## args)
+#define info(fmt, args...) robin_log_info(ROBIN_LOG_ID_UTILITY, fmt, ## args)
+#define dbg(fmt, args...)  robin_log_dbg(ROBIN_LOG_ID_UTILITY, fmt, ## args)
+
+
+/*
+ * Local types and macros
+ */
+
+#define UIDSET_EMPTY   UINT32_MAX
+#define UIDSET_MIN_CAP 4
+
+
+/*
+ * Local functions
+ */
+
+/* index of the first element >= uid in the sorted vector */
+static uint32_t uidset_vec_search(const uidset_t *s, uint32_t uid)
+{
+    uint32_t lo = 0, hi = s->len, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (s->v[mid] < uid)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static inline uint32_t uidset_slot_of(uint32_t uid, uint32_t cap)
+{
+    return hash_u32(uid) & (cap - 1);
+}
+
+/* slot holding uid, or the empty slot that ends its probe sequence */
+static uint32_t uidset_hash_search(const uidset_t *s, uint32_t uid)
+{
+    uint32_t mask = s->cap - 1, i;
+
+    for (i = uidset_slot_of(uid, s->cap); ; i = (i + 1) & mask)
+        if (s->v[i] == uid || s->v[i] == UIDSET_EMPTY)
+            return i;
+}
+
+static int uidset_rehash(uidset_t *s, uint32_t new_cap)
+{
+    uint32_t *old = s->v, old_cap = s->cap, old_len = s->len, *slot;
+    int was_hashed = s->hashed;
+
+    s->v = malloc(new_cap * sizeof(uint32_t));
+    if (!s->v) {
+        err("malloc: %s", strerror(errno));
+        s->v = old;
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < new_cap; i++)
+        s->v[i] = UIDSET_EMPTY;
+
+    s->cap = new_cap;
+    s->hashed = 1;
+
+    for (uint32_t i = 0; i < (was_hashed ? old_cap : old_len); i++) {
+        if (old[i] == UIDSET_EMPTY)
+            continue;
+
+        slot = &s->v[uidset_hash_search(s, old[i])];
+        *slot = old[i];
+    }
+
+    free(old);
+
+    return 0;
+}
+
+
+/*
+ * Exported functions
+ */
+
+int uidset_add(uidset_t *s, uint32_t uid)
+{
+    uint32_t i, *new_v;
+
+    if (s->hashed) {
+        i = uidset_hash_search(s, uid);
+        if (s->v[i] == uid)
+            return 1;
+
+        /* keep the load factor below 1/2 */
+        if (2 * (s->len + 1) > s->cap) {
+            if (uidset_rehash(s, 2 * s->cap) < 0)
+                return -1;
+            i = uidset_hash_search(s, uid);
+        }
+
+        s->v[i] = uid;
+        s->len++;
+
+        return 0;
+    }
+
+    i = uidset_vec_search(s, uid);
+    if (i < s->len && s->v[i] == uid)
+        return 1;
+
+    if (s->len + 1 >= UIDSET_HASH_THRESHOLD) {
+        if (uidset_rehash(s, 4 * UIDSET_HASH_THRESHOLD) < 0)
+            return -1;
+
+        return uidset_add(s, uid);
+    }
+
+    if (s->len == s->cap) {
+        new_v = realloc(s->v, (s->cap ? 2 * s->cap : UIDSET_MIN_CAP)
+                              * sizeof(uint32_t));
+        if (!new_v) {
+            err("realloc: %s", strerror(errno));
+            return -1;
+        }
+        s->v = new_v;
+        s->cap = s->cap ? 2 * s->cap : UIDSET_MIN_CAP;
+    }
+
+    memmove(&s->v[i + 1], &s->v[i], (s->len - i) * sizeof(uint32_t));
+    s->v[i] = uid;
+    s->len++;
+
+    return 0;
+}
+
+int uidset_remove(uidset_t *s, uint32_t uid)
+{
+    uint32_t mask, hole, i, home;
+
+    if (!s->hashed) {
+        i = uidset_vec_search(s, uid);
+        if (i == s->len || s->v[i] != uid)
+            return 1;
+
+        memmove(&s->v[i], &s->v[i + 1], (s->len - i - 1) * sizeof(uint32_t));
+        s->len--;
+
+        return 0;
+    }
+
+    hole = uidset_hash_search(s, uid);
+    if (s->v[hole] != uid)
+        return 1;
+
+    /* backward-shift deletion: keeps probe sequences without tombstones */
+    mask = s->cap - 1;
+    for (i = (hole + 1) & mask; s->v[i] != UIDSET_EMPTY; i = (i + 1) & mask) {
+        home = uidset_slot_of(s->v[i], s->cap);
+
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            s->v[hole] = s->v[i];
+            hole = i;
+        }
+    }
+
+    s->v[hole] = UIDSET_EMPTY;
+    s->len--;
+
+    return 0;
+}
+
+int uidset_contains(const uidset_t *s, uint32_t uid)
+{
+    uint32_t i;
+
+    if (s->hashed)
+        return s->v[uidset_hash_search(s, uid)] == uid;
+
+    i = uidset_vec_search(s, uid);
+
+    return i < s->len && s->v[i] == uid;
+}
+
+size_t uidset_copy(const uidset_t *s, uint32_t *out)
+{
+    size_t n = 0;
+
+    /* an empty set may have no vector yet */
+    if (!s->hashed) {
+        if (s->len)
+            memcpy(out, s->v, s->len * sizeof(uint32_t));
+        return s->len;
+    }
+
+    for (uint32_t i = 0; i < s->cap; i++)
+        if (s->v[i] != UIDSET_EMPTY)
+            out[n++] = s->v[i];
+
+    return n;
+}
+
+void uidset_free(uidset_t *s)
+{
+    free(s->v);
+
+    s->v = NULL;
+    s->len = 0;
+    s->cap = 0;
+    s->hashed = 0;
+}
@@ -27,21 +27,18 @@
  * Exported functions
  */
 
-int argv_parse(char *src, int *argc, char ***argv)
+int argv_parse(char *src, char **argv, size_t *argl, int max, int *argc)
 {
-    char *start_arg, *end_arg, **av;
-    int last = 0, ac;
+    char *start_arg, *end_arg;
+    int ac = 0;
 
-    av = *argv;
-    ac = 0;
+    *argc = 0;
 
     start_arg = src;
-    do {
-        if (*start_arg == ' ') {
-            /* discard continuos whitespaces */
-            while (*start_arg == ' ')
-                start_arg++;
-        }
+    while (1) {
+        /* discard continuos whitespaces */
+        while (*start_arg == ' ')
+            start_arg++;
 
         if (*start_arg == '\0') {
             /* no more arguments */
@@ -53,29 +50,28 @@ int argv_parse(char *src, int *argc, char ***argv)
             end_arg = strchr(++start_arg, '"');
             if (!end_arg)
                 return 0;
-        } else
+        } else {
             end_arg = strchr(start_arg, ' ');
+            if (!end_arg)
+                end_arg = start_arg + strlen(start_arg);
+        }
 
-        if (end_arg)
-            *end_arg = '\0';
-        else
-            last = 1;
-
-        av = realloc(av, (ac + 1) * sizeof(char *));
-        if (!av) {
-            err("realloc: %s", strerror(errno));
+        if (ac == max) {
+            dbg("argv_parse: more than %d arguments", max);
             return -1;
         }
 
+        dbg("argv_parse: arg #%d: %.*s", ac, (int) (end_arg - start_arg),
+            start_arg);
+        argv[ac] = start_arg;  /* store new arg */
+        if (argl)
+            argl[ac] = end_arg - start_arg;
+        *argc = ++ac;
 
-        dbg("argv_parse: arg #%d: %s", ac, start_arg);
-        av[ac++] = start_arg;  /* store new arg */
-
-        *argv = av;
-        *argc = ac;
+        if (*end_arg == '\0')
+            return 0;
 
+        *end_arg = '\0';
         start_arg = end_arg + 1;
-    } while (!last);
-
-    return 0;
+    }
 }
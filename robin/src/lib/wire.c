@@ -0,0 +1,252 @@
+/*
+ * wire.c
+ *
+ * Typed fields of binary frames: LEB128 varints, zigzag for signed integers,
+ * strings prefixed by their length and terminated for in place use.
+ *
+ * Luca Zulberti <l.zulberti@studenti.unipi.it>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "robin.h"
+#include "lib/wire.h"
+
+
+/*
+ * Log shortcuts
+ */
+
+#define err(fmt, args...)  robin_log_err(ROBIN_LOG_ID_UTILITY, fmt, ## args)
+#define warn(fmt, args...) robin_log_warn(ROBIN_LOG_ID_UTILITY, fmt, ## args)
+#define info(fmt, args...) robin_log_info(ROBIN_LOG_ID_UTILITY, fmt, ## args)
+#define dbg(fmt, args...)  robin_log_dbg(ROBIN_LOG_ID_UTILITY, fmt, ## args)
+
+
+/*
+ * Local types and macros
+ */
+
+#define WIRE_MIN_CAP    256
+#define WIRE_VARINT_MAX 10  /* bytes of a 64 bit varint */
+#define WIRE_DEC_MAX    20  /* digits and sign of a 64 bit integer */
+
+
+/*
+ * Local functions
+ */
+
+static inline void wire_put_varint(wire_buf_t *buf, uint64_t v)
+{
+    char *p = buf->data + buf->len;
+
+    while (v >= 0x80) {
+        *p++ = (char) (v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (char) v;
+
+    buf->len = p - buf->data;
+}
+
+
+/*
+ * Exported functions
+ */
+
+int wire_reserve(wire_buf_t *buf, size_t n)
+{
+    size_t cap;
+    char *data;
+
+    if (buf->len + n <= buf->cap)
+        return 0;
+
+    cap = buf->cap ? buf->cap : WIRE_MIN_CAP;
+    while (cap < buf->len + n)
+        cap *= 2;
+
+    data = realloc(buf->data, cap);
+    if (!data) {
+        err("realloc: %s", strerror(errno));
+        return -1;
+    }
+
+    buf->data = data;
+    buf->cap = cap;
+
+    return 0;
+}
+
+int wire_put_u8(wire_buf_t *buf, uint8_t v)
+{
+    if (wire_reserve(buf, 1) < 0)
+        return -1;
+
+    buf->data[buf->len++] = (char) v;
+
+    return 0;
+}
+
+int wire_put_uint(wire_buf_t *buf, uint64_t v)
+{
+    if (wire_reserve(buf, WIRE_VARINT_MAX) < 0)
+        return -1;
+
+    wire_put_varint(buf, v);
+
+    return 0;
+}
+
+int wire_put_int(wire_buf_t *buf, int64_t v)
+{
+    return wire_put_uint(buf, ((uint64_t) v << 1) ^ (uint64_t) (v >> 63));
+}
+
+int wire_put_str(wire_buf_t *buf, const char *s, size_t len)
+{
+    if (wire_reserve(buf, WIRE_VARINT_MAX + len + 1) < 0)
+        return -1;
+
+    wire_put_varint(buf, len);
+    memcpy(buf->data + buf->len, s, len);
+    buf->len += len;
+    buf->data[buf->len++] = '\0';
+
+    return 0;
+}
+
+int wire_put_bytes(wire_buf_t *buf, const void *s, size_t len)
+{
+    if (wire_reserve(buf, len) < 0)
+        return -1;
+
+    memcpy(buf->data + buf->len, s, len);
+    buf->len += len;
+
+    return 0;
+}
+
+int wire_put_dec(wire_buf_t *buf, int64_t v)
+{
+    char digits[WIRE_DEC_MAX], *p = digits + WIRE_DEC_MAX;
+    uint64_t u = v < 0 ? -(uint64_t) v : (uint64_t) v;
+
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
+
+    if (v < 0)
+        *--p = '-';
+
+    return wire_put_bytes(buf, p, digits + WIRE_DEC_MAX - p);
+}
+
+int wire_put_vfmt(wire_buf_t *buf, const char *fmt, va_list args)
+{
+    va_list args_copy;
+    int n;
+
+    /* room for the terminator at least */
+    if (wire_reserve(buf, 1) < 0)
+        return -1;
+
+    va_copy(args_copy, args);
+    n = vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, args_copy);
+    va_end(args_copy);
+    if (n < 0) {
+        err("vsnprintf: %s", strerror(errno));
+        return -1;
+    }
+
+    /* truncated, format again in the grown buffer */
+    if ((size_t) n >= buf->cap - buf->len) {
+        if (wire_reserve(buf, n + 1) < 0)
+            return -1;
+
+        if (vsnprintf(buf->data + buf->len, n + 1, fmt, args) < 0) {
+            err("vsnprintf: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    buf->len += n;
+
+    return 0;
+}
+
+void wire_buf_free(wire_buf_t *buf)
+{
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = buf->cap = 0;
+}
+
+void wire_rd_init(wire_rd_t *rd, char *frame, size_t len)
+{
+    rd->p = frame;
+    rd->end = frame + len;
+}
+
+int wire_get_u8(wire_rd_t *rd, uint8_t *v)
+{
+    if (rd->p >= rd->end)
+        return -1;
+
+    *v = (uint8_t) *rd->p++;
+
+    return 0;
+}
+
+int wire_get_uint(wire_rd_t *rd, uint64_t *v)
+{
+    uint64_t x = 0;
+    uint8_t b;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (rd->p >= rd->end)
+            return -1;
+
+        b = (uint8_t) *rd->p++;
+        x |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = x;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+int wire_get_int(wire_rd_t *rd, int64_t *v)
+{
+    uint64_t x;
+
+    if (wire_get_uint(rd, &x) < 0)
+        return -1;
+
+    *v = (int64_t) (x >> 1) ^ -(int64_t) (x & 1);
+
+    return 0;
+}
+
+int wire_get_str(wire_rd_t *rd, char **s, size_t *len)
+{
+    uint64_t n;
+
+    if (wire_get_uint(rd, &n) < 0)
+        return -1;
+
+    /* the string and its terminator must be inside the frame */
+    if (n >= (uint64_t) (rd->end - rd->p) || rd->p[n] != '\0')
+        return -1;
+
+    *s = rd->p;
+    if (len)
+        *len = n;
+    rd->p += n + 1;
+
+    return 0;
+}
@@ -6,15 +6,21 @@
  * Luca Zulberti <l.zulberti@studenti.unipi.it>
  */
 
-#include <stdarg.h>
+#include <arpa/inet.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 
 #include "robin.h"
 #include "robin_api.h"
+#include "robin_proto.h"
+#include "lib/lz4.h"
 #include "lib/socket.h"
 #include "lib/utility.h"
+#include "lib/wire.h"
 
 /*
  * Log shortcuts
@@ -31,6 +37,18 @@
  */
 
 #define ROBIN_REPLY_LINE_MAX_LEN 300
+#define ROBIN_CMD_MAX_LEN 300 /* as accepted by the server */
+#define ROBIN_CMD_ARGC_MAX (ROBIN_CMD_MAX_LEN / 2 + 1)
+
+#define ROBIN_API_UNIX_PREFIX "unix:" /* target of a local server */
+
+/* binary reply, strings point into buf */
+typedef struct ra_frame {
+    char *buf;
+    wire_rd_t rd; /* on the first record */
+    int n;        /* number of records, error code if < 0 */
+    char *msg;
+} ra_frame_t;
 
 
 /*
@@ -38,51 +56,86 @@
  */
 
 static int client_fd;
-static char *msg_buf = NULL, *reply_buf = NULL;
+static int ra_proto = ROBIN_PROTO_TEXT;
+static char *reply_buf = NULL;
+static wire_buf_t ra_out;   /* request frames, to be sent */
+static int ra_batch = 0;   /* requests are held until the batch is sent */
+
+/* compressed replies, the frames of the last packet are read from ra_in_pos */
+static int ra_zip = 0;
+static wire_buf_t ra_zip_in;
+static wire_buf_t ra_in;
+static size_t ra_in_pos = 0;
+
+/* cips pushed by the server, received while waiting for replies */
+static list_t *ra_push_head = NULL, *ra_push_tail = NULL;
+static unsigned int ra_push_lost = 0;
 
 
 /*
  * Local functions
  */
 
-static int ra_send(const char *fmt, ...)
+/* send the requests built so far */
+static int ra_send(void)
 {
-    va_list args;
-    int msg_len;
+    int ret;
 
-    va_start(args, fmt);
-    msg_len = vsnprintf(NULL, 0, fmt, args);
-    if (msg_len < 0) {
-        err("vsnprintf: %s", strerror(errno));
+    ret = socket_send_raw(client_fd, ra_out.data, ra_out.len);
+    ra_out.len = 0;
+    if (ret < 0) {
+        err("socket_send: failed to send data to socket");
         return -1;
     }
-    msg_len++;
-    va_end(args);
 
-    dbg("ra_send: msg_len=%d", msg_len);
+    return 0;
+}
+
+/* send the command in the protocol of the connection, or add it to the batch */
+static int ra_request(robin_op_t op, int argc, const char **argv)
+{
+    const char *name;
+    uint32_t len;
+    size_t hdr;
+    int quote;
 
-    msg_buf = realloc(msg_buf, msg_len * sizeof(char));
-    if (!msg_buf) {
-        err("realloc: %s", strerror(errno));
-        return -1;
-    }
+    dbg("ra_request: op=%d argc=%d", op, argc);
 
-    va_start(args, fmt);
-    if (vsnprintf(msg_buf, msg_len, fmt, args) < 0) {
-        err("vsnprintf: %s", strerror(errno));
+    /* the frame length is filled at the end */
+    hdr = ra_out.len;
+    if (wire_put_bytes(&ra_out, "\0\0\0\0", SOCKET_HDR_LEN) < 0)
         return -1;
-    }
-    va_end(args);
 
-    dbg("ra_send: msg_buf=%s", msg_buf);
+    if (ra_proto == ROBIN_PROTO_BINARY) {
+        if (wire_put_u8(&ra_out, op) < 0)
+            return -1;
 
-    /* do not send '\0' in msg */
-    if (socket_send(client_fd, msg_buf, msg_len - 1) < 0) {
-        err("socket_send: failed to send data to socket");
-        return -1;
+        for (int i = 0; i < argc; i++)
+            if (wire_put_str(&ra_out, argv[i], strlen(argv[i])) < 0)
+                return -1;
+    } else {
+        /* command line, arguments with spaces (or empty) are quoted */
+        name = robin_op_name(op);
+        if (wire_put_bytes(&ra_out, name, strlen(name)) < 0)
+            return -1;
+
+        for (int i = 0; i < argc; i++) {
+            quote = !*argv[i] || strchr(argv[i], ' ');
+
+            if (wire_put_bytes(&ra_out, " \"", quote ? 2 : 1) < 0
+                || wire_put_bytes(&ra_out, argv[i], strlen(argv[i])) < 0
+                || (quote && wire_put_bytes(&ra_out, "\"", 1) < 0))
+                return -1;
+        }
+
+        dbg("ra_request: msg=%.*s", (int) (ra_out.len - hdr - SOCKET_HDR_LEN),
+            ra_out.data + hdr + SOCKET_HDR_LEN);
     }
 
-    return 0;
+    len = htonl(ra_out.len - hdr - SOCKET_HDR_LEN);
+    memcpy(ra_out.data + hdr, &len, SOCKET_HDR_LEN);
+
+    return ra_batch ? 0 : ra_send();
 }
 
 void ra_free_reply(char **reply)
@@ -98,13 +151,339 @@ void ra_free_reply(char **reply)
     free(reply);
 }
 
+/* check if a whole frame is left by the last compressed packet */
+static int ra_in_frame(void)
+{
+    size_t avail = ra_in.len - ra_in_pos;
+    uint32_t len;
+
+    if (avail < SOCKET_HDR_LEN)
+        return 0;
+
+    memcpy(&len, ra_in.data + ra_in_pos, SOCKET_HDR_LEN);
+
+    return avail - SOCKET_HDR_LEN >= ntohl(len);
+}
+
+/* receive a compressed packet of len bytes, its frames go to ra_in */
+static int ra_unzip(size_t len)
+{
+    wire_rd_t rd;
+    uint64_t n;
+    size_t out;
+
+    ra_zip_in.len = 0;
+    if (wire_reserve(&ra_zip_in, len) < 0
+        || socket_recv_raw(client_fd, ra_zip_in.data, len))
+        return -1;
+
+    wire_rd_init(&rd, ra_zip_in.data, len);
+    if (wire_get_uint(&rd, &n) < 0 || n > INT_MAX) {
+        err("unzip: malformed packet");
+        return -1;
+    }
+
+    /* drop the frames already read, a cut one goes on in this packet */
+    if (ra_in_pos) {
+        memmove(ra_in.data, ra_in.data + ra_in_pos, ra_in.len - ra_in_pos);
+        ra_in.len -= ra_in_pos;
+        ra_in_pos = 0;
+    }
+
+    if (wire_reserve(&ra_in, n) < 0)
+        return -1;
+
+    out = n;
+    if (lz4_decompress(rd.p, rd.end - rd.p, ra_in.data + ra_in.len, &out) < 0
+        || out != n) {
+        err("unzip: malformed packet");
+        return -1;
+    }
+    ra_in.len += n;
+
+    dbg("unzip: %zu bytes in %zu", (size_t) n, len);
+
+    return 0;
+}
+
+/* receive a frame like socket_recv(), from the last compressed packet first */
+static int ra_recv(char **buf)
+{
+    uint32_t len;
+    char *msg;
+    int ret;
+
+    if (!ra_zip)
+        return socket_recv(client_fd, buf);
+
+    while (!ra_in_frame()) {
+        ret = socket_recv_raw(client_fd, &len, SOCKET_HDR_LEN);
+        if (ret)
+            return ret > 0 ? 0 : -1;
+
+        len = ntohl(len);
+        if (len & SOCKET_HDR_ZIP) {
+            if (ra_unzip(len & ~SOCKET_HDR_ZIP) < 0)
+                return -1;
+
+            continue;
+        }
+
+        /* a frame sent as it is */
+        if (ra_in_pos < ra_in.len || len > INT_MAX) {
+            err("recv: unexpected frame");
+            return -1;
+        }
+
+        msg = malloc(len + 1);
+        if (!msg) {
+            err("malloc: %s", strerror(errno));
+            return -1;
+        }
+
+        if (socket_recv_raw(client_fd, msg, len)) {
+            free(msg);
+            return -1;
+        }
+
+        msg[len] = '\0';
+        *buf = msg;
+
+        return len;
+    }
+
+    memcpy(&len, ra_in.data + ra_in_pos, SOCKET_HDR_LEN);
+    len = ntohl(len);
+
+    msg = malloc(len + 1);
+    if (!msg) {
+        err("malloc: %s", strerror(errno));
+        return -1;
+    }
+
+    memcpy(msg, ra_in.data + ra_in_pos + SOCKET_HDR_LEN, len);
+    msg[len] = '\0';
+    ra_in_pos += SOCKET_HDR_LEN + len;
+
+    *buf = msg;
+
+    return len;
+}
+
+/* parse a text cips_since record: ts user "msg" */
+static int ra_cip_parse(char *line, robin_cip_t *cip)
+{
+    char *cip_argv[3];
+    int cip_argc;
+
+    if (argv_parse(line, cip_argv, NULL, 3, &cip_argc) < 0 || cip_argc != 3) {
+        err("argv_parse: failed to parse the reply");
+        return -1;
+    }
+
+    cip->ts = strtol(cip_argv[0], NULL, 10);
+    cip->user = cip_argv[1];
+    cip->msg = cip_argv[2];
+    cip->free_ptr = line;
+
+    return 0;
+}
+
+/* decode n records of a binary cips_since reply */
+static int ra_cips_decode(ra_frame_t *frame, robin_cip_t *cs, int n)
+{
+    uint64_t ts;
+
+    for (int i = 0; i < n; i++) {
+        if (wire_get_uint(&frame->rd, &ts) < 0
+            || wire_get_str(&frame->rd, (char **) &cs[i].user, NULL) < 0
+            || wire_get_str(&frame->rd, (char **) &cs[i].msg, NULL) < 0)
+            return -1;
+
+        cs[i].ts = ts;
+        cs[i].free_ptr = NULL;
+    }
+
+    return 0;
+}
+
+/* keep a pushed cip for robin_api_push_get() */
+static int ra_push_queue(robin_cip_t *cip)
+{
+    list_t *el;
+
+    el = malloc(sizeof(list_t));
+    if (!el) {
+        err("malloc: %s", strerror(errno));
+        return -1;
+    }
+
+    el->ptr = cip;
+    el->next = NULL;
+
+    if (ra_push_tail)
+        ra_push_tail->next = el;
+    else
+        ra_push_head = el;
+    ra_push_tail = el;
+
+    return 0;
+}
+
+/* take the oldest pushed cip, return 0 if none */
+static int ra_push_pop(robin_cip_t *cip)
+{
+    list_t *el = ra_push_head;
+
+    if (!el)
+        return 0;
+
+    ra_push_head = el->next;
+    if (!ra_push_head)
+        ra_push_tail = NULL;
+
+    *cip = *(robin_cip_t *) el->ptr;
+    free(el->ptr);
+    free(el);
+
+    return 1;
+}
+
+/* store a binary push, the frame is consumed */
+static int ra_push_bin(ra_frame_t *frame)
+{
+    robin_cip_t *cip;
+
+    if (frame->n == ROBIN_PUSH_LOST) {
+        ra_push_lost += strtoul(frame->msg, NULL, 10);
+        free(frame->buf);
+        return 0;
+    }
+
+    cip = malloc(sizeof(robin_cip_t));
+    if (!cip) {
+        err("malloc: %s", strerror(errno));
+        free(frame->buf);
+        return -1;
+    }
+
+    /* user and message are left in the frame */
+    if (ra_cips_decode(frame, cip, 1) < 0) {
+        err("push: malformed cip");
+        free(cip);
+        free(frame->buf);
+        return -1;
+    }
+    cip->free_ptr = frame->buf;
+
+    if (ra_push_queue(cip) < 0) {
+        free(cip);
+        free(frame->buf);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* store a text push, whose status line is buf, consumed */
+static int ra_push_text(char *buf, int code)
+{
+    robin_cip_t *cip;
+    char *line, *p;
+
+    if (code == ROBIN_PUSH_LOST) {
+        p = strchr(buf, ' ');
+        if (p)
+            ra_push_lost += strtoul(p, NULL, 10);
+        free(buf);
+        return 0;
+    }
+
+    free(buf);
+
+    /* the record is in the next line */
+    if (ra_recv(&line) <= 0)
+        return -1;
+
+    cip = malloc(sizeof(robin_cip_t));
+    if (!cip) {
+        err("malloc: %s", strerror(errno));
+        free(line);
+        return -1;
+    }
+
+    if (ra_cip_parse(line, cip) < 0 || ra_push_queue(cip) < 0) {
+        free(cip);
+        free(line);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* receive a binary frame; return 1 if it was a push, stored */
+static int ra_recv_frame(ra_frame_t *frame)
+{
+    int64_t n;
+    int len;
+
+    len = ra_recv(&frame->buf);
+    if (len <= 0)
+        return -1;
+
+    wire_rd_init(&frame->rd, frame->buf, len);
+
+    if (wire_get_int(&frame->rd, &n) < 0
+        || wire_get_str(&frame->rd, &frame->msg, NULL) < 0) {
+        err("wait_frame: malformed reply");
+        free(frame->buf);
+        return -1;
+    }
+    frame->n = n;
+
+    dbg("wait_frame: n=%d msg=%s", frame->n, frame->msg);
+
+    if (frame->n == ROBIN_PUSH_CIP || frame->n == ROBIN_PUSH_LOST)
+        return ra_push_bin(frame) < 0 ? -1 : 1;
+
+    return 0;
+}
+
+/* receive a text status line; return 1 if it was a push, stored */
+static int ra_recv_line(char **buf)
+{
+    int code;
+
+    if (ra_recv(buf) <= 0)
+        return -1;
+
+    code = strtol(*buf, NULL, 10);
+    if (code == ROBIN_PUSH_CIP || code == ROBIN_PUSH_LOST)
+        return ra_push_text(*buf, code) < 0 ? -1 : 1;
+
+    return 0;
+}
+
+static int ra_wait_frame(ra_frame_t *frame)
+{
+    int ret;
+
+    /* pushes can come before the reply */
+    while ((ret = ra_recv_frame(frame)) == 1)
+        ;
+
+    return ret;
+}
+
 static int ra_wait_reply(char ***replies, int *nrep)
 {
     char *buf, **l;
     int n;
     int reply_ret;
 
-    n = socket_recv(client_fd, &buf);
+    /* pushes can come before the reply */
+    while ((n = ra_recv_line(&buf)) == 1)
+        ;
     if (n < 0)
         return -1;
 
@@ -130,7 +509,7 @@ static int ra_wait_reply(char ***replies, int *nrep)
 
     if (reply_ret > 0) {
         for (int i = 0; i < reply_ret; i++) {
-            n = socket_recv(client_fd, &buf);
+            n = ra_recv(&buf);
             if (n < 0) {
                 ra_free_reply(l);
                 return -1;
@@ -140,81 +519,485 @@ static int ra_wait_reply(char ***replies, int *nrep)
         }
     }
 
-    *replies = l;
-    *nrep = reply_ret;
+    *replies = l;
+    *nrep = reply_ret;
+
+    return 0;
+}
+
+/* wait for a reply made of the status line only, store its code */
+static int ra_wait_status(int *code)
+{
+    ra_frame_t frame;
+    char **replies;
+
+    if (ra_proto == ROBIN_PROTO_BINARY) {
+        if (ra_wait_frame(&frame) < 0)
+            return -1;
+
+        *code = frame.n;
+        free(frame.buf);
+
+        return 0;
+    }
+
+    if (ra_wait_reply(&replies, code) < 0)
+        return -1;
+
+    dbg("wait_status: reply: %s", replies[0]);
+
+    ra_free_reply(replies);
+
+    return 0;
+}
+
+
+/* decode the records of a binary hashtags_since reply */
+static int ra_hashtags_decode(ra_frame_t *frame, robin_hashtag_t *hs)
+{
+    uint64_t count;
+
+    for (int i = 0; i < frame->n; i++) {
+        if (wire_get_str(&frame->rd, (char **) &hs[i].tag, NULL) < 0
+            || wire_get_uint(&frame->rd, &count) < 0)
+            return -1;
+
+        hs[i].count = count;
+        hs[i].free_ptr = NULL;
+    }
+
+    return 0;
+}
+
+/* wait for the reply to followers */
+static int ra_wait_followers(robin_reply_t *reply)
+{
+    char **replies, **followers;
+    ra_frame_t frame;
+    int nrep, ret;
+
+    replies = NULL;
+
+    if (ra_proto == ROBIN_PROTO_BINARY) {
+        ret = ra_wait_frame(&frame);
+        if (ret)
+            return -1;
+
+        nrep = frame.n;
+        if (nrep < 0) {
+            free(frame.buf);
+            return nrep;
+        }
+
+        followers = malloc(nrep * sizeof(char *));
+        if (!followers) {
+            err("malloc: %s", strerror(errno));
+            free(frame.buf);
+            return -1;
+        }
+
+        /* the emails are left in the frame */
+        for (int i = 0; i < nrep; i++) {
+            if (wire_get_str(&frame.rd, &followers[i], NULL) < 0) {
+                err("followers: malformed reply");
+                free(followers);
+                free(frame.buf);
+                return -1;
+            }
+        }
+
+        reply->n = nrep;
+        reply->data = followers;
+        reply->free_ptr = frame.buf;
+
+        return 0;
+    }
+
+    ret = ra_wait_reply(&replies, &nrep);
+    if (ret)
+        return -1;
+
+    if (nrep < 0) {
+        ra_free_reply(replies);
+        return nrep;
+    }
+
+    /* free up first line and terminator pointer */
+    free(replies[0]);
+    free(replies[nrep + 1]);
+
+    followers = malloc(nrep * sizeof(char *));
+    if (!followers) {
+        err("malloc: %s", strerror(errno));
+        ra_free_reply(replies);
+        return -1;
+    }
+    memcpy(followers, &replies[1], nrep * sizeof(char *));
+
+    reply->n = nrep;
+    reply->data = followers;
+    reply->free_ptr = NULL;
+
+    /* free up the replies array (not the content) */
+    free(replies);
+
+    return 0;
+}
+
+/* wait for the reply to cips_since */
+static int ra_wait_cips(robin_reply_t *reply)
+{
+    robin_cip_t *cs;
+    ra_frame_t frame;
+    char **replies;
+    int nrep, ret;
+
+    replies = NULL;
+
+    if (ra_proto == ROBIN_PROTO_BINARY) {
+        ret = ra_wait_frame(&frame);
+        if (ret)
+            return -1;
+
+        nrep = frame.n;
+        if (nrep < 0) {
+            free(frame.buf);
+            return nrep;
+        }
+
+        cs = malloc(nrep * sizeof(robin_cip_t));
+        if (!cs) {
+            err("malloc: %s", strerror(errno));
+            free(frame.buf);
+            return -1;
+        }
+
+        /* users and messages are left in the frame */
+        if (ra_cips_decode(&frame, cs, nrep) < 0) {
+            err("cips_since: malformed reply");
+            free(cs);
+            free(frame.buf);
+            return -1;
+        }
+
+        reply->n = nrep;
+        reply->data = cs;
+        reply->free_ptr = frame.buf;
+
+        return 0;
+    }
+
+    ret = ra_wait_reply(&replies, &nrep);
+    if (ret)
+        return -1;
+
+    dbg("nrep=%d", nrep);
+
+    if (nrep < 0) {
+        ra_free_reply(replies);
+        return nrep;
+    }
+
+    /* free up first line and terminator pointer */
+    free(replies[0]);
+    free(replies[nrep + 1]);
+
+    cs = malloc(nrep * sizeof(robin_cip_t));
+    if (!cs) {
+        err("malloc: %s", strerror(errno));
+        ra_free_reply(replies);
+        return -1;
+    }
+
+    for (int i = 0; i < nrep; i++) {
+        if (ra_cip_parse(replies[i + 1], &cs[i]) < 0) {
+            ra_free_reply(replies);
+            free(cs);
+            return -1;
+        }
+    }
+
+    reply->n = nrep;
+    reply->data = cs;
+    reply->free_ptr = NULL;
+
+    /* free up the replies array (not the content) */
+    free(replies);
+
+    return 0;
+}
+
+/* wait for the reply to hashtags_since */
+static int ra_wait_hashtags(robin_reply_t *reply)
+{
+    robin_hashtag_t *hs;
+    ra_frame_t frame;
+    char **replies, *ht_argv[2];
+    int nrep, ht_argc, ret;
+
+    replies = NULL;
+
+    if (ra_proto == ROBIN_PROTO_BINARY) {
+        ret = ra_wait_frame(&frame);
+        if (ret)
+            return -1;
+
+        nrep = frame.n;
+        if (nrep < 0) {
+            free(frame.buf);
+            return nrep;
+        }
+
+        hs = malloc(nrep * sizeof(robin_hashtag_t));
+        if (!hs) {
+            err("malloc: %s", strerror(errno));
+            free(frame.buf);
+            return -1;
+        }
+
+        /* tags are left in the frame */
+        if (ra_hashtags_decode(&frame, hs) < 0) {
+            err("hashtags_since: malformed reply");
+            free(hs);
+            free(frame.buf);
+            return -1;
+        }
+
+        reply->n = nrep;
+        reply->data = hs;
+        reply->free_ptr = frame.buf;
+
+        return 0;
+    }
+
+    ret = ra_wait_reply(&replies, &nrep);
+    if (ret)
+        return -1;
+
+    if (nrep < 0) {
+        ra_free_reply(replies);
+        return nrep;
+    }
+
+    /* free up first line and terminator pointer */
+    free(replies[0]);
+    free(replies[nrep + 1]);
+
+    hs = malloc(nrep * sizeof(robin_hashtag_t));
+    if (!hs) {
+        err("malloc: %s", strerror(errno));
+        ra_free_reply(replies);
+        return -1;
+    }
+
+    for (int i = 0; i < nrep; i++) {
+        /* tag count */
+        if (argv_parse(replies[i + 1], ht_argv, NULL, 2, &ht_argc) < 0
+            || ht_argc != 2) {
+            err("argv_parse: failed to parse the reply");
+            ra_free_reply(replies);
+            free(hs);
+            return -1;
+        }
+
+        hs[i].tag = ht_argv[0];
+        hs[i].count = strtol(ht_argv[1], NULL, 10);
+        hs[i].free_ptr = replies[i + 1];
+    }
+
+    reply->n = nrep;
+    reply->data = hs;
+    reply->free_ptr = NULL;
+
+    /* free up the replies array (not the content) */
+    free(replies);
 
     return 0;
 }
 
+/* free a reply got by ra_wait_followers(), ra_wait_cips() or
+ * ra_wait_hashtags()
+ */
+static void ra_reply_free(robin_op_t op, robin_reply_t *reply)
+{
+    for (int i = 0; i < reply->n; i++) {
+        switch (op) {
+            case ROBIN_OP_FOLLOWERS:
+                /* the emails are in one buffer or allocated one by one */
+                if (!reply->free_ptr)
+                    free(((char **) reply->data)[i]);
+                break;
+
+            case ROBIN_OP_CIPS_SINCE:
+                free(((robin_cip_t *) reply->data)[i].free_ptr);
+                break;
+
+            case ROBIN_OP_HASHTAGS_SINCE:
+                free(((robin_hashtag_t *) reply->data)[i].free_ptr);
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    free(reply->free_ptr);
+    free(reply->data);
+}
+
 
 /*
  * Exported functions
  */
 
+int robin_api_connect(const char *target, unsigned short port, int *fd)
+{
+    size_t len = strlen(ROBIN_API_UNIX_PREFIX);
+
+    /* a local server is reached without the TCP stack, port is unused */
+    if (!strncmp(target, ROBIN_API_UNIX_PREFIX, len)) {
+        dbg("connect: local socket %s", target + len);
+        return socket_open_connect_unix(target + len, fd) ? -1 : 0;
+    }
+
+    dbg("connect: host %s port %hu", target, port);
+
+    return socket_open_connect(target, port, fd) ? -1 : 0;
+}
+
 int robin_api_init(int fd)
 {
+    const char *argv[] = { STR(ROBIN_PROTO_BINARY), "lz4" };
+    int code;
+
     client_fd = fd;
+    ra_proto = ROBIN_PROTO_TEXT;
+    ra_zip = 0;
+    ra_in.len = ra_in_pos = 0;
+
+    /* servers without compression refuse it, then the protocol alone is
+     * asked; servers without the binary protocol keep talking text
+     */
+    if (ra_request(ROBIN_OP_HELLO, 2, argv) < 0
+        || ra_wait_status(&code) < 0)
+        return -1;
+
+    ra_zip = code == 0;
+    if (!ra_zip && (ra_request(ROBIN_OP_HELLO, 1, argv) < 0
+                    || ra_wait_status(&code) < 0))
+        return -1;
+
+    if (code == 0)
+        ra_proto = ROBIN_PROTO_BINARY;
+
+    dbg("init: protocol version %d%s", ra_proto,
+        ra_zip ? ", lz4 compression" : "");
 
     return 0;
 }
 
 void robin_api_free(void)
 {
-    if (msg_buf) {
-        dbg("free: msg_buf=%p", msg_buf);
-        free(msg_buf);
-    }
+    robin_cip_t cip;
+
+    while (ra_push_pop(&cip))
+        free(cip.free_ptr);
+    ra_push_lost = 0;
 
     if (reply_buf) {
         dbg("free: reply_buf=%p", reply_buf);
         free(reply_buf);
     }
+
+    wire_buf_free(&ra_out);
+    wire_buf_free(&ra_zip_in);
+    wire_buf_free(&ra_in);
+    ra_in_pos = 0;
 }
 
 int robin_api_register(const char *email, const char *password)
 {
-    char **replies;
-    int nrep, ret;
+    const char *argv[] = { email, password };
+    int code;
 
     dbg("register: email=%s psw=%s", email, password);
 
-    ret = ra_send("register %s %s", email, password);
-    if (ret)
+    if (ra_request(ROBIN_OP_REGISTER, 2, argv) < 0
+        || ra_wait_status(&code) < 0)
         return -1;
 
-    ret = ra_wait_reply(&replies, &nrep);
-    if (ret)
-        return -1;
+    /* check for errors */
+    if (code < 0)
+        return code;
 
-    dbg("register: reply: %s", replies[0]);
+    return 0;
+}
 
-    ra_free_reply(replies);
+int robin_api_login(const char *email, const char *password)
+{
+    const char *argv[] = { email, password };
+    int code;
+
+    dbg("login: email=%s psw=%s", email, password);
+
+    if (ra_request(ROBIN_OP_LOGIN, 2, argv) < 0
+        || ra_wait_status(&code) < 0)
+        return -1;
 
     /* check for errors */
-    if (nrep < 0)
-        return nrep;
+    if (code < 0)
+        return code;
 
     return 0;
 }
 
-int robin_api_login(const char *email, const char *password)
+int robin_api_login_session(const char *email, const char *password,
+                            char *token)
 {
-    char **replies;
+    const char *argv[] = { email, password, "session" };
+    char **replies, *tok = NULL;
+    ra_frame_t frame;
     int nrep, ret;
 
-    dbg("login: email=%s psw=%s", email, password);
+    dbg("login_session: email=%s psw=%s", email, password);
 
-    ret = ra_send("login %s %s", email, password);
+    ret = ra_request(ROBIN_OP_LOGIN, 3, argv);
     if (ret)
         return -1;
 
-    ret = ra_wait_reply(&replies, &nrep);
-    if (ret)
-        return -1;
+    if (ra_proto == ROBIN_PROTO_BINARY) {
+        ret = ra_wait_frame(&frame);
+        if (ret)
+            return -1;
+
+        nrep = frame.n;
+        if (nrep == 1 && wire_get_str(&frame.rd, &tok, NULL) < 0) {
+            err("login_session: malformed reply");
+            free(frame.buf);
+            return -1;
+        }
+    } else {
+        ret = ra_wait_reply(&replies, &nrep);
+        if (ret)
+            return -1;
 
-    dbg("login: reply: %s", replies[0]);
+        dbg("login_session: reply: %s", replies[0]);
 
-    ra_free_reply(replies);
+        if (nrep == 1)
+            tok = replies[1];
+    }
+
+    /* the server may log in without opening the session */
+    if (nrep >= 0 && tok) {
+        strncpy(token, tok, ROBIN_SESSION_TOKEN_LEN);
+        token[ROBIN_SESSION_TOKEN_LEN] = '\0';
+    } else if (nrep >= 0)
+        *token = '\0';
+
+    if (ra_proto == ROBIN_PROTO_BINARY)
+        free(frame.buf);
+    else
+        ra_free_reply(replies);
 
     /* check for errors */
     if (nrep < 0)
@@ -223,24 +1006,49 @@ int robin_api_login(const char *email, const char *password)
     return 0;
 }
 
-int robin_api_logout(void)
+int robin_api_resume(const char *token, char *email, size_t len)
 {
-    char **replies;
+    char **replies, *msg, *user;
+    ra_frame_t frame;
     int nrep, ret;
 
-    dbg("logout");
+    dbg("resume: token=%s", token);
 
-    ret = ra_send("logout");
+    ret = ra_request(ROBIN_OP_RESUME, 1, &token);
     if (ret)
         return -1;
 
-    ret = ra_wait_reply(&replies, &nrep);
-    if (ret)
-        return -1;
+    if (ra_proto == ROBIN_PROTO_BINARY) {
+        ret = ra_wait_frame(&frame);
+        if (ret)
+            return -1;
+
+        nrep = frame.n;
+        msg = frame.msg;
+    } else {
+        ret = ra_wait_reply(&replies, &nrep);
+        if (ret)
+            return -1;
+
+        msg = replies[0];
+    }
 
-    dbg("logout: reply: %s", replies[0]);
+    dbg("resume: reply: %s", msg);
 
-    ra_free_reply(replies);
+    /* the email of the restored user is the last word of the reply */
+    if (nrep >= 0) {
+        user = strrchr(msg, ' ');
+        if (user) {
+            strncpy(email, user + 1, len - 1);
+            email[len - 1] = '\0';
+        } else
+            *email = '\0';
+    }
+
+    if (ra_proto == ROBIN_PROTO_BINARY)
+        free(frame.buf);
+    else
+        ra_free_reply(replies);
 
     /* check for errors */
     if (nrep < 0)
@@ -249,56 +1057,117 @@ int robin_api_logout(void)
     return 0;
 }
 
+int robin_api_logout(void)
+{
+    int code;
+
+    dbg("logout");
+
+    if (ra_request(ROBIN_OP_LOGOUT, 0, NULL) < 0
+        || ra_wait_status(&code) < 0)
+        return -1;
+
+    /* check for errors */
+    if (code < 0)
+        return code;
+
+    return 0;
+}
+
 int robin_api_follow(const char *emails, robin_reply_t *reply)
 {
-    char **replies;
-    int nrep, ret;
+    char **replies, *argv[ROBIN_CMD_ARGC_MAX], *buf, *s;
+    ra_frame_t frame;
+    int64_t code;
+    int argc, nrep, ret;
     int *results;
 
     dbg("follow: emails=%s", emails);
 
-    ret = ra_send("follow %s", emails);
-    if (ret)
+    /* one argument per email */
+    buf = strdup(emails);
+    if (!buf) {
+        err("strdup: %s", strerror(errno));
+        return -1;
+    }
+
+    if (argv_parse(buf, argv, NULL, ROBIN_CMD_ARGC_MAX, &argc) < 0) {
+        err("argv_parse: too many emails");
+        free(buf);
         return -1;
+    }
 
-    ret = ra_wait_reply(&replies, &nrep);
+    ret = ra_request(ROBIN_OP_FOLLOW, argc, (const char **) argv);
+    free(buf);
     if (ret)
         return -1;
 
-    dbg("follow: reply: %s", replies[0]);
+    if (ra_proto == ROBIN_PROTO_BINARY) {
+        ret = ra_wait_frame(&frame);
+        if (ret)
+            return -1;
+
+        nrep = frame.n;
+    } else {
+        ret = ra_wait_reply(&replies, &nrep);
+        if (ret)
+            return -1;
+
+        dbg("follow: reply: %s", replies[0]);
+    }
 
     /* check for errors */
     if (nrep < 0)
-        return nrep;
+        goto follow_quit;
 
     results = malloc(nrep * sizeof(int));
     if (!results) {
         err("malloc: %s", strerror(errno));
-        return -1;
+        nrep = -1;
+        goto follow_quit;
     }
 
     for (int i = 0; i < nrep; i++) {
-        char *res = strchr(replies[i + 1], ' ');
-        *(res++) = '\0';
+        if (ra_proto == ROBIN_PROTO_BINARY) {
+            /* email, result, reason */
+            if (wire_get_str(&frame.rd, &s, NULL) < 0
+                || wire_get_int(&frame.rd, &code) < 0
+                || wire_get_str(&frame.rd, &s, NULL) < 0) {
+                err("follow: malformed reply");
+                free(results);
+                nrep = -1;
+                goto follow_quit;
+            }
+
+            results[i] = code;
+        } else {
+            char *res = strchr(replies[i + 1], ' ');
+            *(res++) = '\0';
 
-        results[i] = strtol(res, NULL, 10);
+            results[i] = strtol(res, NULL, 10);
+        }
 
-        dbg("follow: user=%s res=%d", replies[i + 1], results[i]);
+        dbg("follow: res=%d", results[i]);
     }
 
     reply->n = nrep;
     reply->data = results;
+    reply->free_ptr = NULL;
 
-    ra_free_reply(replies);
+follow_quit:
+    if (ra_proto == ROBIN_PROTO_BINARY)
+        free(frame.buf);
+    else
+        ra_free_reply(replies);
 
     return nrep;
 }
 
 int robin_api_cip(const char *msg)
 {
-    char **replies, *msg_to_send, *next;
+    char *msg_to_send, *next;
     char const *last;
-    int nrep, len, delta, ret;
+    int len, delta, code, ret;
 
     dbg("cip: msg=%s", msg);
 
@@ -313,7 +1182,8 @@ int robin_api_cip(const char *msg)
         else
             delta = strlen(last);
 
-        msg_to_send = realloc(msg_to_send, len + delta);
+        /* room for the terminator */
+        msg_to_send = realloc(msg_to_send, len + delta + 1);
         if (!msg_to_send) {
             err("realloc: %s", strerror(errno));
             return -1;
@@ -330,211 +1200,190 @@ int robin_api_cip(const char *msg)
         last = next + 1;
     } while (next);
 
-    ret = ra_send("cip \"%.*s\"", len, msg_to_send);
-    if (ret) {
-        free(msg_to_send);
-        return -1;
-    }
+    msg_to_send[len] = '\0';
 
-    ret = ra_wait_reply(&replies, &nrep);
-    if (ret) {
-        free(msg_to_send);
+    ret = ra_request(ROBIN_OP_CIP, 1, (const char **) &msg_to_send);
+    free(msg_to_send);
+    if (ret)
         return -1;
-    }
 
-    free(msg_to_send);
-    ra_free_reply(replies);
+    if (ra_wait_status(&code) < 0)
+        return -1;
 
-    if (nrep < 0)
-        return nrep;
+    if (code < 0)
+        return code;
 
     return 0;
 }
 
 int robin_api_followers(robin_reply_t *reply)
 {
-    char **replies, **followers;
-    int nrep, ret;
-
-    replies = NULL;
-
     dbg("followers");
 
-    ret = ra_send("followers");
-    if (ret)
-        return -1;
-
-    ret = ra_wait_reply(&replies, &nrep);
-    if (ret)
-        return -1;
-
-    if (nrep < 0)
-        return nrep;
-
-    /* free up first line and terminator pointer */
-    free(replies[0]);
-    free(replies[nrep + 1]);
-
-    followers = malloc(nrep * sizeof(char *));
-    if (!followers) {
-        err("malloc: %s", strerror(errno));
-        ra_free_reply(replies);
+    if (ra_request(ROBIN_OP_FOLLOWERS, 0, NULL))
         return -1;
-    }
-    memcpy(followers, &replies[1], nrep * sizeof(char *));
-
-    reply->n = nrep;
-    reply->data = followers;
 
-    /* free up the replies array (not the content) */
-    free(replies);
-
-    return 0;
+    return ra_wait_followers(reply);
 }
 
 int robin_api_cips_since(time_t since, robin_reply_t *reply)
 {
-    robin_cip_t *cs;
-    char **replies, **cip_argv;
-    int nrep, cip_argc, ret;
+    char ts[24];
+    const char *argv[] = { ts };
 
     dbg("cips_since: since=%ld", since);
 
-    replies = NULL;
+    snprintf(ts, sizeof(ts), "%ld", since);
 
-    ret = ra_send("cips_since %ld", since);
-    if (ret)
+    if (ra_request(ROBIN_OP_CIPS_SINCE, 1, argv))
         return -1;
 
-    ret = ra_wait_reply(&replies, &nrep);
-    if (ret)
-        return -1;
+    return ra_wait_cips(reply);
+}
 
-    dbg("nrep=%d", nrep);
+int robin_api_hashtags_since(time_t since, robin_reply_t *reply)
+{
+    char ts[24];
+    const char *argv[] = { ts };
 
-    if (nrep < 0)
-        return nrep;
+    dbg("hashtags_since: since=%ld", since);
 
-    /* free up first line and terminator pointer */
-    free(replies[0]);
-    free(replies[nrep + 1]);
+    snprintf(ts, sizeof(ts), "%ld", since);
 
-    cs = malloc(nrep * sizeof(robin_cip_t));
-    if (!cs) {
-        err("malloc: %s", strerror(errno));
-        ra_free_reply(replies);
+    if (ra_request(ROBIN_OP_HASHTAGS_SINCE, 1, argv))
         return -1;
-    }
 
-    for (int i = 0; i < nrep; i++) {
-        cip_argv = NULL;
+    return ra_wait_hashtags(reply);
+}
 
-        if (argv_parse(replies[i + 1], &cip_argc, &cip_argv) < 0) {
-            err("argv_parse: failed to parse the reply");
-            ra_free_reply(replies);
-            free(cs);
-            return -1;
-        }
+int robin_api_home(time_t cips_since, time_t hashtags_since,
+                   robin_reply_t *followers, robin_reply_t *cips,
+                   robin_reply_t *hashtags)
+{
+    char cips_ts[24], hashtags_ts[24];
+    const char *batch_argv[] = { "3" };
+    const char *cips_argv[] = { cips_ts };
+    const char *hashtags_argv[] = { hashtags_ts };
+    int code, ret[3];
+
+    dbg("home: cips_since=%ld hashtags_since=%ld", cips_since, hashtags_since);
+
+    snprintf(cips_ts, sizeof(cips_ts), "%ld", cips_since);
+    snprintf(hashtags_ts, sizeof(hashtags_ts), "%ld", hashtags_since);
+
+    /* the requests are sent in one batch */
+    ra_out.len = 0;
+    ra_batch = 1;
+    code = ra_request(ROBIN_OP_BATCH, 1, batch_argv)
+           || ra_request(ROBIN_OP_FOLLOWERS, 0, NULL)
+           || ra_request(ROBIN_OP_CIPS_SINCE, 1, cips_argv)
+           || ra_request(ROBIN_OP_HASHTAGS_SINCE, 1, hashtags_argv);
+    ra_batch = 0;
+    if (code || ra_send() < 0)
+        return -1;
 
-        cs[i].ts = strtol(cip_argv[0], NULL, 10);
-        cs[i].user = cip_argv[1];
-        cs[i].msg = cip_argv[2];
-        cs[i].free_ptr = cip_argv[0];
+    /* servers without batches reply to the requests one by one anyway */
+    if (ra_wait_status(&code) < 0)
+        return -1;
 
-        /* free up the argv array (not the content) */
-        free(cip_argv);
-    }
+    dbg("home: batch code=%d", code);
 
-    reply->n = nrep;
-    reply->data = cs;
+    /* all the replies are read, even after a failed one */
+    ret[0] = ra_wait_followers(followers);
+    ret[1] = ra_wait_cips(cips);
+    ret[2] = ra_wait_hashtags(hashtags);
 
-    /* free up the replies array (not the content) */
-    free(replies);
+    if (!ret[0] && !ret[1] && !ret[2])
+        return 0;
 
-    return 0;
+    if (!ret[0])
+        ra_reply_free(ROBIN_OP_FOLLOWERS, followers);
+    if (!ret[1])
+        ra_reply_free(ROBIN_OP_CIPS_SINCE, cips);
+    if (!ret[2])
+        ra_reply_free(ROBIN_OP_HASHTAGS_SINCE, hashtags);
+
+    return ret[0] ? ret[0] : ret[1] ? ret[1] : ret[2];
 }
 
-int robin_api_hashtags_since(time_t since, robin_reply_t *reply)
+int robin_api_subscribe(void)
 {
-    robin_hashtag_t *hs;
-    char **replies, **ht_argv;
-    int nrep, ht_argc, ret;
-
-    dbg("hashtags_since: since=%ld", since);
+    int code;
 
-    replies = NULL;
+    dbg("subscribe");
 
-    ret = ra_send("hashtags_since %ld", since);
-    if (ret)
+    if (ra_request(ROBIN_OP_SUBSCRIBE, 0, NULL) < 0
+        || ra_wait_status(&code) < 0)
         return -1;
 
-    ret = ra_wait_reply(&replies, &nrep);
-    if (ret)
-        return -1;
+    if (code < 0)
+        return code;
 
-    if (nrep < 0)
-        return nrep;
+    return 0;
+}
 
-    /* free up first line and terminator pointer */
-    free(replies[0]);
-    free(replies[nrep + 1]);
+int robin_api_push_get(robin_cip_t *cip, int timeout)
+{
+    struct pollfd pfd;
+    ra_frame_t frame;
+    char *buf;
+    int ret;
+
+    /* nothing kept yet, wait for the server */
+    while (!ra_push_head && !ra_push_lost) {
+        pfd.fd = client_fd;
+        pfd.events = POLLIN;
+
+        /* frames left by a compressed packet need no wait */
+        ret = ra_in_frame() ? 1 : poll(&pfd, 1, timeout);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            err("poll: %s", strerror(errno));
+            return -1;
+        }
 
-    hs = malloc(nrep * sizeof(robin_hashtag_t));
-    if (!hs) {
-        err("malloc: %s", strerror(errno));
-        ra_free_reply(replies);
-        return -1;
-    }
+        if (ret == 0)
+            return 0;
 
-    for (int i = 0; i < nrep; i++) {
-        ht_argv = NULL;
+        if (ra_proto == ROBIN_PROTO_BINARY)
+            ret = ra_recv_frame(&frame);
+        else
+            ret = ra_recv_line(&buf);
 
-        if (argv_parse(replies[i + 1], &ht_argc, &ht_argv) < 0) {
-            err("argv_parse: failed to parse the reply");
-            ra_free_reply(replies);
-            free(hs);
+        if (ret < 0)
             return -1;
-        }
-
-        hs[i].tag = ht_argv[0];
-        hs[i].count = strtol(ht_argv[1], NULL, 10);
-        hs[i].free_ptr = ht_argv[0];
 
-        /* free up the argv array (not the content) */
-        free(ht_argv);
+        /* no request is waiting for it */
+        if (ret == 0) {
+            err("push_get: unexpected reply");
+            free(ra_proto == ROBIN_PROTO_BINARY ? frame.buf : buf);
+            return -1;
+        }
     }
 
-    reply->n = nrep;
-    reply->data = hs;
+    if (ra_push_pop(cip))
+        return 1;
 
-    /* free up the replies array (not the content) */
-    free(replies);
+    ra_push_lost = 0;
 
-    return 0;
+    return 2;
 }
 
 int robin_api_quit(void)
 {
-    char **replies;
-    int nrep, ret;
+    int code;
 
     dbg("quit");
 
-    ret = ra_send("quit");
-    if (ret)
-        return -1;
-
-    ret = ra_wait_reply(&replies, &nrep);
-    if (ret)
+    if (ra_request(ROBIN_OP_QUIT, 0, NULL) < 0
+        || ra_wait_status(&code) < 0)
         return -1;
 
-    dbg("quit: reply: %s", replies[0]);
-
-    ra_free_reply(replies);
-
     /* check for errors */
-    if (nrep < 0)
-        return nrep;
+    if (code < 0)
+        return code;
 
     return 0;
 }
@@ -57,11 +57,34 @@ static robin_cip_t *last_cip = NULL;
 static pthread_mutex_t cips_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 
+/*
+ * Local functions
+ */
+
+/*
+ * Get the cips sent after ts, from first to last. Cips are only appended and
+ * never change, so the ones up to the last stored can be read without lock.
+ */
+static void rcip_range(time_t ts, const robin_cip_t **first,
+                     const robin_cip_t **last)
+{
+    const robin_cip_t *cip;
+
+    pthread_mutex_lock(&cips_mutex);
+    *last = last_cip;
+    pthread_mutex_unlock(&cips_mutex);
+
+    *first = NULL;
+    for (cip = *last; cip && cip->ts > ts; cip = cip->prev)
+        *first = cip;
+}
+
+
 /*
  * Exported functions
  */
 
-int robin_cip_add(const char *user, const char *msg)
+int robin_cip_add(const char *user, const char *msg, robin_cip_exp_t *cip)
 {
     robin_cip_t *new_cip;
     char *hashtag, *ptr;
@@ -143,84 +166,70 @@ int robin_cip_add(const char *user, const char *msg)
 
     pthread_mutex_unlock(&cips_mutex);
 
+    if (cip) {
+        cip->ts = new_cip->ts;
+        cip->user = new_cip->user;
+        cip->msg = new_cip->msg;
+    }
+
     return 0;
 }
 
-int robin_cip_get_since(time_t ts, char **users, int ulen, list_t **cips, unsigned int *nums)
+void robin_cip_since(robin_cip_iter_t *it, time_t ts, char **users, int ulen)
 {
-    robin_cip_t *cip;
-    list_t *cip_list = NULL, *cip_el;
-    robin_cip_exp_t *ptr;
-    unsigned int n;
+    rcip_range(ts, &it->next, &it->last);
+    it->users = users;
+    it->ulen = ulen;
+}
 
-    pthread_mutex_lock(&cips_mutex);
+int robin_cip_next(robin_cip_iter_t *it, robin_cip_exp_t *cip)
+{
+    const robin_cip_t *next;
+    int i;
 
-    cip = last_cip;
-    n = 0;
-    while (cip && cip->ts > ts) {
+    while ((next = it->next)) {
+        it->next = next != it->last ? next->next : NULL;
 
-        int i;
-        for (i = 0; i < ulen; i++)
-            if (!strcmp(cip->user, users[i]))
+        for (i = 0; i < it->ulen; i++)
+            if (!strcmp(next->user, it->users[i]))
                 break;
 
         /* cip user not in filter */
-        if (i == ulen) {
-            cip = cip->prev;
+        if (i == it->ulen)
             continue;
-        }
-
-
-        cip_el = malloc(sizeof(list_t));
-        if (!cip_el) {
-            err("malloc: %s", strerror(errno));
-            return -1;
-        }
-        cip_el->ptr = malloc(sizeof(robin_cip_exp_t));
-        if (!cip_el->ptr) {
-            err("malloc: %s", strerror(errno));
-            return -1;
-        }
 
-        cip_el->next = cip_list;
-        ptr = (robin_cip_exp_t *) cip_el->ptr;
-        ptr->ts = cip->ts;
-        ptr->user = cip->user;
-        ptr->msg = cip->msg;
+        cip->ts = next->ts;
+        cip->user = next->user;
+        cip->msg = next->msg;
 
-        cip_list = cip_el;
-
-        cip = cip->prev;
-        n++;
+        return 1;
     }
 
-    pthread_mutex_unlock(&cips_mutex);
-
-    *cips = cip_list;
-    *nums = n;
-
     return 0;
 }
 
 int robin_hashtag_get_since(time_t ts, list_t **hashtags, unsigned int *nums)
 {
-    robin_cip_t *cip;
+    const robin_cip_t *cip, *first, *last;
     list_t *hashtag_list = NULL, *hashtag_el;
     robin_hashtag_exp_t *hashtag_ptr;
     unsigned int n;
+    size_t len;
 
-    pthread_mutex_lock(&cips_mutex);
+    rcip_range(ts, &first, &last);
 
-    cip = last_cip;
+    cip = first ? last : NULL;
     n = 0;
-    while (cip && cip->ts > ts) {
+    while (cip) {
         for (int i = 0; i < cip->hashtags_num; i++) {
-            /* search for already registered tag */
+            len = cip->hashtags[i].len;
+
+            /* search for already registered tag, not just a prefix */
             hashtag_el = hashtag_list;
             while (hashtag_el) {
                 hashtag_ptr = (robin_hashtag_exp_t *) hashtag_el->ptr;
-                if (!memcmp(hashtag_ptr->tag, cip->hashtags[i].tag,
-                            cip->hashtags[i].len))
+                if (!strncmp(hashtag_ptr->tag, cip->hashtags[i].tag, len)
+                    && hashtag_ptr->tag[len] == '\0')
                     break;
 
                 hashtag_el = hashtag_el->next;
@@ -259,11 +268,9 @@ int robin_hashtag_get_since(time_t ts, list_t **hashtags, unsigned int *nums)
             }
         }
 
-        cip = cip->prev;
+        cip = cip != first ? cip->prev : NULL;
     }
 
-    pthread_mutex_unlock(&cips_mutex);
-
     *hashtags = hashtag_list;
     *nums = n;
 
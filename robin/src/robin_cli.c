@@ -14,6 +14,7 @@
 #include "robin.h"
 #include "robin_api.h"
 #include "robin_cli.h"
+#include "robin_proto.h"
 #include "lib/utility.h"
 
 
@@ -33,6 +34,11 @@
 
 #define ROBIN_CLI_CIP_MAX_LEN 280
 #define ROBIN_CLI_EMAIL_LEN   64
+#define ROBIN_CLI_ARGC_MAX    2   /* the command name, one more is an error */
+
+/* commands of the CLI only, after the opcodes of the protocol */
+#define ROBIN_CLI_OP_HOME ROBIN_OP_MAX
+#define ROBIN_CLI_OP_MAX  (ROBIN_OP_MAX + 1)
 
 typedef enum robin_cli_cmd_ret {
     ROBIN_CMD_ERR = -1,
@@ -47,11 +53,14 @@ typedef struct robin_cli {
 
     /* Robin Command */
     int argc;
-    char **argv;
+    char *argv[ROBIN_CLI_ARGC_MAX];
+    size_t argl[ROBIN_CLI_ARGC_MAX];
 
     /* Robin User */
     int logged;
     char email[ROBIN_CLI_EMAIL_LEN];
+    char session[ROBIN_SESSION_TOKEN_LEN + 1];
+    int subscribed;
 } robin_cli_t;
 
 typedef struct robin_cli_cmd {
@@ -63,15 +72,10 @@ typedef struct robin_cli_cmd {
 #define ROBIN_CLI_CMD_FN(name, cli) \
     robin_cli_cmd_ret_t rc_cmd_##name(robin_cli_t *cli)
 #define ROBIN_CLI_CMD_FN_DECL(name) static ROBIN_CLI_CMD_FN(name,)
-#define ROBIN_CLI_CMD_ENTRY(cmd_name, cmd_desc) { \
-    .name = #cmd_name,                            \
-    .desc = cmd_desc,                             \
-    .fn = rc_cmd_##cmd_name                       \
-}
-#define ROBIN_CLI_CMD_ENTRY_NULL { \
-    .name = NULL,                  \
-    .desc = NULL,                  \
-    .fn = NULL                     \
+#define ROBIN_CLI_CMD_ENTRY(cmd_op, cmd_name, cmd_desc) [cmd_op] = { \
+    .name = #cmd_name,                                            \
+    .desc = cmd_desc,                                             \
+    .fn = rc_cmd_##cmd_name                                       \
 }
 
 
@@ -82,27 +86,41 @@ typedef struct robin_cli_cmd {
 ROBIN_CLI_CMD_FN_DECL(help);
 ROBIN_CLI_CMD_FN_DECL(register);
 ROBIN_CLI_CMD_FN_DECL(login);
+ROBIN_CLI_CMD_FN_DECL(resume);
 ROBIN_CLI_CMD_FN_DECL(logout);
 ROBIN_CLI_CMD_FN_DECL(follow);
 ROBIN_CLI_CMD_FN_DECL(cip);
 ROBIN_CLI_CMD_FN_DECL(home);
 ROBIN_CLI_CMD_FN_DECL(quit);
+ROBIN_CLI_CMD_FN_DECL(subscribe);
 
 
 /*
  * Local data
  */
 
-static robin_cli_cmd_t robin_cmds[] = {
-    ROBIN_CLI_CMD_ENTRY(help,     "print this help"),
-    ROBIN_CLI_CMD_ENTRY(register, "register to Robin with email and password"),
-    ROBIN_CLI_CMD_ENTRY(login,    "login to Robin with email and password"),
-    ROBIN_CLI_CMD_ENTRY(logout,   "logout from Robin"),
-    ROBIN_CLI_CMD_ENTRY(follow,   "follow the user identified by the email"),
-    ROBIN_CLI_CMD_ENTRY(cip,      "cip a message to Robin"),
-    ROBIN_CLI_CMD_ENTRY(home,     "print your Home page"),
-    ROBIN_CLI_CMD_ENTRY(quit,     "terminate the connection with the server"),
-    ROBIN_CLI_CMD_ENTRY_NULL /* terminator */
+/* indexed by opcode, protocol commands the CLI does not offer are empty */
+static robin_cli_cmd_t robin_cmds[ROBIN_CLI_OP_MAX] = {
+    ROBIN_CLI_CMD_ENTRY(ROBIN_OP_HELP,     help,
+                        "print this help"),
+    ROBIN_CLI_CMD_ENTRY(ROBIN_OP_REGISTER, register,
+                        "register to Robin with email and password"),
+    ROBIN_CLI_CMD_ENTRY(ROBIN_OP_LOGIN,    login,
+                        "login to Robin with email and password"),
+    ROBIN_CLI_CMD_ENTRY(ROBIN_OP_RESUME,   resume,
+                        "login to Robin with a session token"),
+    ROBIN_CLI_CMD_ENTRY(ROBIN_OP_LOGOUT,   logout,
+                        "logout from Robin"),
+    ROBIN_CLI_CMD_ENTRY(ROBIN_OP_FOLLOW,   follow,
+                        "follow the user identified by the email"),
+    ROBIN_CLI_CMD_ENTRY(ROBIN_OP_CIP,      cip,
+                        "cip a message to Robin"),
+    ROBIN_CLI_CMD_ENTRY(ROBIN_OP_QUIT,     quit,
+                        "terminate the connection with the server"),
+    ROBIN_CLI_CMD_ENTRY(ROBIN_OP_SUBSCRIBE, subscribe,
+                        "show new cips of the followed users as they come"),
+    ROBIN_CLI_CMD_ENTRY(ROBIN_CLI_OP_HOME, home,
+                        "print your Home page"),
 };
 
 static robin_cli_t *robin_cli;
@@ -125,6 +143,46 @@ static robin_cli_t *rcli_alloc()
     return cli;
 }
 
+/* NULL if the CLI has no command with that name */
+static robin_cli_cmd_t *rcli_cmd_lookup(const char *name, size_t len)
+{
+    int op;
+
+    op = robin_op_lookup(name, len);
+    if (op == ROBIN_OP_MAX) {
+        if (len != 4 || memcmp(name, "home", 4))
+            return NULL;
+
+        op = ROBIN_CLI_OP_HOME;
+    }
+
+    return robin_cmds[op].name ? &robin_cmds[op] : NULL;
+}
+
+/* print the cips pushed since the last prompt */
+static int rcli_print_pushed(void)
+{
+    robin_cip_t cip;
+    char date[32];
+    struct tm lt;
+    int ret;
+
+    while ((ret = robin_api_push_get(&cip, 0)) > 0) {
+        if (ret == 2) {
+            printf("some new cips were lost, see your Home page\n");
+            continue;
+        }
+
+        localtime_r(&cip.ts, &lt);
+        strftime(date, sizeof(date), "%F %T", &lt);
+
+        printf("new cip: %s, %s, %s\n", date, cip.user, cip.msg);
+        free(cip.free_ptr);
+    }
+
+    return ret;
+}
+
 static void rcli_free(robin_cli_t *cli)
 {
     if (cli->buf) {
@@ -132,11 +190,6 @@ static void rcli_free(robin_cli_t *cli)
         free(cli->buf);
     }
 
-    if (cli->argv) {
-        dbg("cli_free: argv=%p", cli->argv);
-        free(cli->argv);
-    }
-
     dbg("cli_free: cli=%p", cli);
     free(cli);
 }
@@ -150,8 +203,9 @@ ROBIN_CLI_CMD_FN(help, cli)
 {
     robin_cli_cmd_t *cmd;
 
-    for (cmd = robin_cmds; cmd->name != NULL; cmd++)
-        printf("%-10s \t%s\n", cmd->name, cmd->desc);
+    for (cmd = robin_cmds; cmd < robin_cmds + ROBIN_CLI_OP_MAX; cmd++)
+        if (cmd->name)
+            printf("%-10s \t%s\n", cmd->name, cmd->desc);
 
     return ROBIN_CMD_OK;
 }
@@ -254,7 +308,7 @@ ROBIN_CLI_CMD_FN(login, cli)
         return ROBIN_CMD_OK;
     }
 
-    ret = robin_api_login(email, psw);
+    ret = robin_api_login_session(email, psw, cli->session);
     if (ret < 0) switch (-ret) {
         case 1:
             err("server error, could not perform login");
@@ -291,6 +345,65 @@ ROBIN_CLI_CMD_FN(login, cli)
     free(psw);
 
     printf("login successfull\n");
+    if (*cli->session)
+        printf("session token: %s\n", cli->session);
+
+    return ROBIN_CMD_OK;
+}
+
+ROBIN_CLI_CMD_FN(resume, cli)
+{
+    char *token = NULL, *delim;
+    size_t len = 0;
+    int nread, ret;
+
+    if (cli->logged) {
+        printf("you are already logged in as %s\n", cli->email);
+        return ROBIN_CMD_OK;
+    }
+
+    printf("Insert the session token: ");
+
+    nread = getline(&token, &len, stdin);
+    if (nread < 0)
+        return ROBIN_CMD_ERR;
+
+    delim = strchr(token, ' ');
+    if (delim)
+        *delim = '\0';
+    else
+        token[nread - 1] = '\0';
+
+    dbg("resume: token=%s", token);
+
+    ret = robin_api_resume(token, cli->email, ROBIN_CLI_EMAIL_LEN);
+    if (ret < 0) switch (-ret) {
+        case 1:
+            err("server error, could not resume the session");
+            free(token);
+            return ROBIN_CMD_ERR;
+
+        case 3:
+            printf("the user is already logged in from another client\n");
+            free(token);
+            return ROBIN_CMD_OK;
+
+        case 4:
+            printf("invalid or expired session\n");
+            free(token);
+            return ROBIN_CMD_OK;
+
+        default:
+            err("unexpected error occurred");
+            free(token);
+            return ROBIN_CMD_ERR;
+    }
+
+    cli->logged = 1;
+    strncpy(cli->session, token, ROBIN_SESSION_TOKEN_LEN);
+    free(token);
+
+    printf("session resumed as %s\n", cli->email);
 
     return ROBIN_CMD_OK;
 }
@@ -323,7 +436,9 @@ ROBIN_CLI_CMD_FN(logout, cli)
 
     /* save login information */
     cli->logged = 0;
+    cli->subscribed = 0;
     *(cli->email) = '\0';
+    *(cli->session) = '\0';
 
     printf("logout successfull\n");
 
@@ -445,35 +560,15 @@ ROBIN_CLI_CMD_FN(home, cli)
         return ROBIN_CMD_OK;
     }
 
-    /* get my followers */
-    ret = robin_api_followers(&foll_reply);
+    /* get my followers, all cips sent in the last hour by the people i'm
+     * following and all hot topics mentioned in the last day by all the
+     * people, in one round trip
+     */
+    ret = robin_api_home(time(NULL) - 60 * 60, time(NULL) - 24 * 60 * 60,
+                         &foll_reply, &cips_reply, &hash_reply);
     if (ret < 0) switch (-ret) {
         case 1:
-            err("server error, could not retrieve followers");
-            return ROBIN_CMD_ERR;
-
-        default:
-            err("unexpected error occurred");
-            return ROBIN_CMD_ERR;
-    }
-
-    /* get all cips sent in the last hour by the people i'm following */
-    ret = robin_api_cips_since(time(NULL) - 60 * 60, &cips_reply);
-    if (ret < 0) switch (-ret) {
-        case 1:
-            err("server error, could not retrieve cips");
-            return ROBIN_CMD_ERR;
-
-        default:
-            err("unexpected error occurred");
-            return ROBIN_CMD_ERR;
-    }
-
-    /* get all hot topics mentioned in the last day by all the people */
-    ret = robin_api_hashtags_since(time(NULL) - 24 * 60 * 60, &hash_reply);
-    if (ret < 0) switch (-ret) {
-        case 1:
-            err("server error, could not retrieve hashtags");
+            err("server error, could not retrieve the home");
             return ROBIN_CMD_ERR;
 
         default:
@@ -493,10 +588,13 @@ ROBIN_CLI_CMD_FN(home, cli)
             printf("\t%s\n", followers[i]);
     }
 
-    for (int i = 0; i < foll_reply.n; i++)
-        free(followers[i]);
-    if (foll_reply.n)
-        free(foll_reply.data);
+    /* the emails are in one buffer or allocated one by one */
+    if (foll_reply.free_ptr)
+        free(foll_reply.free_ptr);
+    else
+        for (int i = 0; i < foll_reply.n; i++)
+            free(followers[i]);
+    free(foll_reply.data);
 
     printf("- - - - - - - - - - - - -\n");
 
@@ -514,6 +612,7 @@ ROBIN_CLI_CMD_FN(home, cli)
             err("strftime: %s", strerror(errno));
             for (int i = 0; i < cips_reply.n; i++)
                 free(cips[i].free_ptr);
+            free(cips_reply.free_ptr);
             free(foll_reply.data);
             return -1;
         }
@@ -523,8 +622,8 @@ ROBIN_CLI_CMD_FN(home, cli)
 
     for (int i = 0; i < cips_reply.n; i++)
         free(cips[i].free_ptr);
-    if (cips_reply.n)
-        free(cips_reply.data);
+    free(cips_reply.free_ptr);
+    free(cips_reply.data);
 
     printf("- - - - - - - - - - - - -\n");
 
@@ -536,8 +635,8 @@ ROBIN_CLI_CMD_FN(home, cli)
 
     for (int i = 0; i < hash_reply.n; i++)
         free(hashtags[i].free_ptr);
-    if (hash_reply.n)
-        free(hash_reply.data);
+    free(hash_reply.free_ptr);
+    free(hash_reply.data);
 
     printf("-------------------------\n");
 
@@ -559,6 +658,39 @@ ROBIN_CLI_CMD_FN(quit, cli)
     return ROBIN_CMD_QUIT;
 }
 
+ROBIN_CLI_CMD_FN(subscribe, cli)
+{
+    int ret;
+
+    if (!cli->logged) {
+        printf("you must login first\n");
+        return ROBIN_CMD_OK;
+    }
+
+    ret = robin_api_subscribe();
+    if (ret < 0) switch (-ret) {
+        case 1:
+            err("server error, could not subscribe");
+            return ROBIN_CMD_ERR;
+
+        case 2:
+            printf("you must login first\n");
+            cli->logged = 0;
+            *(cli->email) = '\0';
+            return ROBIN_CMD_OK;
+
+        default:
+            err("unexpected error occurred");
+            return ROBIN_CMD_ERR;
+    }
+
+    cli->subscribed = 1;
+
+    printf("new cips of the followed users will be shown at the prompt\n");
+
+    return ROBIN_CMD_OK;
+}
+
 
 /*
  * Exported functions
@@ -567,6 +699,7 @@ ROBIN_CLI_CMD_FN(quit, cli)
 void robin_cli_manage(int fd)
 {
     ssize_t nread;
+    int ret;
     robin_cli_t *cli;
     robin_cli_cmd_t *cmd;
 
@@ -576,9 +709,17 @@ void robin_cli_manage(int fd)
         return;
 
     robin_cli = cli;
-    robin_api_init(fd);
+    if (robin_api_init(fd) < 0) {
+        err("could not initialize the connection with the server");
+        goto manager_quit;
+    }
 
     while (1) {
+        if (cli->subscribed && rcli_print_pushed() < 0) {
+            err("could not receive the new cips");
+            goto manager_quit;
+        }
+
         if (cli->logged)
             printf("robin (%s)> ", cli->email);
         else
@@ -603,13 +744,11 @@ void robin_cli_manage(int fd)
         dbg("command received: \"%s\"", cli->buf);
 
         /* parse the command in argc-argv form and store it in cli */
-        if (argv_parse(cli->buf, &cli->argc, &cli->argv) < 0) {
-            err("argv_parse: failed to parse command");
-            goto manager_quit;
-        }
+        ret = argv_parse(cli->buf, cli->argv, cli->argl, ROBIN_CLI_ARGC_MAX,
+                         &cli->argc);
 
         /* only the command name must be provided */
-        if (cli->argc > 1) {
+        if (ret < 0 || cli->argc > 1) {
             warn("invalid command");
             continue;
         }
@@ -618,25 +757,22 @@ void robin_cli_manage(int fd)
         if (cli->argc < 1)
             continue;
 
-        /* search for the command */
-        for (cmd = robin_cmds; cmd->name != NULL; cmd++) {
-            if (!strcmp(cli->argv[0], cmd->name)) {
-                /* execute cmd and evaluate the returned value */
-                switch (cmd->fn(cli)) {
-                    case ROBIN_CMD_OK:
-                        break;
-
-                    case ROBIN_CMD_ERR:
-                        err("failed to execute the requested command");
-                    case ROBIN_CMD_QUIT:
-                        goto manager_quit;
-                }
-                break;
-            }
+        cmd = rcli_cmd_lookup(cli->argv[0], cli->argl[0]);
+        if (!cmd) {
+            warn("invalid command; type help for the list of availble commands");
+            continue;
         }
 
-        if (cmd->name == NULL)
-            warn("invalid command; type help for the list of availble commands");
+        /* execute cmd and evaluate the returned value */
+        switch (cmd->fn(cli)) {
+            case ROBIN_CMD_OK:
+                break;
+
+            case ROBIN_CMD_ERR:
+                err("failed to execute the requested command");
+            case ROBIN_CMD_QUIT:
+                goto manager_quit;
+        }
     }
 
 manager_quit:
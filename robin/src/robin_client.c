@@ -10,6 +10,7 @@
 #include <stdlib.h>
 
 #include "robin.h"
+#include "robin_api.h"
 #include "robin_cli.h"
 #include "lib/socket.h"
 
@@ -44,8 +45,10 @@ static void welcome(void)
 static void usage(void)
 {
     puts("usage: robin_client <host> <port>");
+    puts("       robin_client unix:<path>");
     puts("\thost: remote hostname where the client will try to connect to");
     puts("\tport: remote port");
+    puts("\tpath: local socket of a server on this machine");
 }
 
 
@@ -56,7 +59,7 @@ static void usage(void)
 int main(int argc, char **argv)
 {
     char *h_name;
-    int port;
+    int port = 0;
     int client_fd;
 
     welcome();
@@ -66,23 +69,26 @@ int main(int argc, char **argv)
      * Argument parsing
      */
 
-    if (argc != 3) {
+    if (argc != 3 && !(argc == 2 && !strncmp(argv[1], "unix:", 5))) {
         err("invalid number of arguments.");
         usage();
         exit(EXIT_FAILURE);
     }
 
     h_name = argv[1];
-    port = atoi(argv[2]);
-
-    info("remote address is %s and port is %d", h_name, port);
+    if (argc == 3) {
+        port = atoi(argv[2]);
+        info("remote address is %s and port is %d", h_name, port);
+    } else {
+        info("remote address is %s", h_name);
+    }
 
 
     /*
      * Socket creation and listening
      */
 
-    if (socket_open_connect(h_name, port, &client_fd) < 0) {
+    if (robin_api_connect(h_name, port, &client_fd) < 0) {
         err("failed to connect to the Robin Server");
         exit(EXIT_FAILURE);
     }
@@ -6,16 +6,28 @@
  * Luca Zulberti <l.zulberti@studenti.unipi.it>
  */
 
+#include <arpa/inet.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <pthread.h>
 
 #include "robin.h"
 #include "robin_cip.h"
 #include "robin_conn.h"
+#include "robin_proto.h"
+#include "robin_session.h"
 #include "robin_user.h"
+#include "lib/lz4.h"
 #include "lib/socket.h"
 #include "lib/utility.h"
+#include "lib/wire.h"
 
 
 /*
@@ -35,7 +47,13 @@
 #define ROBIN_CONN_MAX 64
 #define ROBIN_CONN_BIGCMD_THRESHOLD 5
 #define ROBIN_CONN_CMD_MAX_LEN 300
+#define ROBIN_CONN_ARGC_MAX (ROBIN_CONN_CMD_MAX_LEN / 2 + 1) /* "a a a..." */
 #define ROBIN_CONN_CIP_MAX_LEN 280
+#define ROBIN_CONN_SUGGEST_K 10
+#define ROBIN_CONN_SUGGEST_MAX 100
+#define ROBIN_CONN_OUT_FLUSH_LEN 65536 /* streamed replies are sent from here */
+#define ROBIN_CONN_PUSH_MAX 64 /* cips waiting to be pushed, then dropped */
+#define ROBIN_CONN_ZIP_MIN_LEN 512 /* sends compressed from this length */
 
 typedef enum robin_conn_cmd_ret {
     ROBIN_CMD_ERR = -1,
@@ -45,20 +63,43 @@ typedef enum robin_conn_cmd_ret {
 
 typedef struct robin_conn {
     int fd; /* socket file descriptor */
+    int proto; /* ROBIN_PROTO_* */
+
+    /* Robin reply, both buffers are reused by every command */
+    wire_buf_t line; /* binary reply lines are formatted here first */
+    wire_buf_t out;  /* reply frames, to be sent */
+    int bin_status;  /* the binary reply has got its status */
+    size_t bin_hdr;  /* offset of the binary reply frame in out */
+    int bin_stream;  /* the binary reply length is sent, records go as built */
+    size_t bin_left; /* bytes of the streamed binary reply not sent yet */
 
-    /* Robin reply */
-    char *reply;
+    /* Robin compression, negotiated by hello */
+    lz4_ctx_t *zip;     /* NULL if the replies are sent as they are */
+    wire_buf_t zip_out; /* compressed packet of the replies to send */
+    int zip_cont;       /* the last one ended inside a reply frame */
 
     /* Robin Log */
     int log_id;
 
-    /* Robin Command */
+    /* Robin Command, pointing into the received frame */
+    char in[ROBIN_CONN_CMD_MAX_LEN + 1]; /* the frame, '\0' terminated */
     int argc;
-    char **argv;
+    char *argv[ROBIN_CONN_ARGC_MAX];
+    size_t argl[ROBIN_CONN_ARGC_MAX];
+    int batch; /* commands of the running batch still to be run */
+    int big_cmd_count; /* oversized commands received */
 
     /* Robin User */
     int logged;
     int uid;
+    char session[ROBIN_SESSION_TOKEN_LEN + 1]; /* empty if no session */
+
+    /* Robin push, the queue is under rc_push_mutex */
+    int push_fd; /* eventfd signaling new cips, -1 if not subscribed */
+    robin_cip_exp_t push[ROBIN_CONN_PUSH_MAX];
+    unsigned int push_head;
+    unsigned int push_len;
+    unsigned int push_lost;
 } robin_conn_t;
 
 typedef struct robin_conn_cmd {
@@ -71,12 +112,13 @@ typedef struct robin_conn_cmd {
 #define ROBIN_CONN_CMD_FN(name, conn) \
     robin_conn_cmd_ret_t rc_cmd_##name(robin_conn_t *conn)
 #define ROBIN_CONN_CMD_FN_DECL(name) static ROBIN_CONN_CMD_FN(name,)
-#define ROBIN_CONN_CMD_ENTRY(cmd_name, cmd_usage, cmd_desc) { \
-    .name = #cmd_name,                                        \
-    .usage = cmd_usage,                                       \
-    .desc = cmd_desc,                                         \
-    .fn = rc_cmd_##cmd_name                                   \
-}
+#define ROBIN_CONN_CMD_ENTRY(cmd_op, cmd_name, cmd_usage, cmd_desc) \
+    [cmd_op] = {                                                    \
+        .name = #cmd_name,                                          \
+        .usage = cmd_usage,                                         \
+        .desc = cmd_desc,                                           \
+        .fn = rc_cmd_##cmd_name                                     \
+    }
 #define ROBIN_CONN_CMD_ENTRY_NULL { \
     .name = NULL,                   \
     .usage = NULL,                  \
@@ -90,54 +132,89 @@ typedef struct robin_conn_cmd {
  */
 
 ROBIN_CONN_CMD_FN_DECL(help);
+ROBIN_CONN_CMD_FN_DECL(hello);
 ROBIN_CONN_CMD_FN_DECL(register);
 ROBIN_CONN_CMD_FN_DECL(login);
+ROBIN_CONN_CMD_FN_DECL(resume);
 ROBIN_CONN_CMD_FN_DECL(logout);
 ROBIN_CONN_CMD_FN_DECL(follow);
 ROBIN_CONN_CMD_FN_DECL(unfollow);
 ROBIN_CONN_CMD_FN_DECL(following);
 ROBIN_CONN_CMD_FN_DECL(followers);
+ROBIN_CONN_CMD_FN_DECL(suggest);
+ROBIN_CONN_CMD_FN_DECL(mutuals);
+ROBIN_CONN_CMD_FN_DECL(common);
 ROBIN_CONN_CMD_FN_DECL(cip);
 ROBIN_CONN_CMD_FN_DECL(cips_since);
 ROBIN_CONN_CMD_FN_DECL(hashtags_since);
 ROBIN_CONN_CMD_FN_DECL(quit);
+ROBIN_CONN_CMD_FN_DECL(subscribe);
+ROBIN_CONN_CMD_FN_DECL(batch);
 
 
 /*
  * Local data
  */
 
-static robin_conn_cmd_t robin_cmds[] = {
-    ROBIN_CONN_CMD_ENTRY(help, "",
+/* indexed by opcode */
+static robin_conn_cmd_t robin_cmds[ROBIN_OP_MAX + 1] = {
+    ROBIN_CONN_CMD_ENTRY(ROBIN_OP_HELP, help, "",
                          "print this help"),
-    ROBIN_CONN_CMD_ENTRY(register, "<email> <password>",
+    ROBIN_CONN_CMD_ENTRY(ROBIN_OP_HELLO, hello, "<version> [lz4]",
+                         "switch the connection to the protocol version "
+                         "(1 text, 2 binary), optionally compressing the "
+                         "replies"),
+    ROBIN_CONN_CMD_ENTRY(ROBIN_OP_REGISTER, register, "<email> <password>",
                          "register to Robin with email and password"),
-    ROBIN_CONN_CMD_ENTRY(login, "<email> <password>",
-                         "login to Robin with email and password"),
-    ROBIN_CONN_CMD_ENTRY(logout, "",
+    ROBIN_CONN_CMD_ENTRY(ROBIN_OP_LOGIN, login, "<email> <password> [session]",
+                         "login to Robin with email and password, "
+                         "optionally opening a session"),
+    ROBIN_CONN_CMD_ENTRY(ROBIN_OP_RESUME, resume, "<token>",
+                         "login to Robin restoring a session"),
+    ROBIN_CONN_CMD_ENTRY(ROBIN_OP_LOGOUT, logout, "",
                          "logout from Robin"),
-    ROBIN_CONN_CMD_ENTRY(follow, "<email>",
+    ROBIN_CONN_CMD_ENTRY(ROBIN_OP_FOLLOW, follow, "<email>",
                          "follow the user identified by the email"),
-    ROBIN_CONN_CMD_ENTRY(unfollow, "<email>",
+    ROBIN_CONN_CMD_ENTRY(ROBIN_OP_UNFOLLOW, unfollow, "<email>",
                          "unfollow the user identified by the email"),
-    ROBIN_CONN_CMD_ENTRY(following, "",
+    ROBIN_CONN_CMD_ENTRY(ROBIN_OP_FOLLOWING, following, "",
                          "list following users"),
-    ROBIN_CONN_CMD_ENTRY(followers, "",
+    ROBIN_CONN_CMD_ENTRY(ROBIN_OP_FOLLOWERS, followers, "",
                          "list followers users"),
-    ROBIN_CONN_CMD_ENTRY(cip, "<msg string>",
+    ROBIN_CONN_CMD_ENTRY(ROBIN_OP_SUGGEST, suggest, "[k]",
+                         "suggest up to k (default " STR(ROBIN_CONN_SUGGEST_K)
+                         ") users to follow"),
+    ROBIN_CONN_CMD_ENTRY(ROBIN_OP_MUTUALS, mutuals, "",
+                         "list followed users which follow you back"),
+    ROBIN_CONN_CMD_ENTRY(ROBIN_OP_COMMON, common,
+                         "<email> [following|followers]",
+                         "list users followed (or following) by both you "
+                         "and the user identified by the email"),
+    ROBIN_CONN_CMD_ENTRY(ROBIN_OP_CIP, cip, "<msg string>",
                          "cip a message to Robin"),
-    ROBIN_CONN_CMD_ENTRY(cips_since, "<ts>",
+    ROBIN_CONN_CMD_ENTRY(ROBIN_OP_CIPS_SINCE, cips_since, "<ts>",
                          "return the cips sent after timestamp"),
-    ROBIN_CONN_CMD_ENTRY(hashtags_since, "<ts>",
+    ROBIN_CONN_CMD_ENTRY(ROBIN_OP_HASHTAGS_SINCE, hashtags_since, "<ts>",
                          "return the hastags found in cips sent after timestamp"),
-    ROBIN_CONN_CMD_ENTRY(quit, "",
+    ROBIN_CONN_CMD_ENTRY(ROBIN_OP_QUIT, quit, "",
                          "terminate the connection with the server"),
-    ROBIN_CONN_CMD_ENTRY_NULL /* terminator */
+    ROBIN_CONN_CMD_ENTRY(ROBIN_OP_SUBSCRIBE, subscribe, "",
+                         "receive the new cips of the followed users as they "
+                         "are sent, until logout"),
+    ROBIN_CONN_CMD_ENTRY(ROBIN_OP_BATCH, batch, "<k>",
+                         "run the k commands following, replying to all of "
+                         "them at once"),
+    [ROBIN_OP_MAX] = ROBIN_CONN_CMD_ENTRY_NULL /* terminator */
 };
 
 /* for gracefully termination */
 static robin_conn_t *robin_conns[ROBIN_CONN_MAX];
 
+/* subscribed connections */
+static robin_conn_t *rc_subs[ROBIN_CONN_MAX];
+static int rc_subs_num = 0;
+static pthread_mutex_t rc_push_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 
 /*
  * Local functions
@@ -154,67 +231,614 @@ static robin_conn_t *rc_alloc(int log_id, int fd)
     }
 
     conn->fd = fd;
+    conn->proto = ROBIN_PROTO_TEXT;
     conn->log_id = log_id;
+    conn->push_fd = -1;
 
     return conn;
 }
 
 static void rc_free(robin_conn_t *conn)
 {
-    if (conn->reply) {
-        dbg("conn_free: reply=%p", conn->reply);
-        free(conn->reply);
+    wire_buf_free(&conn->line);
+    wire_buf_free(&conn->out);
+    wire_buf_free(&conn->zip_out);
+    free(conn->zip);
+
+    dbg("conn_free: conn=%p", conn);
+    free(conn);
+}
+
+/* compress the reply frames built so far into one packet */
+static int rc_zip(robin_conn_t *conn)
+{
+    wire_buf_t *zip = &conn->zip_out;
+    uint32_t len;
+
+    /* the length of the frames, then the LZ4 block */
+    zip->len = 0;
+    if (wire_put_bytes(zip, "\0\0\0\0", SOCKET_HDR_LEN) < 0
+        || wire_put_uint(zip, conn->out.len) < 0
+        || wire_reserve(zip, lz4_bound(conn->out.len)) < 0)
+        return -1;
+
+    zip->len += lz4_compress(conn->zip, conn->out.data, conn->out.len,
+                             zip->data + zip->len);
+
+    len = htonl((zip->len - SOCKET_HDR_LEN) | SOCKET_HDR_ZIP);
+    memcpy(zip->data, &len, SOCKET_HDR_LEN);
+
+    dbg("zip: %zu bytes in %zu", conn->out.len, zip->len);
+
+    return 0;
+}
+
+/* send the reply built so far, if any */
+static int rc_send(robin_conn_t *conn)
+{
+    int ret, zip;
+
+    if (!conn->out.len)
+        return 0;
+
+    /* small sends are not worth it, unless the client is inside a frame */
+    zip = conn->zip && (conn->out.len >= ROBIN_CONN_ZIP_MIN_LEN
+                        || conn->zip_cont);
+    if (zip && rc_zip(conn) < 0)
+        return -1;
+
+    if (zip)
+        ret = socket_send_raw(conn->fd, conn->zip_out.data, conn->zip_out.len);
+    else
+        ret = socket_send_raw(conn->fd, conn->out.data, conn->out.len);
+
+    if (conn->bin_stream)
+        conn->bin_left -= conn->out.len;
+    conn->zip_cont = zip && conn->bin_stream && conn->bin_left;
+    conn->out.len = 0;
+    if (ret < 0) {
+        err("socket_send: failed to send data to socket");
+        return -1;
     }
 
-    if (conn->argv) {
-        dbg("conn_free: argv=%p", conn->argv);
-        free(conn->argv);
+    return 0;
+}
+
+/* complete the reply, the command is over; it is sent by rc_send() */
+static int rc_reply_end(robin_conn_t *conn)
+{
+    uint32_t len;
+
+    if (conn->bin_stream && conn->bin_left != conn->out.len) {
+        err("reply: %zu bytes left but %zu built", conn->bin_left,
+            conn->out.len);
+        return -1;
     }
 
-    dbg("conn_free: conn=%p", conn);
-    free(conn);
+    /* the binary reply is one frame, its length is known if not streamed */
+    if (conn->bin_status && !conn->bin_stream) {
+        len = htonl(conn->out.len - conn->bin_hdr - SOCKET_HDR_LEN);
+        memcpy(conn->out.data + conn->bin_hdr, &len, SOCKET_HDR_LEN);
+    }
+
+    conn->bin_status = 0;
+    conn->bin_stream = 0;
+
+    return 0;
+}
+
+/* send the rest of the reply, the command is over */
+static int rc_flush(robin_conn_t *conn)
+{
+    if (rc_reply_end(conn) < 0)
+        return -1;
+
+    return rc_send(conn);
+}
+
+/* send what is complete of a long reply */
+static int rc_reply_more(robin_conn_t *conn)
+{
+    if (conn->out.len < ROBIN_CONN_OUT_FLUSH_LEN)
+        return 0;
+
+    /* a binary reply is complete only if streamed */
+    if (conn->proto == ROBIN_PROTO_BINARY && !conn->bin_stream)
+        return 0;
+
+    return rc_send(conn);
+}
+
+/*
+ * The binary reply goes on with len bytes of records: send its length now
+ * and the records as they are built, instead of holding them all. Text
+ * replies are sent line by line anyway.
+ */
+static int rc_reply_stream(robin_conn_t *conn, size_t len)
+{
+    uint32_t frame_len;
+
+    if (conn->proto != ROBIN_PROTO_BINARY || !conn->bin_status)
+        return 0;
+
+    conn->bin_left = conn->out.len + len;
+    conn->bin_stream = 1;
+
+    frame_len = htonl(conn->out.len + len - conn->bin_hdr - SOCKET_HDR_LEN);
+    memcpy(conn->out.data + conn->bin_hdr, &frame_len, SOCKET_HDR_LEN);
+
+    return 0;
+}
+
+/* start a frame in the reply, its length is filled by rc_line_end() */
+static int rc_line_begin(robin_conn_t *conn, size_t *hdr)
+{
+    *hdr = conn->out.len;
+
+    return wire_put_bytes(&conn->out, "\0\0\0\0", SOCKET_HDR_LEN);
 }
 
+static int rc_line_end(robin_conn_t *conn, size_t hdr)
+{
+    uint32_t len = htonl(conn->out.len - hdr - SOCKET_HDR_LEN);
+
+    memcpy(conn->out.data + hdr, &len, SOCKET_HDR_LEN);
+
+    dbg("reply: msg=%.*s", (int) (conn->out.len - hdr - SOCKET_HDR_LEN),
+        conn->out.data + hdr + SOCKET_HDR_LEN);
+
+    return rc_reply_more(conn);
+}
+
+static int rc_vreply(robin_conn_t *conn, const char *fmt, va_list args)
+{
+    size_t hdr;
+
+    if (conn->proto == ROBIN_PROTO_BINARY) {
+        /* the string length goes before it: format the line apart */
+        conn->line.len = 0;
+        if (wire_put_vfmt(&conn->line, fmt, args) < 0)
+            return -1;
+
+        dbg("reply: msg=%.*s", (int) conn->line.len, conn->line.data);
+
+        if (wire_put_str(&conn->out, conn->line.data, conn->line.len) < 0)
+            return -1;
+
+        return rc_reply_more(conn);
+    }
+
+    /* format the line straight into the reply */
+    if (rc_line_begin(conn, &hdr) < 0
+        || wire_put_vfmt(&conn->out, fmt, args) < 0)
+        return -1;
+
+    return rc_line_end(conn, hdr);
+}
+
+/* reply a line following the status, e.g. a session token */
 static int rc_reply(robin_conn_t *conn, const char *fmt, ...)
 {
     va_list args;
-    int reply_len;
+    int ret;
 
     va_start(args, fmt);
-    reply_len = vsnprintf(NULL, 0, fmt, args);
-    if (reply_len < 0) {
-        err("vsnprintf: %s", strerror(errno));
+    ret = rc_vreply(conn, fmt, args);
+    va_end(args);
+
+    return ret;
+}
+
+/*
+ * Reply the status of the command: "<code> <msg>" in text replies, the code
+ * and the message encoded in binary ones, where it opens the frame.
+ */
+static int rc_reply_status(robin_conn_t *conn, int code, const char *fmt, ...)
+{
+    va_list args;
+    size_t hdr;
+    int ret;
+
+    va_start(args, fmt);
+
+    if (conn->proto != ROBIN_PROTO_BINARY) {
+        ret = rc_line_begin(conn, &hdr);
+        if (!ret && (wire_put_dec(&conn->out, code) < 0
+                     || wire_put_bytes(&conn->out, " ", 1) < 0
+                     || wire_put_vfmt(&conn->out, fmt, args) < 0))
+            ret = -1;
+
+        va_end(args);
+
+        return ret ? ret : rc_line_end(conn, hdr);
+    }
+
+    conn->line.len = 0;
+    ret = wire_put_vfmt(&conn->line, fmt, args);
+
+    va_end(args);
+
+    dbg("reply: code=%d msg=%.*s", code, (int) conn->line.len,
+        conn->line.data);
+
+    /* the frame length is filled by rc_flush() or rc_reply_stream() */
+    if (ret < 0
+        || rc_line_begin(conn, &hdr) < 0
+        || wire_put_int(&conn->out, code) < 0
+        || wire_put_str(&conn->out, conn->line.data, conn->line.len) < 0)
         return -1;
+
+    conn->bin_status = 1;
+    conn->bin_hdr = hdr;
+
+    return 0;
+}
+
+/*
+ * Reply a record of typed fields: s string, q quoted string, d int,
+ * u unsigned int, t time_t. Text replies get one line with the fields
+ * separated by spaces, binary replies get the fields encoded.
+ */
+static int rc_reply_rec(robin_conn_t *conn, const char *types, ...)
+{
+    const char *s;
+    va_list args;
+    size_t hdr;
+    int ret = 0;
+
+    va_start(args, types);
+
+    if (conn->proto != ROBIN_PROTO_BINARY) {
+        ret = rc_line_begin(conn, &hdr);
+
+        for (const char *t = types; *t && !ret; t++) {
+            if (t != types && wire_put_bytes(&conn->out, " ", 1) < 0) {
+                ret = -1;
+                break;
+            }
+
+            switch (*t) {
+                case 's':
+                    s = va_arg(args, const char *);
+                    ret = wire_put_bytes(&conn->out, s, strlen(s));
+                    break;
+
+                case 'q':
+                    s = va_arg(args, const char *);
+                    if (wire_put_bytes(&conn->out, "\"", 1) < 0
+                        || wire_put_bytes(&conn->out, s, strlen(s)) < 0
+                        || wire_put_bytes(&conn->out, "\"", 1) < 0)
+                        ret = -1;
+                    break;
+
+                case 'd':
+                    ret = wire_put_dec(&conn->out, va_arg(args, int));
+                    break;
+
+                case 'u':
+                    ret = wire_put_dec(&conn->out, va_arg(args, unsigned int));
+                    break;
+
+                case 't':
+                    ret = wire_put_dec(&conn->out, va_arg(args, time_t));
+                    break;
+            }
+        }
+
+        va_end(args);
+
+        return ret ? ret : rc_line_end(conn, hdr);
     }
-    reply_len++;
+
+    for (const char *t = types; *t && !ret; t++) {
+        switch (*t) {
+            case 's':
+            case 'q':
+                s = va_arg(args, const char *);
+                ret = wire_put_str(&conn->out, s, strlen(s));
+                break;
+
+            case 'd':
+                ret = wire_put_int(&conn->out, va_arg(args, int));
+                break;
+
+            case 'u':
+                ret = wire_put_uint(&conn->out, va_arg(args, unsigned int));
+                break;
+
+            case 't':
+                ret = wire_put_uint(&conn->out, va_arg(args, time_t));
+                break;
+        }
+    }
+
     va_end(args);
 
-    dbg("reply: len=%d", reply_len);
+    return ret ? ret : rc_reply_more(conn);
+}
 
-    conn->reply = realloc(conn->reply, reply_len * sizeof(char));
-    if (!conn->reply) {
-        err("malloc: %s", strerror(errno));
+static int rc_uid_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* start pushing the new cips of the users followed by the logged one */
+static int rc_push_subscribe(robin_conn_t *conn)
+{
+    int efd, cancel_state;
+
+    if (conn->push_fd >= 0)
+        return 0;
+
+    efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd < 0) {
+        err("eventfd: %s", strerror(errno));
         return -1;
     }
 
-    va_start(args, fmt);
-    if (vsnprintf(conn->reply, reply_len, fmt, args) < 0) {
-        err("vsnprintf: %s", strerror(errno));
+    /* a cancelled thread must not hold the lock */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+    pthread_mutex_lock(&rc_push_mutex);
+
+    conn->push_fd = efd;
+    conn->push_head = conn->push_len = conn->push_lost = 0;
+    rc_subs[rc_subs_num++] = conn;
+
+    pthread_mutex_unlock(&rc_push_mutex);
+    pthread_setcancelstate(cancel_state, NULL);
+
+    return 0;
+}
+
+static void rc_push_unsubscribe(robin_conn_t *conn)
+{
+    int cancel_state;
+
+    if (conn->push_fd < 0)
+        return;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+    pthread_mutex_lock(&rc_push_mutex);
+
+    for (int i = 0; i < rc_subs_num; i++) {
+        if (rc_subs[i] == conn) {
+            rc_subs[i] = rc_subs[--rc_subs_num];
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&rc_push_mutex);
+    pthread_setcancelstate(cancel_state, NULL);
+
+    /* no cip can be pushed anymore */
+    close(conn->push_fd);
+    conn->push_fd = -1;
+}
+
+/* queue the cip sent by the user of conn to its subscribed followers */
+static void rc_push_cip(robin_conn_t *conn, const robin_cip_exp_t *cip)
+{
+    const robin_user_adj_t *followers;
+    const uint64_t one = 1;
+    robin_conn_t *sub;
+    uint32_t uid;
+    int cancel_state;
+
+    followers = robin_user_followers_snap(conn->uid);
+    if (!followers) {
+        warn("push: could not get the list of followers");
+        return;
+    }
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+    pthread_mutex_lock(&rc_push_mutex);
+
+    for (int i = 0; i < rc_subs_num; i++) {
+        sub = rc_subs[i];
+        uid = sub->uid;
+        if (!bsearch(&uid, followers->uids, followers->len,
+                     sizeof(uint32_t), rc_uid_cmp))
+            continue;
+
+        /* a slow connection loses the newest cips, not the memory */
+        if (sub->push_len == ROBIN_CONN_PUSH_MAX) {
+            sub->push_lost++;
+        } else {
+            sub->push[(sub->push_head + sub->push_len) % ROBIN_CONN_PUSH_MAX] =
+                *cip;
+            sub->push_len++;
+        }
+
+        /* wake up its thread */
+        if (write(sub->push_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            warn("write: %s", strerror(errno));
+    }
+
+    pthread_mutex_unlock(&rc_push_mutex);
+    pthread_setcancelstate(cancel_state, NULL);
+
+    robin_user_adj_put(followers);
+}
+
+/* send the cips queued to the connection */
+static int rc_push_send(robin_conn_t *conn)
+{
+    robin_cip_exp_t push[ROBIN_CONN_PUSH_MAX];
+    unsigned int n, lost;
+    uint64_t count;
+    int cancel_state;
+
+    /* reset the signal, the queue is read whole */
+    if (read(conn->push_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        err("read: %s", strerror(errno));
         return -1;
     }
-    va_end(args);
 
-    dbg("reply: msg=%s", conn->reply);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+    pthread_mutex_lock(&rc_push_mutex);
 
-    /* do not send '\0' in reply */
-    if (socket_send(conn->fd, conn->reply, reply_len - 1) < 0) {
-        err("socket_send: failed to send data to socket");
+    n = conn->push_len;
+    for (unsigned int i = 0; i < n; i++)
+        push[i] = conn->push[(conn->push_head + i) % ROBIN_CONN_PUSH_MAX];
+    lost = conn->push_lost;
+
+    conn->push_head = (conn->push_head + n) % ROBIN_CONN_PUSH_MAX;
+    conn->push_len = 0;
+    conn->push_lost = 0;
+
+    pthread_mutex_unlock(&rc_push_mutex);
+    pthread_setcancelstate(cancel_state, NULL);
+
+    dbg("push: %u cips, %u lost", n, lost);
+
+    for (unsigned int i = 0; i < n; i++) {
+        if (rc_reply_status(conn, ROBIN_PUSH_CIP, "cip") < 0
+            || rc_reply_rec(conn, "tsq", push[i].ts, push[i].user,
+                            push[i].msg) < 0
+            || rc_flush(conn) < 0)
+            return -1;
+    }
+
+    if (lost && (rc_reply_status(conn, ROBIN_PUSH_LOST, "%u cips lost",
+                                 lost) < 0
+                 || rc_flush(conn) < 0))
         return -1;
+
+    return 0;
+}
+
+/* wait for the next command, sending the pushed cips meanwhile */
+static int rc_wait_cmd(robin_conn_t *conn)
+{
+    struct pollfd fds[2];
+
+    while (conn->push_fd >= 0) {
+        fds[0].fd = conn->fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = conn->push_fd;
+        fds[1].events = POLLIN;
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            err("poll: %s", strerror(errno));
+            return -1;
+        }
+
+        if ((fds[1].revents & POLLIN) && rc_push_send(conn) < 0)
+            return -1;
+
+        /* a command, or the client went away */
+        if (fds[0].revents)
+            return 0;
     }
 
     return 0;
 }
 
+/*
+ * Decode a binary request in argc-argv form, argv[0] is the command name.
+ * Return 0 on success, -1 on too many arguments, 1 on malformed request.
+ */
+static int rc_parse_bin(robin_conn_t *conn, char *frame, int len,
+                        robin_conn_cmd_t **cmd)
+{
+    wire_rd_t rd;
+    uint8_t op;
+
+    wire_rd_init(&rd, frame, len);
+
+    /* unknown opcodes end on the terminator */
+    if (wire_get_u8(&rd, &op) < 0 || op >= ROBIN_OP_MAX)
+        op = ROBIN_OP_MAX;
+    *cmd = &robin_cmds[op];
+
+    conn->argv[0] = (*cmd)->name;
+    conn->argl[0] = op < ROBIN_OP_MAX ? strlen((*cmd)->name) : 0;
+    conn->argc = 1;
+
+    while (!wire_rd_end(&rd)) {
+        if (conn->argc == ROBIN_CONN_ARGC_MAX)
+            return -1;
+
+        if (wire_get_str(&rd, &conn->argv[conn->argc],
+                         &conn->argl[conn->argc]) < 0)
+            return 1;
+
+        conn->argc++;
+    }
+
+    return 0;
+}
+
+/* run the command of a request, its reply is left in conn->out */
+static robin_conn_cmd_ret_t rc_exec(robin_conn_t *conn, size_t len)
+{
+    char *buf = conn->in;
+    robin_conn_cmd_t *cmd;
+    int ret;
+
+    if (len > ROBIN_CONN_CMD_MAX_LEN) {
+        if (rc_reply_status(conn, -1, "command string exceeds "
+                            STR(ROBIN_CONN_CMD_MAX_LEN)
+                            " characters: cmd dropped") < 0
+            || rc_reply_end(conn) < 0)
+            return ROBIN_CMD_ERR;
+
+        /* close connection with client if it is too annoying */
+        if (++conn->big_cmd_count >= ROBIN_CONN_BIGCMD_THRESHOLD) {
+            warn("the client has issued to many oversized commands");
+            return ROBIN_CMD_QUIT;
+        }
+
+        return ROBIN_CMD_OK;
+    }
+
+    if (conn->proto == ROBIN_PROTO_BINARY) {
+        /* decode the request in argc-argv form and store it in conn */
+        ret = rc_parse_bin(conn, buf, len, &cmd);
+    } else {
+        dbg("command received: %s", buf);
+
+        /* parse the command in argc-argv form and store it in conn */
+        ret = argv_parse(buf, conn->argv, conn->argl, ROBIN_CONN_ARGC_MAX,
+                         &conn->argc);
+
+        /* blank line, replied only in a batch */
+        if (!ret && conn->argc < 1 && !conn->batch)
+            return ROBIN_CMD_OK;
+
+        /* unknown commands (and blank lines) end on the terminator */
+        cmd = &robin_cmds[conn->argc < 1 ? ROBIN_OP_MAX
+                          : robin_op_lookup(conn->argv[0], conn->argl[0])];
+    }
+
+    if (ret) {
+        rc_reply_status(conn, -1, ret < 0 ? "too many arguments"
+                                          : "malformed request");
+        ret = ROBIN_CMD_OK;
+    } else if (cmd->name == NULL) {
+        rc_reply_status(conn, -1, "invalid command; type help for the list "
+                                  "of availble commands");
+        ret = ROBIN_CMD_OK;
+    } else if (conn->batch && (cmd == &robin_cmds[ROBIN_OP_HELLO]
+                               || cmd == &robin_cmds[ROBIN_OP_BATCH])) {
+        rc_reply_status(conn, -1, "%s is not allowed in a batch", cmd->name);
+        ret = ROBIN_CMD_OK;
+    } else {
+        info("recognized command: %s", cmd->name);
+        ret = cmd->fn(conn);
+    }
+
+    if (rc_reply_end(conn) < 0)
+        return ROBIN_CMD_ERR;
+
+    return ret;
+}
+
 
 /*
  * Robin Command function definitions
@@ -228,11 +852,11 @@ ROBIN_CONN_CMD_FN(help, conn)
     dbg("%s: ncmds=%d", conn->argv[0], ncmds);
 
     if (conn->argc != 1) {
-        rc_reply(conn, "-1 invalid number of arguments");
+        rc_reply_status(conn, -1, "invalid number of arguments");
         return ROBIN_CMD_OK;
     }
 
-    if (rc_reply(conn, "%d available commands:", ncmds) < 0)
+    if (rc_reply_status(conn, ncmds, "available commands:") < 0)
         return ROBIN_CMD_ERR;
 
     for (cmd = robin_cmds; cmd->name != NULL; cmd++) {
@@ -243,6 +867,59 @@ ROBIN_CONN_CMD_FN(help, conn)
     return ROBIN_CMD_OK;
 }
 
+ROBIN_CONN_CMD_FN(hello, conn)
+{
+    lz4_ctx_t *zip = NULL;
+    long version;
+    char *end;
+
+    dbg("%s", conn->argv[0]);
+
+    if (conn->argc != 2 && conn->argc != 3) {
+        rc_reply_status(conn, -1, "invalid number of arguments");
+        return ROBIN_CMD_OK;
+    }
+
+    version = strtol(conn->argv[1], &end, 10);
+    if (*end || (version != ROBIN_PROTO_TEXT
+                 && version != ROBIN_PROTO_BINARY)) {
+        rc_reply_status(conn, -1, "unsupported protocol version");
+        return ROBIN_CMD_OK;
+    }
+
+    if (conn->argc == 3) {
+        if (strcmp(conn->argv[2], "lz4")) {
+            rc_reply_status(conn, -1, "unsupported compression");
+            return ROBIN_CMD_OK;
+        }
+
+        /* the context is kept, and reused by every reply */
+        zip = conn->zip ? conn->zip : calloc(1, sizeof(lz4_ctx_t));
+        if (!zip) {
+            err("calloc: %s", strerror(errno));
+            rc_reply_status(conn, -1, "could not enable the compression");
+            return ROBIN_CMD_OK;
+        }
+    }
+
+    /* reply in the protocol of the request, then switch */
+    if (rc_reply_status(conn, 0, "protocol version %ld%s", version,
+                        zip ? ", lz4 compression" : "") < 0
+        || rc_flush(conn) < 0) {
+        if (zip != conn->zip)
+            free(zip);
+        return ROBIN_CMD_ERR;
+    }
+
+    conn->proto = version;
+    if (zip != conn->zip) {
+        free(conn->zip);
+        conn->zip = zip;
+    }
+
+    return ROBIN_CMD_OK;
+}
+
 ROBIN_CONN_CMD_FN(register, conn)
 {
     char *email, *psw;
@@ -251,7 +928,7 @@ ROBIN_CONN_CMD_FN(register, conn)
     dbg("%s", conn->argv[0]);
 
     if (conn->argc != 3) {
-        rc_reply(conn, "-1 invalid number of arguments");
+        rc_reply_status(conn, -1, "invalid number of arguments");
         return ROBIN_CMD_OK;
     }
 
@@ -262,17 +939,18 @@ ROBIN_CONN_CMD_FN(register, conn)
 
     ret = robin_user_add(email, psw);
     if (ret < 0) {
-        rc_reply(conn, "-1 could not register the new user into the system");
+        rc_reply_status(conn, -1, "could not register the new user into the "
+                                  "system");
         return ROBIN_CMD_ERR;
     } else if (ret == 1) {
-        rc_reply(conn, "-2 invalid email/password format");
+        rc_reply_status(conn, -2, "invalid email/password format");
         return ROBIN_CMD_OK;
     } else if (ret == 2) {
-        rc_reply(conn, "-3 user %s is already registered", email);
+        rc_reply_status(conn, -3, "user %s is already registered", email);
         return ROBIN_CMD_OK;
     }
 
-    rc_reply(conn, "0 user registered successfully");
+    rc_reply_status(conn, 0, "user registered successfully");
 
     return ROBIN_CMD_OK;
 }
@@ -280,12 +958,13 @@ ROBIN_CONN_CMD_FN(register, conn)
 ROBIN_CONN_CMD_FN(login, conn)
 {
     char *email, *psw;
-    int uid;
+    int uid, session;
 
     dbg("%s", conn->argv[0]);
 
-    if (conn->argc != 3) {
-        rc_reply(conn, "-1 invalid number of arguments");
+    session = conn->argc == 4 && !strcmp(conn->argv[3], "session");
+    if (conn->argc != 3 && !session) {
+        rc_reply_status(conn, -1, "invalid number of arguments");
         return ROBIN_CMD_OK;
     }
 
@@ -295,36 +974,92 @@ ROBIN_CONN_CMD_FN(login, conn)
     dbg("%s: email=%s psw=%s", conn->argv[0], email, psw);
 
     if (conn->logged) {
-        rc_reply(conn, "-2 already signed-in as %s",
-                       robin_user_email_get(conn->uid));
+        rc_reply_status(conn, -2, "already signed-in as %s",
+                        robin_user_email_get(conn->uid));
         return ROBIN_CMD_OK;
     }
 
     switch (robin_user_acquire(email, psw, &uid)) {
         case -1:
-            rc_reply(conn, "-1 could not login into the system");
+            rc_reply_status(conn, -1, "could not login into the system");
             return ROBIN_CMD_ERR;
 
         case 0:
             conn->logged = 1;
             conn->uid = uid;
-            rc_reply(conn, "0 user logged-in successfully");
-            return ROBIN_CMD_OK;
+            break;
 
         case 1:
-            rc_reply(conn, "-3 user already logged in from another client");
+            rc_reply_status(conn, -3, "user already logged in from another "
+                                      "client");
             return ROBIN_CMD_OK;
 
         case 2:
-            rc_reply(conn, "-4 invalid email");
+            rc_reply_status(conn, -4, "invalid email");
             return ROBIN_CMD_OK;
 
         case 3:
-            rc_reply(conn, "-5 invalid password");
+            rc_reply_status(conn, -5, "invalid password");
+            return ROBIN_CMD_OK;
+
+        default:
+            rc_reply_status(conn, -6, "unknown error");
+            return ROBIN_CMD_ERR;
+    }
+
+    /* the login succeeded even if the session could not be opened */
+    if (session && robin_session_create(uid, conn->session) == 0) {
+        rc_reply_status(conn, 1, "user logged-in successfully, session token "
+                                 "follows");
+        rc_reply(conn, "%s", conn->session);
+    } else {
+        rc_reply_status(conn, 0, "user logged-in successfully");
+    }
+
+    return ROBIN_CMD_OK;
+}
+
+ROBIN_CONN_CMD_FN(resume, conn)
+{
+    char *token;
+    int uid;
+
+    dbg("%s", conn->argv[0]);
+
+    if (conn->argc != 2) {
+        rc_reply_status(conn, -1, "invalid number of arguments");
+        return ROBIN_CMD_OK;
+    }
+
+    token = conn->argv[1];
+
+    if (conn->logged) {
+        rc_reply_status(conn, -2, "already signed-in as %s",
+                        robin_user_email_get(conn->uid));
+        return ROBIN_CMD_OK;
+    }
+
+    if (robin_session_resume(token, &uid)) {
+        rc_reply_status(conn, -4, "invalid or expired session");
+        return ROBIN_CMD_OK;
+    }
+
+    switch (robin_user_acquire_uid(uid)) {
+        case 0:
+            conn->logged = 1;
+            conn->uid = uid;
+            strcpy(conn->session, token);
+            rc_reply_status(conn, 0, "session resumed as %s",
+                            robin_user_email_get(uid));
+            return ROBIN_CMD_OK;
+
+        case 1:
+            rc_reply_status(conn, -3, "user already logged in from another "
+                                      "client");
             return ROBIN_CMD_OK;
 
         default:
-            rc_reply(conn, "-6 unknown error");
+            rc_reply_status(conn, -1, "could not resume the session");
             return ROBIN_CMD_ERR;
     }
 }
@@ -334,227 +1069,332 @@ ROBIN_CONN_CMD_FN(logout, conn)
     dbg("%s", conn->argv[0]);
 
     if (!conn->logged) {
-        rc_reply(conn, "-2 login is required before logout");
+        rc_reply_status(conn, -2, "login is required before logout");
         return ROBIN_CMD_OK;
     }
 
     if (conn->argc != 1) {
-        rc_reply(conn, "-1 invalid number of arguments");
+        rc_reply_status(conn, -1, "invalid number of arguments");
         return ROBIN_CMD_OK;
     }
 
+    rc_push_unsubscribe(conn);
     robin_user_release(conn->uid);
     conn->logged = 0;
 
-    rc_reply(conn, "0 logout successfull");
+    /* an explicit logout closes the session too */
+    if (*conn->session) {
+        robin_session_revoke(conn->session);
+        *conn->session = '\0';
+    }
+
+    rc_reply_status(conn, 0, "logout successfull");
 
     return ROBIN_CMD_OK;
 }
 
 ROBIN_CONN_CMD_FN(follow, conn)
 {
-    char **replies;
-    int n, nleft, err;
+    const char *reason;
+    int *results;
+    int n, code, ret;
 
     n = conn->argc - 1;
 
     dbg("%s: n_emails=%d", conn->argv[0], n);
 
     if (!conn->logged) {
-        rc_reply(conn, "-2 you must be logged in");
+        rc_reply_status(conn, -2, "you must be logged in");
         return ROBIN_CMD_OK;
     }
 
     if (conn->argc < 2) {
-        rc_reply(conn, "-1 invalid number of arguments");
+        rc_reply_status(conn, -1, "invalid number of arguments");
         return ROBIN_CMD_OK;
     }
 
-    replies = malloc(n * sizeof(char *));
-    if (!replies) {
+    results = malloc(n * sizeof(int));
+    if (!results) {
         err("malloc: %s", strerror(errno));
         return ROBIN_CMD_ERR;
     }
 
-    err = 0;
-    nleft = n;
-    while (nleft && !err) {
-        const char *email = conn->argv[n - nleft + 1];
+    ret = robin_user_follow_many(conn->uid, (const char **) conn->argv + 1, n,
+                                 results);
 
-        switch (robin_user_follow(conn->uid, email)) {
+    rc_reply_status(conn, n, "users tried to follow");
+    for (int i = 0; i < n; i++) {
+        switch (results[i]) {
             case -1:
-                replies[n - nleft] = "-1 could not follow the user";
-                err = 1;
+                code = -1;
+                reason = "could not follow the user";
                 break;
 
             case 0:
-                replies[n - nleft] = "0 user followed";
+                code = 0;
+                reason = "user followed";
                 break;
 
             case 1:
-                replies[n - nleft] = "1 user does not exist";
+                code = 1;
+                reason = "user does not exist";
                 break;
 
             case 2:
-                replies[n - nleft] = "2 user already followed";
+                code = 2;
+                reason = "user already followed";
                 break;
 
             default:
-                replies[n - nleft] = "3 unknown error";
-                err = 1;
+                code = 3;
+                reason = "unknown error";
                 break;
         }
 
-        nleft--;
+        rc_reply_rec(conn, "sds", conn->argv[i + 1], code, reason);
     }
 
-    if (nleft == n) {
-        rc_reply(conn, "-1 could not follow any user");
-    } else {
-        rc_reply(conn, "%d users tried to follow", n - nleft);
-        for (int i = 0; i < n - nleft; i++) {
-            const char *email = conn->argv[i + 1];
-            rc_reply(conn, "%s %s", email, replies[i]);
-        }
-    }
-
-    free(replies);
+    free(results);
 
-    if (!nleft)
-        return ROBIN_CMD_OK;
-    else
-        return ROBIN_CMD_ERR;
+    return ret < 0 ? ROBIN_CMD_ERR : ROBIN_CMD_OK;
 }
 
 ROBIN_CONN_CMD_FN(unfollow, conn)
 {
-    char **replies;
-    int n, nleft, err;
+    const char *reason;
+    int *results;
+    int n, code, ret;
 
     n = conn->argc - 1;
 
     dbg("%s: n_emails=%d", conn->argv[0], n);
 
     if (!conn->logged) {
-        rc_reply(conn, "-2 you must be logged in");
+        rc_reply_status(conn, -2, "you must be logged in");
         return ROBIN_CMD_OK;
     }
 
     if (conn->argc < 2) {
-        rc_reply(conn, "-1 invalid number of arguments");
+        rc_reply_status(conn, -1, "invalid number of arguments");
         return ROBIN_CMD_OK;
     }
 
-    replies = malloc(n * sizeof(char *));
-    if (!replies) {
+    results = malloc(n * sizeof(int));
+    if (!results) {
         err("malloc: %s", strerror(errno));
         return ROBIN_CMD_ERR;
     }
 
-    err = 0;
-    nleft = n;
-    while (nleft && !err) {
-        const char *email = conn->argv[n - nleft + 1];
+    ret = robin_user_unfollow_many(conn->uid, (const char **) conn->argv + 1,
+                                   n, results);
 
-        switch (robin_user_unfollow(conn->uid, email)) {
+    rc_reply_status(conn, n, "users tried to unfollow");
+    for (int i = 0; i < n; i++) {
+        switch (results[i]) {
             case -1:
-                replies[n - nleft] = "-1 could not unfollow the user";
-                err = 1;
+                code = -1;
+                reason = "could not unfollow the user";
                 break;
 
             case 0:
-                replies[n - nleft] = "0 user unfollowed";
+                code = 0;
+                reason = "user unfollowed";
                 break;
 
             case 1:
-                replies[n - nleft] = "-1 user is not followed";
+                code = -1;
+                reason = "user is not followed";
                 break;
 
             default:
-                replies[n - nleft] = "-1 unknown error";
-                err = 1;
+                code = -1;
+                reason = "unknown error";
                 break;
         }
 
-        nleft--;
+        rc_reply_rec(conn, "sds", conn->argv[i + 1], code, reason);
     }
 
-    if (nleft == n) {
-        rc_reply(conn, "-1 could not unfollow any user");
-    } else {
-        rc_reply(conn, "%d users tried to unfollow", n - nleft);
-        for (int i = 0; i < n - nleft; i++) {
-            const char *email = conn->argv[i + 1];
-            rc_reply(conn, "%s %s", email, replies[i]);
-        }
-    }
+    free(results);
+
+    return ret < 0 ? ROBIN_CMD_ERR : ROBIN_CMD_OK;
+}
 
-    free(replies);
+ROBIN_CONN_CMD_FN(following, conn)
+{
+    const robin_user_adj_t *following;
+
+    dbg("%s", conn->argv[0]);
 
-    if (!nleft)
+    if (!conn->logged) {
+        rc_reply_status(conn, -2, "you must be logged in");
         return ROBIN_CMD_OK;
-    else
+    }
+
+    if (conn->argc != 1) {
+        rc_reply_status(conn, -1, "invalid number of arguments");
+        return ROBIN_CMD_OK;
+    }
+
+    following = robin_user_following_snap(conn->uid);
+    if (!following) {
+        rc_reply_status(conn, -1, "could not get the list of following users");
         return ROBIN_CMD_ERR;
+    }
+
+    rc_reply_status(conn, following->len, "users");
+    for (size_t i = 0; i < following->len; i++)
+        rc_reply_rec(conn, "s", following->emails[i]);
+
+    robin_user_adj_put(following);
+
+    return ROBIN_CMD_OK;
 }
 
-ROBIN_CONN_CMD_FN(following, conn)
+ROBIN_CONN_CMD_FN(followers, conn)
 {
-    char **following;
-    size_t len;
+    const robin_user_adj_t *followers;
 
     dbg("%s", conn->argv[0]);
 
     if (!conn->logged) {
-        rc_reply(conn, "-2 you must be logged in");
+        rc_reply_status(conn, -2, "you must be logged in");
         return ROBIN_CMD_OK;
     }
 
     if (conn->argc != 1) {
-        rc_reply(conn, "-1 invalid number of arguments");
+        rc_reply_status(conn, -1, "invalid number of arguments");
         return ROBIN_CMD_OK;
     }
 
-    if (robin_user_following_get(conn->uid, &following, &len) < 0) {
-        rc_reply(conn, "-1 could not get the list of following users");
+    followers = robin_user_followers_snap(conn->uid);
+    if (!followers) {
+        rc_reply_status(conn, -1, "could not get the list of followers users");
         return ROBIN_CMD_ERR;
     }
 
-    rc_reply(conn, "%d users", len);
-    for (int i = 0; i < len; i++)
-        rc_reply(conn, "%s", following[i]);
+    rc_reply_status(conn, followers->len, "users");
+    for (size_t i = 0; i < followers->len; i++)
+        rc_reply_rec(conn, "s", followers->emails[i]);
 
-    free(following);
+    robin_user_adj_put(followers);
 
     return ROBIN_CMD_OK;
 }
 
-ROBIN_CONN_CMD_FN(followers, conn)
+ROBIN_CONN_CMD_FN(suggest, conn)
 {
-    char **followers;
-    size_t len;
+    const robin_user_sugg_t *sugg;
+    long k = ROBIN_CONN_SUGGEST_K;
+    char *end;
 
     dbg("%s", conn->argv[0]);
 
     if (!conn->logged) {
-        rc_reply(conn, "-2 you must be logged in");
+        rc_reply_status(conn, -2, "you must be logged in");
+        return ROBIN_CMD_OK;
+    }
+
+    if (conn->argc > 2) {
+        rc_reply_status(conn, -1, "invalid number of arguments");
+        return ROBIN_CMD_OK;
+    }
+
+    if (conn->argc == 2) {
+        k = strtol(conn->argv[1], &end, 10);
+        if (*end || k < 1 || k > ROBIN_CONN_SUGGEST_MAX) {
+            rc_reply_status(conn, -1, "k must be between 1 and "
+                                      STR(ROBIN_CONN_SUGGEST_MAX));
+            return ROBIN_CMD_OK;
+        }
+    }
+
+    sugg = robin_user_suggest(conn->uid, k);
+    if (!sugg) {
+        rc_reply_status(conn, -1, "could not get the suggestions");
+        return ROBIN_CMD_ERR;
+    }
+
+    rc_reply_status(conn, sugg->len, "users");
+    for (size_t i = 0; i < sugg->len; i++)
+        rc_reply_rec(conn, "su", sugg->emails[i], sugg->shared[i]);
+
+    robin_user_sugg_put(sugg);
+
+    return ROBIN_CMD_OK;
+}
+
+ROBIN_CONN_CMD_FN(mutuals, conn)
+{
+    const robin_user_adj_t *mutuals;
+
+    dbg("%s", conn->argv[0]);
+
+    if (!conn->logged) {
+        rc_reply_status(conn, -2, "you must be logged in");
         return ROBIN_CMD_OK;
     }
 
     if (conn->argc != 1) {
-        rc_reply(conn, "-1 invalid number of arguments");
+        rc_reply_status(conn, -1, "invalid number of arguments");
         return ROBIN_CMD_OK;
     }
 
-    if (robin_user_followers_get(conn->uid, &followers, &len) < 0) {
-        rc_reply(conn, "-1 could not get the list of followers users");
+    mutuals = robin_user_mutuals(conn->uid);
+    if (!mutuals) {
+        rc_reply_status(conn, -1, "could not get the list of mutual users");
         return ROBIN_CMD_ERR;
     }
 
-    rc_reply(conn, "%d users", len);
-    for (int i = 0; i < len; i++)
-        rc_reply(conn, "%s", followers[i]);
+    rc_reply_status(conn, mutuals->len, "users");
+    for (size_t i = 0; i < mutuals->len; i++)
+        rc_reply_rec(conn, "s", mutuals->emails[i]);
 
-    free(followers);
+    robin_user_adj_put(mutuals);
+
+    return ROBIN_CMD_OK;
+}
+
+ROBIN_CONN_CMD_FN(common, conn)
+{
+    const robin_user_adj_t *common;
+    int followers = 0, ret;
+
+    dbg("%s", conn->argv[0]);
+
+    if (!conn->logged) {
+        rc_reply_status(conn, -2, "you must be logged in");
+        return ROBIN_CMD_OK;
+    }
+
+    if (conn->argc != 2 && conn->argc != 3) {
+        rc_reply_status(conn, -1, "invalid number of arguments");
+        return ROBIN_CMD_OK;
+    }
+
+    if (conn->argc == 3) {
+        if (!strcmp(conn->argv[2], "followers")) {
+            followers = 1;
+        } else if (strcmp(conn->argv[2], "following")) {
+            rc_reply_status(conn, -1, "expected following or followers");
+            return ROBIN_CMD_OK;
+        }
+    }
+
+    ret = robin_user_common(conn->uid, conn->argv[1], followers, &common);
+    if (ret == 1) {
+        rc_reply_status(conn, -1, "user does not exist");
+        return ROBIN_CMD_OK;
+    } else if (ret < 0) {
+        rc_reply_status(conn, -1, "could not get the list of common users");
+        return ROBIN_CMD_ERR;
+    }
+
+    rc_reply_status(conn, common->len, "users");
+    for (size_t i = 0; i < common->len; i++)
+        rc_reply_rec(conn, "s", common->emails[i]);
+
+    robin_user_adj_put(common);
 
     return ROBIN_CMD_OK;
 }
@@ -562,28 +1402,29 @@ ROBIN_CONN_CMD_FN(followers, conn)
 ROBIN_CONN_CMD_FN(cip, conn)
 {
     const char *user, *msg;
+    robin_cip_exp_t cip;
 
     dbg("%s", conn->argv[0]);
 
     if (!conn->logged) {
-        rc_reply(conn, "-2 you must be logged in");
+        rc_reply_status(conn, -2, "you must be logged in");
         return ROBIN_CMD_OK;
     }
 
     if (conn->argc != 2) {
-        rc_reply(conn, "-1 invalid number of arguments");
+        rc_reply_status(conn, -1, "invalid number of arguments");
         return ROBIN_CMD_OK;
     }
 
     msg = conn->argv[1];
 
-    if (strlen(msg) > ROBIN_CONN_CIP_MAX_LEN) {
-        rc_reply(conn, "-1 cip messages cannot be longer than " STR(ROBIN_CONN_CIP_MAX_LEN)
-             " characters");
+    if (conn->argl[1] > ROBIN_CONN_CIP_MAX_LEN) {
+        rc_reply_status(conn, -1, "cip messages cannot be longer than "
+                                  STR(ROBIN_CONN_CIP_MAX_LEN) " characters");
         return ROBIN_CMD_OK;
     }
 
-    dbg("%s: msg_len=%d", conn->argv[0], strlen(msg));
+    dbg("%s: msg_len=%zu", conn->argv[0], conn->argl[1]);
 
     user = robin_user_email_get(conn->uid);
     if (!user) {
@@ -591,34 +1432,37 @@ ROBIN_CONN_CMD_FN(cip, conn)
         return ROBIN_CMD_ERR;
     }
 
-    if (robin_cip_add(user, msg) < 0) {
+    if (robin_cip_add(user, msg, &cip) < 0) {
         err("%s: failed to add the cip to the system", conn->argv[0]);
         return ROBIN_CMD_ERR;
     }
 
-    rc_reply(conn, "0 success");
+    rc_push_cip(conn, &cip);
+
+    rc_reply_status(conn, 0, "success");
 
     return ROBIN_CMD_OK;
 }
 
 ROBIN_CONN_CMD_FN(cips_since, conn)
 {
-    char **following;
-    size_t foll_len;
-    list_t *cip_list, *tmp;
+    const robin_user_adj_t *following;
+    robin_cip_iter_t it, count;
+    robin_cip_exp_t cip;
     unsigned int cips_num;
-    const robin_cip_exp_t *cip;
+    size_t len;
     time_t ts;
+    int ret = ROBIN_CMD_OK;
 
     dbg("%s", conn->argv[0]);
 
     if (!conn->logged) {
-        rc_reply(conn, "-2 you must be logged in");
+        rc_reply_status(conn, -2, "you must be logged in");
         return ROBIN_CMD_OK;
     }
 
     if (conn->argc != 2) {
-        rc_reply(conn, "-1 invalid number of arguments");
+        rc_reply_status(conn, -1, "invalid number of arguments");
         return ROBIN_CMD_OK;
     }
 
@@ -626,31 +1470,41 @@ ROBIN_CONN_CMD_FN(cips_since, conn)
 
     dbg("%s: ts=%d", conn->argv[0], ts);
 
-    if (robin_user_following_get(conn->uid, &following, &foll_len) < 0) {
-        rc_reply(conn, "-1 could not get the list of following users");
-        return ROBIN_CMD_ERR;
-    }
-
-    if (robin_cip_get_since(ts, following, foll_len, &cip_list, &cips_num) < 0) {
-        err("%s: failed to get the cips", conn->argv[0]);
+    following = robin_user_following_snap(conn->uid);
+    if (!following) {
+        rc_reply_status(conn, -1, "could not get the list of following users");
         return ROBIN_CMD_ERR;
     }
 
-    free(following);
+    robin_cip_since(&it, ts, following->emails, following->len);
 
-    rc_reply(conn, "%d cips", cips_num);
-    for (int i = 0; i < cips_num; i++) {
-        cip = (const robin_cip_exp_t *) cip_list->ptr;
-        rc_reply(conn, "%d %s \"%s\"", cip->ts, cip->user, cip->msg);
+    /* the cips are streamed: count them and their binary records first */
+    count = it;
+    cips_num = 0;
+    len = 0;
+    while (robin_cip_next(&count, &cip)) {
+        cips_num++;
+        len += wire_len_uint(cip.ts) + wire_len_str(strlen(cip.user))
+               + wire_len_str(strlen(cip.msg));
+    }
 
-        tmp = cip_list;
-        cip_list = cip_list->next;
+    if (rc_reply_status(conn, cips_num, "cips") < 0
+        || rc_reply_stream(conn, len) < 0) {
+        ret = ROBIN_CMD_ERR;
+        goto cips_since_quit;
+    }
 
-        free(tmp->ptr);
-        free(tmp);
+    while (robin_cip_next(&it, &cip)) {
+        if (rc_reply_rec(conn, "tsq", cip.ts, cip.user, cip.msg) < 0) {
+            ret = ROBIN_CMD_ERR;
+            break;
+        }
     }
 
-    return ROBIN_CMD_OK;
+cips_since_quit:
+    robin_user_adj_put(following);
+
+    return ret;
 }
 
 ROBIN_CONN_CMD_FN(hashtags_since, conn)
@@ -663,12 +1517,12 @@ ROBIN_CONN_CMD_FN(hashtags_since, conn)
     dbg("%s", conn->argv[0]);
 
     if (!conn->logged) {
-        rc_reply(conn, "-2 you must be logged in");
+        rc_reply_status(conn, -2, "you must be logged in");
         return ROBIN_CMD_OK;
     }
 
     if (conn->argc != 2) {
-        rc_reply(conn, "-1 invalid number of arguments");
+        rc_reply_status(conn, -1, "invalid number of arguments");
         return ROBIN_CMD_OK;
     }
 
@@ -681,10 +1535,10 @@ ROBIN_CONN_CMD_FN(hashtags_since, conn)
         return ROBIN_CMD_ERR;
     }
 
-    rc_reply(conn, "%d hashtags", hashtag_num);
+    rc_reply_status(conn, hashtag_num, "hashtags");
     for (int i = 0; i < hashtag_num; i++) {
         hashtag = (robin_hashtag_exp_t *) hashtag_list->ptr;
-        rc_reply(conn, "%s %d", hashtag->tag, hashtag->count);
+        rc_reply_rec(conn, "su", hashtag->tag, hashtag->count);
 
         tmp = hashtag_list;
         hashtag_list = hashtag_list->next;
@@ -702,16 +1556,94 @@ ROBIN_CONN_CMD_FN(quit, conn)
     dbg("%s", conn->argv[0]);
 
     if (conn->argc != 1) {
-        rc_reply(conn, "-1 invalid number of arguments");
+        rc_reply_status(conn, -1, "invalid number of arguments");
         return ROBIN_CMD_OK;
     }
 
-    if (rc_reply(conn, "0 bye bye!") < 0)
+    if (rc_reply_status(conn, 0, "bye bye!") < 0)
         return ROBIN_CMD_ERR;
 
     return ROBIN_CMD_QUIT;
 }
 
+ROBIN_CONN_CMD_FN(subscribe, conn)
+{
+    dbg("%s", conn->argv[0]);
+
+    if (!conn->logged) {
+        rc_reply_status(conn, -2, "you must be logged in");
+        return ROBIN_CMD_OK;
+    }
+
+    if (conn->argc != 1) {
+        rc_reply_status(conn, -1, "invalid number of arguments");
+        return ROBIN_CMD_OK;
+    }
+
+    if (rc_push_subscribe(conn) < 0) {
+        rc_reply_status(conn, -1, "could not subscribe");
+        return ROBIN_CMD_OK;
+    }
+
+    rc_reply_status(conn, 0, "subscribed to the cips of the followed users");
+
+    return ROBIN_CMD_OK;
+}
+
+ROBIN_CONN_CMD_FN(batch, conn)
+{
+    robin_conn_cmd_ret_t ret = ROBIN_CMD_OK;
+    int recv_ret;
+    char *end;
+    size_t len;
+    long n;
+
+    dbg("%s", conn->argv[0]);
+
+    if (conn->argc != 2) {
+        rc_reply_status(conn, -1, "invalid number of arguments");
+        return ROBIN_CMD_OK;
+    }
+
+    n = strtol(conn->argv[1], &end, 10);
+    if (*end || n < 1 || n > INT_MAX) {
+        rc_reply_status(conn, -1, "invalid number of commands");
+        return ROBIN_CMD_OK;
+    }
+
+    if (rc_reply_status(conn, 0, "%ld replies follow", n) < 0
+        || rc_reply_end(conn) < 0)
+        return ROBIN_CMD_ERR;
+
+    /* the requests were sent together, the replies are sent together; each
+     * request replaces the previous one in conn->in
+     */
+    for (conn->batch = n; conn->batch > 0; conn->batch--) {
+        /* oversized commands are skipped, rc_exec() replies to them */
+        recv_ret = socket_recv_into(conn->fd, conn->in, ROBIN_CONN_CMD_MAX_LEN,
+                                    &len);
+        if (recv_ret < 0 || recv_ret == 1) {
+            err("batch: failed to receive the commands");
+            ret = ROBIN_CMD_ERR;
+            break;
+        }
+
+        ret = rc_exec(conn, len);
+        if (ret != ROBIN_CMD_OK)
+            break;
+
+        /* the replies built so far are complete, do not hold too many */
+        if (conn->out.len >= ROBIN_CONN_OUT_FLUSH_LEN && rc_send(conn) < 0) {
+            ret = ROBIN_CMD_ERR;
+            break;
+        }
+    }
+
+    conn->batch = 0;
+
+    return ret;
+}
+
 
 /*
  * Exported functions
@@ -730,10 +1662,9 @@ ROBIN_CONN_CMD_FN(quit, conn)
 void robin_conn_manage(int id, int fd)
 {
     const int log_id = ROBIN_LOG_ID_RT_BASE + id;
-    int nread, big_cmd_count = 0;
-    char *buf;
-    robin_conn_cmd_t *cmd;
     robin_conn_t *conn;
+    size_t len;
+    int ret;
 
     /* setup the context for this connection */
     conn = rc_alloc(log_id, fd);
@@ -744,69 +1675,40 @@ void robin_conn_manage(int id, int fd)
     robin_conns[id] = conn;
 
     while (1) {
-        nread = socket_recv(conn->fd, &buf);
-        if (nread < 0) {
+        if (rc_wait_cmd(conn) < 0)
+            goto manager_quit;
+
+        /* oversized commands are skipped, rc_exec() replies to them */
+        ret = socket_recv_into(conn->fd, conn->in, ROBIN_CONN_CMD_MAX_LEN,
+                               &len);
+        if (ret < 0) {
             err("failed to receive a line from the client");
             goto manager_quit;
-        } else if (nread == 0) {
+        } else if (ret == 1) {
             warn("client disconnected");
             goto manager_quit;
-        } else if (nread > ROBIN_CONN_CMD_MAX_LEN) {
-            free(buf);
-
-            rc_reply(conn, "-1 command string exceeds " \
-                     STR(ROBIN_CONN_CMD_MAX_LEN) " characters: cmd dropped");
-
-            /* close connection with client if it is too annoying */
-            if (++big_cmd_count >= ROBIN_CONN_BIGCMD_THRESHOLD) {
-                warn("the client has issued to many oversized commands");
-                goto manager_quit;
-            }
-
-            continue;
-        }
-
-        dbg("command received: %s", buf);
-
-        /* parse the command in argc-argv form and store it in conn */
-        if (argv_parse(buf, &conn->argc, &conn->argv) < 0) {
-            err("argv_parse: failed to parse command");
-            goto manager_quit;
         }
 
-        /* blank line */
-        if (conn->argc < 1)
-            continue;
+        /* execute the command, send its reply and evaluate the returned
+         * value
+         */
+        ret = rc_exec(conn, len);
+        if (rc_send(conn) < 0)
+            ret = ROBIN_CMD_ERR;
 
-        /* search for the command */
-        for (cmd = robin_cmds; cmd->name != NULL; cmd++) {
-            if (!strcmp(conn->argv[0], cmd->name)) {
-                info("recognized command: %s", buf);
-                /* execute cmd and evaluate the returned value */
-                switch (cmd->fn(conn)) {
-                    case ROBIN_CMD_OK:
-                        break;
-
-                    case ROBIN_CMD_ERR:
-                        err("failed to execute the requested command");
-                    case ROBIN_CMD_QUIT:
-                        goto manager_quit;
-                }
+        switch (ret) {
+            case ROBIN_CMD_OK:
                 break;
-            }
-        }
 
-        if (cmd->name == NULL)
-            if (rc_reply(conn, "-1 invalid command; type help for the list of "
-                               "availble commands") < 0) {
-                err("failed to send invalid command reply");
+            case ROBIN_CMD_ERR:
+                err("failed to execute the requested command");
+            case ROBIN_CMD_QUIT:
                 goto manager_quit;
-            }
-
-        free(buf);
+        }
     }
 
 manager_quit:
+    rc_push_unsubscribe(conn);
     if (conn->logged)
         robin_user_release(conn->uid);
     rc_free(conn);
@@ -821,6 +1723,7 @@ void robin_conn_terminate(int id)
     robin_conn_t *conn = robin_conns[id];
 
     if (conn) {
+        rc_push_unsubscribe(conn);
         if (conn->logged)
             robin_user_release(conn->uid);
         socket_close(conn->fd);
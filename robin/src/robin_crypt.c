@@ -0,0 +1,236 @@
+/*
+ * robin_crypt.c
+ *
+ * The Robin Crypt Pool runs the password hashing (crypt_r) on a dedicated
+ * set of workers, fed by a bounded queue.
+ *
+ * Hashing is the most expensive step of login and registration: running it
+ * here keeps it out of the connection threads' critical sections and bounds
+ * the CPU spent on it during login storms.
+ *
+ * Luca Zulberti <l.zulberti@studenti.unipi.it>
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <crypt.h>
+#include <pthread.h>
+
+#include "robin.h"
+#include "robin_crypt.h"
+#include "lib/password.h"
+
+
+/*
+ * Log shortcuts
+ */
+
+#define err(fmt, args...)  robin_log_err(ROBIN_LOG_ID_CRYPT, fmt, ## args)
+#define warn(fmt, args...) robin_log_warn(ROBIN_LOG_ID_CRYPT, fmt, ## args)
+#define info(fmt, args...) robin_log_info(ROBIN_LOG_ID_CRYPT, fmt, ## args)
+#define dbg(fmt, args...)  robin_log_dbg(ROBIN_LOG_ID_CRYPT, fmt, ## args)
+
+
+/*
+ * Robin Crypt types and data
+ */
+
+#define ROBIN_CRYPT_QUEUE_LEN 64
+
+typedef struct robin_crypt_job {
+    char *psw_hashed;
+    const char *psw;
+    const char *salt;
+
+    /* completion, protected by queue_mutex */
+    int done;
+    int ret;
+    pthread_cond_t done_cond;
+} robin_crypt_job_t;
+
+typedef struct robin_crypt_worker {
+    pthread_t thread;
+    unsigned int id;
+    struct crypt_data *data; /* crypt_r scratch area, reused for each job */
+} robin_crypt_worker_t;
+
+static robin_crypt_worker_t *rcw_pool;
+static int rcw_pool_len = 0; /* workers spawned */
+
+/* bounded FIFO of pending jobs */
+static robin_crypt_job_t *queue[ROBIN_CRYPT_QUEUE_LEN];
+static unsigned int queue_head = 0, queue_len = 0;
+static int queue_stop = 0;
+static pthread_cond_t  queue_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  queue_not_full = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * Local functions
+ */
+
+static robin_crypt_job_t *rcw_queue_pop(void)
+{
+    robin_crypt_job_t *job;
+
+    pthread_mutex_lock(&queue_mutex);
+    while (queue_len == 0 && !queue_stop)
+        pthread_cond_wait(&queue_not_empty, &queue_mutex);
+
+    if (queue_len == 0) {
+        /* stop requested and nothing left to do */
+        pthread_mutex_unlock(&queue_mutex);
+        return NULL;
+    }
+
+    job = queue[queue_head];
+    queue_head = (queue_head + 1) % ROBIN_CRYPT_QUEUE_LEN;
+    queue_len--;
+
+    pthread_cond_signal(&queue_not_full);
+    pthread_mutex_unlock(&queue_mutex);
+
+    return job;
+}
+
+static void *rcw_loop(void *ctx)
+{
+    robin_crypt_worker_t *me = (robin_crypt_worker_t *) ctx;
+    robin_crypt_job_t *job;
+    int ret;
+
+    while ((job = rcw_queue_pop()) != NULL) {
+        ret = password_hash_r(job->psw_hashed, job->psw, job->salt, me->data);
+
+        pthread_mutex_lock(&queue_mutex);
+        job->ret = ret;
+        job->done = 1;
+        pthread_cond_signal(&job->done_cond);
+        pthread_mutex_unlock(&queue_mutex);
+    }
+
+    dbg("worker #%u: terminated", me->id);
+
+    pthread_exit(NULL);
+}
+
+
+/*
+ * Exported functions
+ */
+
+int robin_crypt_pool_init(void)
+{
+    long nprocs;
+    int ret;
+
+    /* hashing is CPU bound, one worker per cpu */
+    nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nprocs < 1)
+        nprocs = 1;
+
+    rcw_pool = calloc(nprocs, sizeof(robin_crypt_worker_t));
+    if (!rcw_pool) {
+        err("calloc: %s", strerror(errno));
+        return -1;
+    }
+
+    info("spawning %ld Robin Crypt workers...", nprocs);
+
+    /* no worker yet, a previous free may have left the stop request */
+    queue_stop = 0;
+
+    for (int i = 0; i < nprocs; i++) {
+        rcw_pool[i].id = i;
+
+        rcw_pool[i].data = calloc(1, sizeof(struct crypt_data));
+        if (!rcw_pool[i].data) {
+            err("calloc: %s", strerror(errno));
+            goto init_fail;
+        }
+
+        ret = pthread_create(&rcw_pool[i].thread, NULL, rcw_loop, &rcw_pool[i]);
+        if (ret) {
+            err("pthread_create: %s", strerror(ret));
+            free(rcw_pool[i].data);
+            goto init_fail;
+        }
+        rcw_pool_len++;
+    }
+
+    return 0;
+
+init_fail:
+    /* stop and join the workers already spawned */
+    robin_crypt_pool_free();
+    return -1;
+}
+
+int robin_crypt_hash(char *psw_hashed, const char *psw, const char *salt)
+{
+    robin_crypt_job_t job = {
+        .psw_hashed = psw_hashed,
+        .psw = psw,
+        .salt = salt,
+        .done = 0,
+        .ret = -1,
+    };
+    int cancel_state;
+
+    /*
+     * The job lives on this stack: the caller must not be cancelled while a
+     * worker can still reference it. The wait is bounded by one crypt_r.
+     */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+
+    pthread_cond_init(&job.done_cond, NULL);
+
+    pthread_mutex_lock(&queue_mutex);
+
+    while (queue_len == ROBIN_CRYPT_QUEUE_LEN)
+        pthread_cond_wait(&queue_not_full, &queue_mutex);
+
+    queue[(queue_head + queue_len) % ROBIN_CRYPT_QUEUE_LEN] = &job;
+    queue_len++;
+    pthread_cond_signal(&queue_not_empty);
+
+    while (!job.done)
+        pthread_cond_wait(&job.done_cond, &queue_mutex);
+
+    pthread_mutex_unlock(&queue_mutex);
+
+    pthread_cond_destroy(&job.done_cond);
+
+    pthread_setcancelstate(cancel_state, NULL);
+
+    if (job.ret < 0)
+        err("hash: failed to hash the password");
+
+    return job.ret;
+}
+
+void robin_crypt_pool_free(void)
+{
+    if (!rcw_pool)
+        return;
+
+    pthread_mutex_lock(&queue_mutex);
+    queue_stop = 1;
+    pthread_cond_broadcast(&queue_not_empty);
+    pthread_mutex_unlock(&queue_mutex);
+
+    for (int i = 0; i < rcw_pool_len; i++) {
+        dbg("join: worker=%d, t=%p", i, rcw_pool[i].thread);
+        pthread_join(rcw_pool[i].thread, NULL);
+
+        dbg("free: data=%p", rcw_pool[i].data);
+        free(rcw_pool[i].data);
+    }
+
+    dbg("free: rcw_pool=%p", rcw_pool);
+    free(rcw_pool);
+    rcw_pool = NULL;
+    rcw_pool_len = 0;
+}
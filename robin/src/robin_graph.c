@@ -0,0 +1,574 @@
+/*
+ * robin_graph.c
+ *
+ * Persists the Robin follow graph. The in-memory graph is owned by the user
+ * module, this one only knows about uids and the files:
+ *
+ *  - the snapshot, in CSR (compressed sparse row) form: a header, the row
+ *    offsets and the targets. Row f lists the followers of uid f, sorted;
+ *  - the journal, a sequence of fixed-size binary records for the edges
+ *    followed or unfollowed after the snapshot.
+ *
+ * Replaying a record sets the state of its edge, so records already reflected
+ * by the snapshot can be replayed again safely: this allows to write a
+ * snapshot while the graph keeps changing, and to crash between the snapshot
+ * rename and the journal truncation or rotation.
+ *
+ * Luca Zulberti <l.zulberti@studenti.unipi.it>
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "robin.h"
+#include "robin_graph.h"
+#include "robin_journal.h"
+
+
+/*
+ * Log shortcuts
+ */
+
+#define err(fmt, args...)  robin_log_err(ROBIN_LOG_ID_GRAPH, fmt, ## args)
+#define warn(fmt, args...) robin_log_warn(ROBIN_LOG_ID_GRAPH, fmt, ## args)
+#define info(fmt, args...) robin_log_info(ROBIN_LOG_ID_GRAPH, fmt, ## args)
+#define dbg(fmt, args...)  robin_log_dbg(ROBIN_LOG_ID_GRAPH, fmt, ## args)
+
+
+/*
+ * Local types and macros
+ */
+
+#define ROBIN_GRAPH_MAGIC   0x48505247 /* "GRPH" */
+#define ROBIN_GRAPH_VERSION 1
+
+/* journal records since the last snapshot that trigger a compaction */
+#define ROBIN_GRAPH_COMPACT_RECORDS (1 << 20)
+
+#define ROBIN_GRAPH_JOURNAL_FLUSH_SIZE (64 * 1024)
+#define ROBIN_GRAPH_JOURNAL_FLUSH_MS   100
+
+/* journal record: op, follower and followee in host byte order */
+#define ROBIN_GRAPH_RECORD_LEN (1 + 2 * sizeof(uint32_t))
+
+/* batches up to this many records are encoded on the stack */
+#define ROBIN_GRAPH_LOG_STACK 32
+
+typedef struct robin_graph_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t journal_off; /* journal records before this are reflected */
+    uint64_t users;       /* rows */
+    uint64_t edges;       /* targets */
+    /* followed by uint64_t offsets[users + 1] and uint32_t targets[edges] */
+} robin_graph_hdr_t;
+
+
+/*
+ * Local data
+ */
+
+static robin_graph_ops_t graph_ops;
+static char *graph_snapshot = NULL;
+static robin_journal_t *graph_journal = NULL;
+
+/* background compaction */
+static pthread_mutex_t graph_compact_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t graph_compactor;
+static int graph_compactor_spawned = 0;
+static int graph_compacting = 0;
+static uint64_t graph_records = 0; /* since the last snapshot */
+
+
+/*
+ * Local functions
+ */
+
+static int rg_uid_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+static int rg_apply(robin_graph_op_t op, uint64_t follower, uint64_t followee,
+                    uint64_t users, size_t *skipped)
+{
+    /* the users file may have lost registrations the graph knows about */
+    if (follower >= users || followee >= users || follower == followee) {
+        (*skipped)++;
+        return 0;
+    }
+
+    return graph_ops.apply(op, follower, followee);
+}
+
+static int rg_snapshot_load(const char *path, uint64_t *journal_off)
+{
+    const robin_graph_hdr_t *hdr;
+    const uint64_t *offsets;
+    const uint32_t *targets;
+    struct stat st;
+    size_t skipped = 0;
+    uint64_t users;
+    void *map;
+    int fd, ret = 0;
+
+    *journal_off = 0;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            dbg("load: no snapshot %s", path);
+            return 0;
+        }
+
+        err("open: %s", strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        err("fstat: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if ((size_t) st.st_size < sizeof(robin_graph_hdr_t)) {
+        err("load: snapshot %s is truncated", path);
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        err("mmap: %s", strerror(errno));
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    hdr = map;
+    if (hdr->magic != ROBIN_GRAPH_MAGIC || hdr->version != ROBIN_GRAPH_VERSION
+        || hdr->users > UINT32_MAX
+        || hdr->edges > (uint64_t) st.st_size / sizeof(uint32_t)
+        || (uint64_t) st.st_size != sizeof(robin_graph_hdr_t)
+                                    + (hdr->users + 1) * sizeof(uint64_t)
+                                    + hdr->edges * sizeof(uint32_t)) {
+        err("load: snapshot %s is corrupted", path);
+        ret = -1;
+        goto load_quit;
+    }
+
+    offsets = (const uint64_t *) (hdr + 1);
+    targets = (const uint32_t *) (offsets + hdr->users + 1);
+    users = graph_ops.users();
+
+    for (uint64_t f = 0; f < hdr->users; f++) {
+        if (offsets[f] > offsets[f + 1] || offsets[f + 1] > hdr->edges) {
+            err("load: snapshot %s has invalid offsets", path);
+            ret = -1;
+            goto load_quit;
+        }
+
+        for (uint64_t e = offsets[f]; e < offsets[f + 1]; e++) {
+            ret = rg_apply(ROBIN_GRAPH_FOLLOW, targets[e], f, users, &skipped);
+            if (ret)
+                goto load_quit;
+        }
+    }
+
+    if (skipped)
+        warn("load: %zu edges of unknown users skipped", skipped);
+
+    info("load: %llu edges loaded from snapshot",
+         (unsigned long long) hdr->edges);
+
+    *journal_off = hdr->journal_off;
+
+load_quit:
+    munmap(map, st.st_size);
+
+    return ret;
+}
+
+static int rg_journal_replay(const char *path, uint64_t off, size_t *replayed)
+{
+    uint32_t follower, followee;
+    const uint8_t *rec;
+    struct stat st;
+    size_t skipped = 0;
+    uint64_t users;
+    void *map;
+    int fd, ret = 0;
+
+    *replayed = 0;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return 0;
+
+        err("open: %s", strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        err("fstat: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    /* the journal lost its tail in a crash, the snapshot reflects it */
+    if ((uint64_t) st.st_size <= off) {
+        close(fd);
+        return 0;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        err("mmap: %s", strerror(errno));
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    users = graph_ops.users();
+
+    /* a partial record at the end was being written during a crash */
+    for (rec = (const uint8_t *) map + off;
+         rec + ROBIN_GRAPH_RECORD_LEN <= (const uint8_t *) map + st.st_size;
+         rec += ROBIN_GRAPH_RECORD_LEN) {
+        if (rec[0] != ROBIN_GRAPH_FOLLOW && rec[0] != ROBIN_GRAPH_UNFOLLOW) {
+            err("replay: invalid record at offset %td",
+                rec - (const uint8_t *) map);
+            ret = -1;
+            break;
+        }
+
+        memcpy(&follower, rec + 1, sizeof(uint32_t));
+        memcpy(&followee, rec + 1 + sizeof(uint32_t), sizeof(uint32_t));
+
+        ret = rg_apply(rec[0], follower, followee, users, &skipped);
+        if (ret)
+            break;
+
+        (*replayed)++;
+    }
+
+    if (skipped)
+        warn("replay: %zu edges of unknown users skipped", skipped);
+
+    munmap(map, st.st_size);
+
+    return ret;
+}
+
+static int rg_write_all(FILE *fp, const void *buf, size_t len)
+{
+    if (len && fwrite(buf, len, 1, fp) != 1) {
+        err("fwrite: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* drop the journal records reflected by the snapshot just put in place */
+static int rg_journal_cut(int truncate, uint64_t off)
+{
+    if (truncate)
+        return robin_journal_truncate(graph_journal);
+
+    return robin_journal_rotate(graph_journal, off);
+}
+
+/*
+ * Write a snapshot of the in-memory graph. With truncate, the graph must not
+ * change meanwhile and the journal is emptied once the snapshot is in place;
+ * otherwise the journal is rotated, keeping the records that may be missing.
+ * An owner that saves the graph itself gets a snapshot file only if asked.
+ */
+static int rg_compact(int truncate, int snapshot)
+{
+    robin_graph_hdr_t hdr = {
+        .magic = ROBIN_GRAPH_MAGIC,
+        .version = ROBIN_GRAPH_VERSION
+    };
+    uint64_t *offsets = NULL;
+    uint32_t *targets = NULL, *row = NULL;
+    size_t targets_cap = 0, row_cap = 0, tmp_len;
+    char *tmp = NULL;
+    uint64_t off;
+    ssize_t n;
+    FILE *fp;
+    int ret = -1;
+
+    pthread_mutex_lock(&graph_compact_mutex);
+
+    /*
+     * Records before this offset were applied before the rows are read,
+     * those after it are kept by the rotation. The snapshot replays the whole
+     * journal (journal_off stays 0), which is right both before and after the
+     * rotation replaces it.
+     */
+    off = robin_journal_size(graph_journal);
+    __atomic_store_n(&graph_records, 0, __ATOMIC_RELAXED);
+
+    /* the owner saves the graph, no snapshot file */
+    if (graph_ops.save && !snapshot) {
+        if (graph_ops.save(hdr.journal_off) < 0
+            || rg_journal_cut(truncate, off) < 0)
+            goto compact_quit;
+
+        info("compact: graph saved");
+        ret = 0;
+        goto compact_quit;
+    }
+
+    hdr.users = graph_ops.users();
+    offsets = malloc((hdr.users + 1) * sizeof(uint64_t));
+    if (!offsets) {
+        err("malloc: %s", strerror(errno));
+        goto compact_quit;
+    }
+
+    offsets[0] = 0;
+    for (uint64_t f = 0; f < hdr.users; f++) {
+        n = graph_ops.followers(f, &row, &row_cap);
+        if (n < 0)
+            goto compact_quit;
+
+        if (offsets[f] + n > targets_cap) {
+            size_t new_cap = targets_cap ? targets_cap : 1024;
+            uint32_t *new_targets;
+
+            while (new_cap < offsets[f] + n)
+                new_cap *= 2;
+
+            new_targets = realloc(targets, new_cap * sizeof(uint32_t));
+            if (!new_targets) {
+                err("realloc: %s", strerror(errno));
+                goto compact_quit;
+            }
+            targets = new_targets;
+            targets_cap = new_cap;
+        }
+
+        qsort(row, n, sizeof(uint32_t), rg_uid_cmp);
+        memcpy(targets + offsets[f], row, n * sizeof(uint32_t));
+        offsets[f + 1] = offsets[f] + n;
+    }
+    hdr.edges = offsets[hdr.users];
+
+    tmp_len = strlen(graph_snapshot) + sizeof(".tmp");
+    tmp = malloc(tmp_len);
+    if (!tmp) {
+        err("malloc: %s", strerror(errno));
+        goto compact_quit;
+    }
+    snprintf(tmp, tmp_len, "%s.tmp", graph_snapshot);
+
+    fp = fopen(tmp, "w");
+    if (!fp) {
+        err("fopen: %s", strerror(errno));
+        goto compact_quit;
+    }
+
+    if (rg_write_all(fp, &hdr, sizeof(hdr))
+        || rg_write_all(fp, offsets, (hdr.users + 1) * sizeof(uint64_t))
+        || rg_write_all(fp, targets, hdr.edges * sizeof(uint32_t))
+        || fflush(fp) || fsync(fileno(fp)) < 0) {
+        err("compact: cannot write %s: %s", tmp, strerror(errno));
+        fclose(fp);
+        unlink(tmp);
+        goto compact_quit;
+    }
+    fclose(fp);
+
+    if (rename(tmp, graph_snapshot) < 0) {
+        err("rename: %s", strerror(errno));
+        unlink(tmp);
+        goto compact_quit;
+    }
+
+    /* saved after the snapshot, the owner copy is never the older one */
+    if (graph_ops.save && graph_ops.save(hdr.journal_off) < 0)
+        goto compact_quit;
+
+    if (rg_journal_cut(truncate, off) < 0)
+        goto compact_quit;
+
+    info("compact: %llu edges of %llu users saved",
+         (unsigned long long) hdr.edges, (unsigned long long) hdr.users);
+
+    ret = 0;
+
+compact_quit:
+    pthread_mutex_unlock(&graph_compact_mutex);
+
+    free(tmp);
+    free(row);
+    free(targets);
+    free(offsets);
+
+    return ret;
+}
+
+static void *rg_compactor(void *arg)
+{
+    (void) arg;
+
+    rg_compact(0, 0);
+
+    __atomic_store_n(&graph_compacting, 0, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+
+/*
+ * Exported functions
+ */
+
+int robin_graph_open(const char *snapshot, const char *journal,
+                     const robin_graph_ops_t *ops)
+{
+    robin_journal_opts_t opts = {
+        .flush_size = ROBIN_GRAPH_JOURNAL_FLUSH_SIZE,
+        .flush_ms = ROBIN_GRAPH_JOURNAL_FLUSH_MS,
+        .sync = 0
+    };
+    uint64_t off;
+    size_t replayed;
+    int restored = 0;
+
+    graph_ops = *ops;
+
+    if (graph_ops.restore) {
+        restored = graph_ops.restore(&off);
+        if (restored < 0)
+            return -1;
+    }
+
+    /* the snapshot migrates to the owner store the first time */
+    if (!graph_ops.restore || restored == 1) {
+        if (rg_snapshot_load(snapshot, &off) < 0)
+            return -1;
+    }
+
+    if (rg_journal_replay(journal, off, &replayed) < 0)
+        return -1;
+
+    info("open: %zu journal records replayed", replayed);
+
+    graph_snapshot = malloc(strlen(snapshot) + 1);
+    if (!graph_snapshot) {
+        err("malloc: %s", strerror(errno));
+        return -1;
+    }
+    strcpy(graph_snapshot, snapshot);
+
+    graph_journal = robin_journal_open(journal, &opts);
+    if (!graph_journal) {
+        free(graph_snapshot);
+        graph_snapshot = NULL;
+        return -1;
+    }
+
+    /* start from an empty journal, dropping a partial record if any */
+    if ((robin_journal_size(graph_journal) || restored == 1)
+        && rg_compact(1, 0) < 0) {
+        robin_journal_close(graph_journal);
+        graph_journal = NULL;
+        free(graph_snapshot);
+        graph_snapshot = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int robin_graph_log(robin_graph_op_t op, uint32_t follower,
+                    const uint32_t *followees, size_t n)
+{
+    uint8_t stack_buf[ROBIN_GRAPH_LOG_STACK * ROBIN_GRAPH_RECORD_LEN];
+    uint8_t *buf = stack_buf, *rec;
+    int ret;
+
+    if (!graph_journal || !n)
+        return 0;
+
+    if (n > ROBIN_GRAPH_LOG_STACK) {
+        buf = malloc(n * ROBIN_GRAPH_RECORD_LEN);
+        if (!buf) {
+            err("malloc: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        rec = buf + i * ROBIN_GRAPH_RECORD_LEN;
+        rec[0] = op;
+        memcpy(rec + 1, &follower, sizeof(uint32_t));
+        memcpy(rec + 1 + sizeof(uint32_t), &followees[i], sizeof(uint32_t));
+    }
+
+    /* one append keeps the records of the batch together */
+    ret = robin_journal_append(graph_journal, buf, n * ROBIN_GRAPH_RECORD_LEN);
+
+    if (buf != stack_buf)
+        free(buf);
+
+    if (ret < 0)
+        return -1;
+
+    if (__atomic_add_fetch(&graph_records, n, __ATOMIC_RELAXED)
+            < ROBIN_GRAPH_COMPACT_RECORDS
+        || __atomic_exchange_n(&graph_compacting, 1, __ATOMIC_ACQUIRE))
+        return 0;
+
+    /* the previous compactor, if any, has already finished */
+    if (graph_compactor_spawned)
+        pthread_join(graph_compactor, NULL);
+
+    ret = pthread_create(&graph_compactor, NULL, rg_compactor, NULL);
+    if (ret) {
+        err("pthread_create: %s", strerror(ret));
+        graph_compactor_spawned = 0;
+        __atomic_store_n(&graph_compacting, 0, __ATOMIC_RELEASE);
+        return 0;
+    }
+    graph_compactor_spawned = 1;
+
+    dbg("log: compaction started");
+
+    return 0;
+}
+
+void robin_graph_close(void)
+{
+    if (!graph_journal)
+        return;
+
+    if (graph_compactor_spawned) {
+        pthread_join(graph_compactor, NULL);
+        graph_compactor_spawned = 0;
+    }
+
+    /* the snapshot stays current for the runs where the owner does not save */
+    if (robin_journal_flush(graph_journal) < 0 || rg_compact(1, 1) < 0)
+        err("close: graph not compacted, the journal is kept");
+
+    robin_journal_close(graph_journal);
+    graph_journal = NULL;
+
+    free(graph_snapshot);
+    graph_snapshot = NULL;
+}
@@ -0,0 +1,488 @@
+/*
+ * robin_journal.c
+ *
+ * Robin Journals: append-only files with a long-lived descriptor and a
+ * dedicated writer thread.
+ *
+ * Appenders copy records in the front buffer under the journal mutex; the
+ * writer swaps it with the back buffer and writes it out with no lock held,
+ * when enough bytes are pending, when the flush interval expires or when a
+ * flush is requested. Callers never wait for the disk unless they ask to.
+ *
+ * Luca Zulberti <l.zulberti@studenti.unipi.it>
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "robin.h"
+#include "robin_journal.h"
+
+
+/*
+ * Log shortcuts
+ */
+
+#define err(fmt, args...)  robin_log_err(ROBIN_LOG_ID_JOURNAL, fmt, ## args)
+#define warn(fmt, args...) robin_log_warn(ROBIN_LOG_ID_JOURNAL, fmt, ## args)
+#define info(fmt, args...) robin_log_info(ROBIN_LOG_ID_JOURNAL, fmt, ## args)
+#define dbg(fmt, args...)  robin_log_dbg(ROBIN_LOG_ID_JOURNAL, fmt, ## args)
+
+
+/*
+ * Local types and macros
+ */
+
+#define ROBIN_JOURNAL_BUF_MAX (1 << 20) /* appenders wait beyond this */
+#define ROBIN_JOURNAL_COPY_LEN (64 * 1024) /* rotation copies this at once */
+
+typedef struct robin_journal_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+} robin_journal_buf_t;
+
+struct robin_journal {
+    int fd;
+    char *path;
+    robin_journal_opts_t opts;
+
+    robin_journal_buf_t front; /* filled by appenders */
+    robin_journal_buf_t back;  /* written by the writer */
+
+    uint64_t base;     /* file size at open */
+    uint64_t appended; /* bytes appended since open or truncation */
+    uint64_t written;  /* bytes written since open or truncation */
+    int flush_req;     /* a flush or a truncation is waited for */
+    int failed;        /* the writer could not write */
+    int stop;
+
+    pthread_t writer;
+    pthread_mutex_t mutex;
+    pthread_cond_t pending_cond; /* wakes the writer */
+    pthread_cond_t written_cond; /* wakes appenders and flushers */
+};
+
+
+/*
+ * Local functions
+ */
+
+static int rj_write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* copy the bytes of in from off to end at the end of out */
+static int rj_copy(int in, int out, uint64_t off, uint64_t end)
+{
+    char buf[ROBIN_JOURNAL_COPY_LEN];
+    ssize_t n;
+
+    while (off < end) {
+        n = pread(in, buf, end - off < sizeof(buf) ? end - off : sizeof(buf),
+                  off);
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0) {
+            err("pread: %s", n < 0 ? strerror(errno) : "unexpected end");
+            return -1;
+        }
+
+        if (rj_write_all(out, buf, n) < 0) {
+            err("write: %s", strerror(errno));
+            return -1;
+        }
+
+        off += n;
+    }
+
+    return 0;
+}
+
+static void rj_deadline(struct timespec *ts, unsigned int ms)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static int rj_flush_unsafe(robin_journal_t *j)
+{
+    uint64_t target = j->appended;
+
+    while (j->written < target && !j->failed) {
+        j->flush_req = 1;
+        pthread_cond_signal(&j->pending_cond);
+        pthread_cond_wait(&j->written_cond, &j->mutex);
+    }
+
+    return j->failed ? -1 : 0;
+}
+
+static void *rj_loop(void *ctx)
+{
+    robin_journal_t *j = (robin_journal_t *) ctx;
+    robin_journal_buf_t tmp;
+    struct timespec deadline;
+    uint64_t target;
+    int ret;
+
+    pthread_mutex_lock(&j->mutex);
+
+    while (1) {
+        /* wait for enough bytes, a flush request or the interval to expire */
+        rj_deadline(&deadline, j->opts.flush_ms);
+        while (!j->stop && !j->flush_req && j->front.len < j->opts.flush_size)
+            if (pthread_cond_timedwait(&j->pending_cond, &j->mutex,
+                                       &deadline) == ETIMEDOUT)
+                break;
+
+        if (j->front.len == 0) {
+            j->flush_req = 0;
+            pthread_cond_broadcast(&j->written_cond);
+
+            if (j->stop)
+                break;
+
+            continue;
+        }
+
+        /* take the pending bytes and write them without the lock */
+        tmp = j->back;
+        j->back = j->front;
+        j->front = tmp;
+        j->front.len = 0;
+        target = j->appended;
+        j->flush_req = 0;
+
+        /* appenders may be waiting for room in the front buffer */
+        pthread_cond_broadcast(&j->written_cond);
+
+        pthread_mutex_unlock(&j->mutex);
+
+        ret = rj_write_all(j->fd, j->back.data, j->back.len);
+        if (ret < 0)
+            err("write: %s", strerror(errno));
+        else if (j->opts.sync && fdatasync(j->fd) < 0) {
+            err("fdatasync: %s", strerror(errno));
+            ret = -1;
+        }
+
+        dbg("writer: %zu bytes written", j->back.len);
+        j->back.len = 0;
+
+        pthread_mutex_lock(&j->mutex);
+
+        if (ret < 0)
+            j->failed = 1;
+        j->written = target;
+
+        pthread_cond_broadcast(&j->written_cond);
+    }
+
+    pthread_mutex_unlock(&j->mutex);
+
+    return NULL;
+}
+
+
+/*
+ * Exported functions
+ */
+
+robin_journal_t *robin_journal_open(const char *path,
+                                    const robin_journal_opts_t *opts)
+{
+    robin_journal_t *j;
+    struct stat st;
+    int ret;
+
+    j = calloc(1, sizeof(robin_journal_t));
+    if (!j) {
+        err("calloc: %s", strerror(errno));
+        return NULL;
+    }
+
+    j->opts = *opts;
+    if (j->opts.flush_size > ROBIN_JOURNAL_BUF_MAX)
+        j->opts.flush_size = ROBIN_JOURNAL_BUF_MAX;
+
+    j->path = malloc(strlen(path) + 1);
+    if (!j->path) {
+        err("malloc: %s", strerror(errno));
+        free(j);
+        return NULL;
+    }
+    strcpy(j->path, path);
+
+    j->fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (j->fd < 0) {
+        err("open: %s", strerror(errno));
+        free(j->path);
+        free(j);
+        return NULL;
+    }
+
+    if (fstat(j->fd, &st) < 0) {
+        err("fstat: %s", strerror(errno));
+        close(j->fd);
+        free(j->path);
+        free(j);
+        return NULL;
+    }
+    j->base = st.st_size;
+
+    pthread_mutex_init(&j->mutex, NULL);
+    pthread_cond_init(&j->pending_cond, NULL);
+    pthread_cond_init(&j->written_cond, NULL);
+
+    ret = pthread_create(&j->writer, NULL, rj_loop, j);
+    if (ret) {
+        err("pthread_create: %s", strerror(ret));
+        close(j->fd);
+        free(j->path);
+        free(j);
+        return NULL;
+    }
+
+    dbg("open: %s fd=%d", path, j->fd);
+
+    return j;
+}
+
+int robin_journal_append(robin_journal_t *j, const void *buf, size_t len)
+{
+    size_t new_cap;
+    char *new_data;
+    int ret = 0;
+
+    pthread_mutex_lock(&j->mutex);
+
+    /* back-pressure: the writer is too slow, wait for the next swap */
+    while (j->front.len && j->front.len + len > ROBIN_JOURNAL_BUF_MAX) {
+        pthread_cond_signal(&j->pending_cond);
+        pthread_cond_wait(&j->written_cond, &j->mutex);
+    }
+
+    if (j->front.len + len > j->front.cap) {
+        new_cap = j->front.cap ? j->front.cap : 4096;
+        while (new_cap < j->front.len + len)
+            new_cap *= 2;
+
+        new_data = realloc(j->front.data, new_cap);
+        if (!new_data) {
+            err("realloc: %s", strerror(errno));
+            ret = -1;
+            goto append_quit;
+        }
+        j->front.data = new_data;
+        j->front.cap = new_cap;
+    }
+
+    memcpy(j->front.data + j->front.len, buf, len);
+    j->front.len += len;
+    j->appended += len;
+
+    if (j->front.len >= j->opts.flush_size)
+        pthread_cond_signal(&j->pending_cond);
+
+append_quit:
+    pthread_mutex_unlock(&j->mutex);
+
+    return ret;
+}
+
+int robin_journal_flush(robin_journal_t *j)
+{
+    int ret;
+
+    pthread_mutex_lock(&j->mutex);
+    ret = rj_flush_unsafe(j);
+    pthread_mutex_unlock(&j->mutex);
+
+    return ret;
+}
+
+int robin_journal_truncate(robin_journal_t *j)
+{
+    int ret;
+
+    pthread_mutex_lock(&j->mutex);
+
+    /* with everything written the writer is idle until the next append */
+    ret = rj_flush_unsafe(j);
+    if (ret < 0)
+        goto truncate_quit;
+
+    ret = ftruncate(j->fd, 0);
+    if (ret < 0) {
+        err("ftruncate: %s", strerror(errno));
+        goto truncate_quit;
+    }
+
+    if (j->opts.sync && fdatasync(j->fd) < 0)
+        err("fdatasync: %s", strerror(errno));
+
+    j->base = 0;
+    j->appended = 0;
+    j->written = 0;
+
+truncate_quit:
+    pthread_mutex_unlock(&j->mutex);
+
+    return ret;
+}
+
+int robin_journal_rotate(robin_journal_t *j, uint64_t off)
+{
+    uint64_t mid, end;
+    size_t tmp_len;
+    char *tmp;
+    int in, out, ret = -1;
+
+    tmp_len = strlen(j->path) + sizeof(".tmp");
+    tmp = malloc(tmp_len);
+    if (!tmp) {
+        err("malloc: %s", strerror(errno));
+        return -1;
+    }
+    snprintf(tmp, tmp_len, "%s.tmp", j->path);
+
+    in = open(j->path, O_RDONLY);
+    if (in < 0) {
+        err("open: %s", strerror(errno));
+        free(tmp);
+        return -1;
+    }
+
+    out = open(tmp, O_WRONLY | O_APPEND | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        err("open: %s", strerror(errno));
+        goto rotate_quit;
+    }
+
+    /* the bulk of the records is copied while appenders go on */
+    pthread_mutex_lock(&j->mutex);
+    ret = rj_flush_unsafe(j);
+    mid = j->base + j->appended;
+    pthread_mutex_unlock(&j->mutex);
+
+    if (ret < 0 || off > mid || rj_copy(in, out, off, mid) < 0) {
+        ret = -1;
+        goto rotate_quit;
+    }
+
+    /* the rest with the appenders waiting, then the new file takes over */
+    pthread_mutex_lock(&j->mutex);
+
+    ret = rj_flush_unsafe(j);
+    end = j->base + j->appended;
+    if (ret < 0 || rj_copy(in, out, mid, end) < 0) {
+        ret = -1;
+        goto rotate_unlock;
+    }
+
+    if (fdatasync(out) < 0) {
+        err("fdatasync: %s", strerror(errno));
+        ret = -1;
+        goto rotate_unlock;
+    }
+
+    if (rename(tmp, j->path) < 0) {
+        err("rename: %s", strerror(errno));
+        ret = -1;
+        goto rotate_unlock;
+    }
+
+    close(j->fd);
+    j->fd = out;
+    out = -1;
+
+    j->base = end - off;
+    j->appended = 0;
+    j->written = 0;
+
+    dbg("rotate: %llu bytes dropped, %llu kept", (unsigned long long) off,
+        (unsigned long long) (end - off));
+
+rotate_unlock:
+    pthread_mutex_unlock(&j->mutex);
+
+rotate_quit:
+    if (out >= 0) {
+        close(out);
+        unlink(tmp);
+    }
+    close(in);
+    free(tmp);
+
+    return ret;
+}
+
+uint64_t robin_journal_size(robin_journal_t *j)
+{
+    uint64_t size;
+
+    pthread_mutex_lock(&j->mutex);
+    size = j->base + j->appended;
+    pthread_mutex_unlock(&j->mutex);
+
+    return size;
+}
+
+void robin_journal_close(robin_journal_t *j)
+{
+    if (!j)
+        return;
+
+    pthread_mutex_lock(&j->mutex);
+    j->stop = 1;
+    pthread_cond_signal(&j->pending_cond);
+    pthread_mutex_unlock(&j->mutex);
+
+    /* the writer drains the front buffer before exiting */
+    pthread_join(j->writer, NULL);
+
+    if (j->opts.sync && fdatasync(j->fd) < 0)
+        err("fdatasync: %s", strerror(errno));
+    close(j->fd);
+
+    pthread_mutex_destroy(&j->mutex);
+    pthread_cond_destroy(&j->pending_cond);
+    pthread_cond_destroy(&j->written_cond);
+
+    dbg("close: fd=%d", j->fd);
+
+    free(j->front.data);
+    free(j->back.data);
+    free(j->path);
+    free(j);
+}
@@ -99,6 +99,26 @@ void _robin_log_print(robin_log_level_t log_lvl, robin_log_id_t id, const char *
                 id_str = "utility";
                 break;
 
+            case ROBIN_LOG_ID_CRYPT:
+                id_str = "crypt";
+                break;
+
+            case ROBIN_LOG_ID_SESSION:
+                id_str = "session";
+                break;
+
+            case ROBIN_LOG_ID_JOURNAL:
+                id_str = "journal";
+                break;
+
+            case ROBIN_LOG_ID_GRAPH:
+                id_str = "graph";
+                break;
+
+            case ROBIN_LOG_ID_STORE:
+                id_str = "store";
+                break;
+
             default:
                 id_str = "???";
                 break;
@@ -0,0 +1,111 @@
+/*
+ * robin_proto.c
+ *
+ * Command names of the opcodes shared by Robin Server and Robin API.
+ *
+ * Luca Zulberti <l.zulberti@studenti.unipi.it>
+ */
+
+#include "robin.h"
+#include "robin_proto.h"
+
+
+/*
+ * Local data
+ */
+
+static const char *robin_op_names[ROBIN_OP_MAX] = {
+    [ROBIN_OP_HELP] = "help",
+    [ROBIN_OP_HELLO] = "hello",
+    [ROBIN_OP_REGISTER] = "register",
+    [ROBIN_OP_LOGIN] = "login",
+    [ROBIN_OP_RESUME] = "resume",
+    [ROBIN_OP_LOGOUT] = "logout",
+    [ROBIN_OP_FOLLOW] = "follow",
+    [ROBIN_OP_UNFOLLOW] = "unfollow",
+    [ROBIN_OP_FOLLOWING] = "following",
+    [ROBIN_OP_FOLLOWERS] = "followers",
+    [ROBIN_OP_SUGGEST] = "suggest",
+    [ROBIN_OP_MUTUALS] = "mutuals",
+    [ROBIN_OP_COMMON] = "common",
+    [ROBIN_OP_CIP] = "cip",
+    [ROBIN_OP_CIPS_SINCE] = "cips_since",
+    [ROBIN_OP_HASHTAGS_SINCE] = "hashtags_since",
+    [ROBIN_OP_QUIT] = "quit",
+    [ROBIN_OP_SUBSCRIBE] = "subscribe",
+    [ROBIN_OP_BATCH] = "batch",
+};
+
+
+/*
+ * Exported functions
+ */
+
+robin_op_t robin_op_lookup(const char *name, size_t len)
+{
+    robin_op_t op;
+
+    /* names of the same length differ in the tested byte */
+    switch (len) {
+        case 3:
+            op = ROBIN_OP_CIP;
+            break;
+
+        case 4:
+            op = name[0] == 'h' ? ROBIN_OP_HELP : ROBIN_OP_QUIT;
+            break;
+
+        case 5:
+            op = name[0] == 'h' ? ROBIN_OP_HELLO
+               : name[0] == 'l' ? ROBIN_OP_LOGIN
+               : ROBIN_OP_BATCH;
+            break;
+
+        case 6:
+            op = name[0] == 'l' ? ROBIN_OP_LOGOUT
+               : name[0] == 'f' ? ROBIN_OP_FOLLOW
+               : name[0] == 'r' ? ROBIN_OP_RESUME
+               : ROBIN_OP_COMMON;
+            break;
+
+        case 7:
+            op = name[0] == 's' ? ROBIN_OP_SUGGEST : ROBIN_OP_MUTUALS;
+            break;
+
+        case 8:
+            op = name[0] == 'r' ? ROBIN_OP_REGISTER : ROBIN_OP_UNFOLLOW;
+            break;
+
+        case 9:
+            /* "following", "followers" and "subscribe" */
+            op = name[0] == 's' ? ROBIN_OP_SUBSCRIBE
+               : name[6] == 'i' ? ROBIN_OP_FOLLOWING
+               : ROBIN_OP_FOLLOWERS;
+            break;
+
+        case 10:
+            op = ROBIN_OP_CIPS_SINCE;
+            break;
+
+        case 14:
+            op = ROBIN_OP_HASHTAGS_SINCE;
+            break;
+
+        default:
+            return ROBIN_OP_MAX;
+    }
+
+    /* the candidate has exactly len characters */
+    if (memcmp(name, robin_op_names[op], len))
+        return ROBIN_OP_MAX;
+
+    return op;
+}
+
+const char *robin_op_name(robin_op_t op)
+{
+    if (op >= ROBIN_OP_MAX)
+        return NULL;
+
+    return robin_op_names[op];
+}
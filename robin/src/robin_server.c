@@ -9,13 +9,17 @@
  * Luca Zulberti <l.zulberti@studenti.unipi.it>
  */
 
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "robin.h"
 #include "robin_cip.h"
+#include "robin_crypt.h"
+#include "robin_session.h"
 #include "robin_thread.h"
 #include "robin_user.h"
 #include "lib/socket.h"
@@ -61,7 +65,12 @@ static void welcome(void)
 
 static void usage(void)
 {
-    puts("usage: robin_server <host> <port>");
+    puts("usage: robin_server [-c <users>] [-u <path>] <host> <port>");
+    puts("\t-c:   keep the follow graph on disk (./users.db), with at most "
+         "<users>");
+    puts("\t      users in memory besides the logged ones");
+    puts("\t-u:   also listen on the local socket <path>, for clients on "
+         "this machine");
     puts("\thost: hostname where the server is executed");
     puts("\tport: port on which the server will listen for incoming "
          "connections");
@@ -75,10 +84,12 @@ static void usage(void)
 int main(int argc, char **argv)
 {
     struct sigaction act;
-    char *h_name;
-    int port;
-    int server_fd, newclient_fd;
-    int ret;
+    struct pollfd listen_fds[2];
+    char *h_name, *end, *unix_path = NULL;
+    long cache_max = -1;
+    int port, opt;
+    int server_fd, unix_fd = -1, newclient_fd;
+    int nfds, i, ret;
 
     welcome();
 
@@ -100,14 +111,35 @@ int main(int argc, char **argv)
      * Argument parsing
      */
 
-    if (argc != 3) {
+    while ((opt = getopt(argc, argv, "c:u:")) != -1) {
+        switch (opt) {
+            case 'c':
+                cache_max = strtol(optarg, &end, 10);
+                if (*end || cache_max < 0) {
+                    err("invalid number of users: %s", optarg);
+                    usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'u':
+                unix_path = optarg;
+                break;
+
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind != 2) {
         err("invalid number of arguments.");
         usage();
         exit(EXIT_FAILURE);
     }
 
-    h_name = argv[1];
-    port = atoi(argv[2]);
+    h_name = argv[optind];
+    port = atoi(argv[optind + 1]);
 
     info("local address is %s and port is %d", h_name, port);
 
@@ -124,16 +156,41 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
+    if (unix_path && socket_open_listen_unix(unix_path, &unix_fd) < 0) {
+        err("failed to start the local server socket");
+        exit(EXIT_FAILURE);
+    }
+
 
     /*
      * Load users' email and password from file
      */
 
+    if (cache_max >= 0 && robin_user_store_init("./users.db", cache_max)) {
+        err("failed to open the user store!");
+        exit(EXIT_FAILURE);
+    }
+
     if (robin_users_load("./users.txt")) {
         err("failed to load user file from file system!");
         exit(EXIT_FAILURE);
     }
 
+    if (robin_user_graph_load("./follows.snap", "./follows.log")) {
+        err("failed to load follow graph from file system!");
+        exit(EXIT_FAILURE);
+    }
+
+
+    /*
+     * Crypt pool spawning (needed by login and registration)
+     */
+
+    if (robin_crypt_pool_init()) {
+        err("failed to initialize crypt pool!");
+        exit(EXIT_FAILURE);
+    }
+
 
     /*
      * Thread pool spawning
@@ -149,19 +206,37 @@ int main(int argc, char **argv)
      * Server loop
      */
 
+    listen_fds[0].fd = server_fd;
+    listen_fds[0].events = POLLIN;
+    listen_fds[1].fd = unix_fd;
+    listen_fds[1].events = POLLIN;
+    nfds = unix_fd < 0 ? 1 : 2;
+
     while (1) {
-        ret = socket_accept_connection(server_fd, &newclient_fd);
+        ret = poll(listen_fds, nfds, -1);
         if (ret < 0) {
             /* signal caught, terminate the server on SIGINT */
             if (errno == EINTR && signal_caught == SIGINT)
                 break;
 
-            err("failed to accept client connection");
-            /* waiting for another client */
+            if (errno != EINTR)
+                err("poll: %s", strerror(errno));
             continue;
         }
 
-        robin_thread_pool_dispatch(newclient_fd);
+        for (i = 0; i < nfds; i++) {
+            if (!listen_fds[i].revents)
+                continue;
+
+            ret = socket_accept_connection(listen_fds[i].fd, &newclient_fd);
+            if (ret < 0) {
+                err("failed to accept client connection");
+                /* waiting for another client */
+                continue;
+            }
+
+            robin_thread_pool_dispatch(newclient_fd);
+        }
     }
 
 
@@ -171,12 +246,20 @@ int main(int argc, char **argv)
 
     dbg("robin_thread_pool_free");
     robin_thread_pool_free();
+    dbg("robin_crypt_pool_free");
+    robin_crypt_pool_free();
+    dbg("robin_session_free_all");
+    robin_session_free_all();
     dbg("robin_user_free_all");
     robin_user_free_all();
     dbg("robin_cip_free_all");
     robin_cip_free_all();
     dbg("socket_close");
     socket_close(server_fd);
+    if (unix_fd >= 0) {
+        socket_close(unix_fd);
+        unlink(unix_path);
+    }
 
     exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,320 @@
+/*
+ * robin_session.c
+ *
+ * Handles the Robin Sessions: random tokens handed out at login that a client
+ * can later present to restore the login without paying the password hashing
+ * again.
+ *
+ * Sessions live in memory only, in an open-addressing hash table keyed by the
+ * token, and expire after ROBIN_SESSION_TTL seconds without being resumed.
+ *
+ * Luca Zulberti <l.zulberti@studenti.unipi.it>
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <sys/random.h>
+
+#include "robin.h"
+#include "robin_session.h"
+
+
+/*
+ * Log shortcuts
+ */
+
+#define err(fmt, args...)  robin_log_err(ROBIN_LOG_ID_SESSION, fmt, ## args)
+#define warn(fmt, args...) robin_log_warn(ROBIN_LOG_ID_SESSION, fmt, ## args)
+#define info(fmt, args...) robin_log_info(ROBIN_LOG_ID_SESSION, fmt, ## args)
+#define dbg(fmt, args...)  robin_log_dbg(ROBIN_LOG_ID_SESSION, fmt, ## args)
+
+
+/*
+ * Local types and macros
+ */
+
+#define ROBIN_SESSION_TTL     (24 * 60 * 60)
+#define ROBIN_SESSION_MAX     (1 << 20)
+#define ROBIN_SESSION_MIN_CAP 64
+#define ROBIN_SESSION_KEY_LEN (ROBIN_SESSION_TOKEN_LEN / 2)
+
+typedef struct robin_session {
+    uint8_t key[ROBIN_SESSION_KEY_LEN]; /* raw token */
+    time_t expire;                      /* 0 if the slot is empty */
+    int uid;
+} robin_session_t;
+
+
+/*
+ * Local data
+ */
+
+static robin_session_t *sessions = NULL;
+static size_t sessions_cap = 0;  /* power of two */
+static size_t sessions_len = 0;
+static time_t sessions_expire_min = 0; /* no session expires before */
+static pthread_mutex_t sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * Local functions
+ */
+
+static inline size_t rs_slot_of(const uint8_t *key, size_t cap)
+{
+    uint32_t h;
+
+    /* the key is random, its first bytes are already a good hash */
+    memcpy(&h, key, sizeof(h));
+
+    return h & (cap - 1);
+}
+
+static int rs_token_to_key(const char *token, uint8_t *key)
+{
+    unsigned int byte;
+
+    if (strlen(token) != ROBIN_SESSION_TOKEN_LEN ||
+        strspn(token, "0123456789abcdefABCDEF") != ROBIN_SESSION_TOKEN_LEN)
+        return -1;
+
+    for (int i = 0; i < ROBIN_SESSION_KEY_LEN; i++) {
+        if (sscanf(token + 2 * i, "%2x", &byte) != 1)
+            return -1;
+        key[i] = byte;
+    }
+
+    return 0;
+}
+
+static void rs_key_to_token(const uint8_t *key, char *token)
+{
+    for (int i = 0; i < ROBIN_SESSION_KEY_LEN; i++)
+        sprintf(token + 2 * i, "%02x", key[i]);
+}
+
+static robin_session_t *rs_lookup_unsafe(const uint8_t *key)
+{
+    size_t mask, i;
+
+    if (!sessions)
+        return NULL;
+
+    mask = sessions_cap - 1;
+    for (i = rs_slot_of(key, sessions_cap); ; i = (i + 1) & mask) {
+        if (!sessions[i].expire)
+            return NULL;
+
+        if (!memcmp(sessions[i].key, key, ROBIN_SESSION_KEY_LEN))
+            return &sessions[i];
+    }
+}
+
+static void rs_put_unsafe(robin_session_t *table, size_t cap,
+                          const robin_session_t *s)
+{
+    size_t mask = cap - 1, i;
+
+    for (i = rs_slot_of(s->key, cap); table[i].expire; i = (i + 1) & mask)
+        ;
+
+    table[i] = *s;
+}
+
+/* backward-shift deletion: keeps probe sequences intact without tombstones */
+static void rs_remove_unsafe(robin_session_t *s)
+{
+    size_t mask = sessions_cap - 1, hole, i, home;
+
+    hole = s - sessions;
+    for (i = (hole + 1) & mask; sessions[i].expire; i = (i + 1) & mask) {
+        home = rs_slot_of(sessions[i].key, sessions_cap);
+
+        /* move the entry into the hole if the hole is on its probe path */
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            sessions[hole] = sessions[i];
+            hole = i;
+        }
+    }
+
+    sessions[hole].expire = 0;
+    sessions_len--;
+}
+
+/* drop the expired sessions in place, the table keeps its capacity */
+static void rs_purge_unsafe(time_t now)
+{
+    time_t expire_min = now + ROBIN_SESSION_TTL;
+    size_t i = 0;
+
+    while (i < sessions_cap) {
+        if (sessions[i].expire && sessions[i].expire <= now) {
+            /* the shift can move an entry not seen yet into this slot */
+            rs_remove_unsafe(&sessions[i]);
+            continue;
+        }
+
+        if (sessions[i].expire && sessions[i].expire < expire_min)
+            expire_min = sessions[i].expire;
+        i++;
+    }
+
+    sessions_expire_min = expire_min;
+
+    dbg("purge: %zu live sessions", sessions_len);
+}
+
+static int rs_grow_unsafe(void)
+{
+    robin_session_t *new_sessions;
+    size_t new_cap;
+
+    new_cap = sessions_cap ? 2 * sessions_cap : ROBIN_SESSION_MIN_CAP;
+
+    new_sessions = calloc(new_cap, sizeof(robin_session_t));
+    if (!new_sessions) {
+        err("calloc: %s", strerror(errno));
+        return -1;
+    }
+
+    for (size_t i = 0; i < sessions_cap; i++) {
+        if (sessions[i].expire)
+            rs_put_unsafe(new_sessions, new_cap, &sessions[i]);
+    }
+
+    dbg("grow: %zu -> %zu slots, %zu live sessions", sessions_cap, new_cap,
+        sessions_len);
+
+    free(sessions);
+    sessions = new_sessions;
+    sessions_cap = new_cap;
+
+    return 0;
+}
+
+/*
+ * Exported functions
+ */
+
+int robin_session_create(int uid, char *token)
+{
+    robin_session_t s;
+    time_t now;
+    int ret = 0;
+
+    if (getrandom(s.key, ROBIN_SESSION_KEY_LEN, 0) != ROBIN_SESSION_KEY_LEN) {
+        err("getrandom: %s", strerror(errno));
+        return -1;
+    }
+
+    now = time(NULL);
+    s.expire = now + ROBIN_SESSION_TTL;
+    s.uid = uid;
+
+    pthread_mutex_lock(&sessions_mutex);
+
+    /*
+     * Keep the load factor below 1/2. Expired sessions make room first, at
+     * most once a second as the purge leaves none that expire before the next
+     * one. The table grows if they were less than half of it, up to the size
+     * holding ROBIN_SESSION_MAX sessions.
+     */
+    if (2 * (sessions_len + 1) > sessions_cap) {
+        if (sessions && now >= sessions_expire_min)
+            rs_purge_unsafe(now);
+
+        if (sessions_len >= ROBIN_SESSION_MAX) {
+            warn("create: too many open sessions");
+            ret = 1;
+            goto create_quit;
+        }
+
+        if (4 * (sessions_len + 1) > sessions_cap
+            && sessions_cap < 2 * ROBIN_SESSION_MAX && rs_grow_unsafe() < 0) {
+            ret = -1;
+            goto create_quit;
+        }
+    }
+
+    rs_put_unsafe(sessions, sessions_cap, &s);
+    sessions_len++;
+
+create_quit:
+    pthread_mutex_unlock(&sessions_mutex);
+
+    if (ret == 0) {
+        rs_key_to_token(s.key, token);
+        dbg("create: uid=%d token=%s", uid, token);
+    }
+
+    return ret;
+}
+
+int robin_session_resume(const char *token, int *uid)
+{
+    uint8_t key[ROBIN_SESSION_KEY_LEN];
+    robin_session_t *s;
+    time_t now;
+    int ret = 1;
+
+    if (rs_token_to_key(token, key) < 0) {
+        warn("resume: malformed token");
+        return 1;
+    }
+
+    now = time(NULL);
+
+    pthread_mutex_lock(&sessions_mutex);
+
+    s = rs_lookup_unsafe(key);
+    if (s && s->expire <= now) {
+        dbg("resume: token %s expired", token);
+        rs_remove_unsafe(s);
+    } else if (s) {
+        s->expire = now + ROBIN_SESSION_TTL;
+        *uid = s->uid;
+        ret = 0;
+    }
+
+    pthread_mutex_unlock(&sessions_mutex);
+
+    return ret;
+}
+
+void robin_session_revoke(const char *token)
+{
+    uint8_t key[ROBIN_SESSION_KEY_LEN];
+    robin_session_t *s;
+
+    if (rs_token_to_key(token, key) < 0)
+        return;
+
+    pthread_mutex_lock(&sessions_mutex);
+
+    s = rs_lookup_unsafe(key);
+    if (s)
+        rs_remove_unsafe(s);
+
+    pthread_mutex_unlock(&sessions_mutex);
+}
+
+void robin_session_free_all(void)
+{
+    pthread_mutex_lock(&sessions_mutex);
+
+    if (sessions) {
+        dbg("free_all: sessions=%p", sessions);
+        free(sessions);
+        sessions = NULL;
+    }
+
+    sessions_cap = 0;
+    sessions_len = 0;
+    sessions_expire_min = 0;
+
+    pthread_mutex_unlock(&sessions_mutex);
+}
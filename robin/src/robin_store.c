@@ -0,0 +1,675 @@
+/*
+ * robin_store.c
+ *
+ * Keeps the adjacency lists of the follow graph on file system, for servers
+ * which cannot hold the whole graph in memory:
+ *
+ *  - the lists file, path.<generation>: uids lists, append-only. A list is
+ *    never overwritten, a new version is appended and the old one becomes
+ *    garbage, reclaimed by rewriting the whole file in a new generation;
+ *  - the index file, path: a header and, per uid, where its lists are.
+ *
+ * The index is updated in memory by each write and saved by the checkpoints,
+ * after the lists file is synced: the saved index only references durable
+ * lists. Each list saved by the index reflects the graph at the checkpoint
+ * or later, the graph journal is replayed from the checkpoint on top of it.
+ *
+ * Luca Zulberti <l.zulberti@studenti.unipi.it>
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "robin.h"
+#include "robin_store.h"
+
+
+/*
+ * Log shortcuts
+ */
+
+#define err(fmt, args...)  robin_log_err(ROBIN_LOG_ID_STORE, fmt, ## args)
+#define warn(fmt, args...) robin_log_warn(ROBIN_LOG_ID_STORE, fmt, ## args)
+#define info(fmt, args...) robin_log_info(ROBIN_LOG_ID_STORE, fmt, ## args)
+#define dbg(fmt, args...)  robin_log_dbg(ROBIN_LOG_ID_STORE, fmt, ## args)
+
+
+/*
+ * Local types and macros
+ */
+
+#define ROBIN_STORE_MAGIC   0x524f5453 /* "STOR" */
+#define ROBIN_STORE_VERSION 1
+
+/* index entries saved together by a checkpoint if one of them changed */
+#define ROBIN_STORE_CHUNK_LEN 1024
+
+/* the lists file is rewritten when its garbage exceeds live lists by this */
+#define ROBIN_STORE_COMPACT_SLACK (1 << 20)
+
+typedef struct robin_store_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t gen;         /* generation of the lists file */
+    uint64_t journal_off; /* graph journal records before this are reflected */
+    uint64_t users;       /* index entries */
+    /* followed by robin_store_ref_t refs[users] */
+} robin_store_hdr_t;
+
+typedef struct robin_store_ref {
+    uint64_t off[ROBIN_STORE_LISTS]; /* in the lists file */
+    uint32_t len[ROBIN_STORE_LISTS]; /* in uids */
+} robin_store_ref_t;
+
+
+/*
+ * Local data
+ */
+
+static char *store_path = NULL;
+static int store_fd = -1;      /* index file */
+static int store_lists_fd = -1;
+static robin_store_hdr_t store_hdr;
+
+/* in-memory index, store_mutex guards it */
+static pthread_mutex_t store_mutex = PTHREAD_MUTEX_INITIALIZER;
+static robin_store_ref_t *store_refs = NULL;
+static uint8_t *store_dirty = NULL; /* per chunk, to save at the checkpoint */
+static size_t store_refs_len = 0;
+static size_t store_refs_cap = 0;
+static uint64_t store_live = 0;     /* bytes of the referenced lists */
+
+/* bytes of the lists file, reserved by writers before writing */
+static uint64_t store_lists_len = 0;
+
+
+/*
+ * Local functions
+ */
+
+static char *rs_lists_path(uint64_t gen)
+{
+    size_t len = strlen(store_path) + 24;
+    char *path;
+
+    path = malloc(len);
+    if (!path) {
+        err("malloc: %s", strerror(errno));
+        return NULL;
+    }
+    snprintf(path, len, "%s.%llu", store_path, (unsigned long long) gen);
+
+    return path;
+}
+
+static int rs_pread_all(int fd, void *buf, size_t len, uint64_t off)
+{
+    ssize_t n;
+
+    while (len) {
+        n = pread(fd, buf, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            err("pread: %s", n ? strerror(errno) : "unexpected end of file");
+            return -1;
+        }
+
+        buf = (char *) buf + n;
+        len -= n;
+        off += n;
+    }
+
+    return 0;
+}
+
+static int rs_pwrite_all(int fd, const void *buf, size_t len, uint64_t off)
+{
+    ssize_t n;
+
+    while (len) {
+        n = pwrite(fd, buf, len, off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            err("pwrite: %s", strerror(errno));
+            return -1;
+        }
+
+        buf = (const char *) buf + n;
+        len -= n;
+        off += n;
+    }
+
+    return 0;
+}
+
+/* make room for n index entries, new ones reference empty lists */
+static int rs_refs_reserve_unsafe(size_t n)
+{
+    robin_store_ref_t *new_refs;
+    uint8_t *new_dirty;
+    size_t new_cap, chunks, new_chunks;
+
+    if (n <= store_refs_len)
+        return 0;
+
+    if (n > store_refs_cap) {
+        new_cap = store_refs_cap ? store_refs_cap : ROBIN_STORE_CHUNK_LEN;
+        while (new_cap < n)
+            new_cap *= 2;
+
+        new_refs = realloc(store_refs, new_cap * sizeof(robin_store_ref_t));
+        if (!new_refs) {
+            err("realloc: %s", strerror(errno));
+            return -1;
+        }
+        store_refs = new_refs;
+
+        chunks = store_refs_cap / ROBIN_STORE_CHUNK_LEN;
+        new_chunks = new_cap / ROBIN_STORE_CHUNK_LEN;
+        new_dirty = realloc(store_dirty, new_chunks);
+        if (!new_dirty) {
+            err("realloc: %s", strerror(errno));
+            return -1;
+        }
+        memset(new_dirty + chunks, 0, new_chunks - chunks);
+        store_dirty = new_dirty;
+
+        store_refs_cap = new_cap;
+    }
+
+    memset(store_refs + store_refs_len, 0,
+           (n - store_refs_len) * sizeof(robin_store_ref_t));
+    store_refs_len = n;
+
+    return 0;
+}
+
+/*
+ * Write a whole index file, replacing the current one only once complete:
+ * returns a descriptor of the new file or -1 on error.
+ */
+static int rs_index_write(const robin_store_hdr_t *hdr,
+                          const robin_store_ref_t *refs)
+{
+    size_t tmp_len = strlen(store_path) + sizeof(".tmp");
+    char *tmp;
+    FILE *fp;
+    int fd = -1;
+
+    tmp = malloc(tmp_len);
+    if (!tmp) {
+        err("malloc: %s", strerror(errno));
+        return -1;
+    }
+    snprintf(tmp, tmp_len, "%s.tmp", store_path);
+
+    fp = fopen(tmp, "w+");
+    if (!fp) {
+        err("fopen: %s", strerror(errno));
+        free(tmp);
+        return -1;
+    }
+
+    if (fwrite(hdr, sizeof(*hdr), 1, fp) != 1
+        || (hdr->users && fwrite(refs, sizeof(robin_store_ref_t), hdr->users,
+                                 fp) != hdr->users)
+        || fflush(fp) || fsync(fileno(fp)) < 0) {
+        err("index: cannot write %s: %s", tmp, strerror(errno));
+        fclose(fp);
+        unlink(tmp);
+        goto index_quit;
+    }
+
+    fd = dup(fileno(fp));
+    fclose(fp);
+    if (fd < 0) {
+        err("dup: %s", strerror(errno));
+        unlink(tmp);
+        goto index_quit;
+    }
+
+    if (rename(tmp, store_path) < 0) {
+        err("rename: %s", strerror(errno));
+        close(fd);
+        fd = -1;
+        unlink(tmp);
+    }
+
+index_quit:
+    free(tmp);
+
+    return fd;
+}
+
+/*
+ * Copy the live lists into a new generation of the lists file. The graph
+ * must not change meanwhile.
+ */
+static int rs_compact(void)
+{
+    robin_store_hdr_t hdr = store_hdr;
+    robin_store_ref_t *refs;
+    uint32_t *buf = NULL, *new_buf;
+    size_t cap = 0;
+    uint64_t off = 0;
+    char *old_path = NULL, *new_path = NULL;
+    FILE *fp = NULL;
+    int lists_fd = -1, fd, ret = -1;
+
+    hdr.gen++;
+    hdr.users = store_refs_len;
+
+    refs = malloc((store_refs_len ? store_refs_len : 1)
+                  * sizeof(robin_store_ref_t));
+    old_path = rs_lists_path(store_hdr.gen);
+    new_path = rs_lists_path(hdr.gen);
+    if (!refs || !old_path || !new_path) {
+        if (!refs)
+            err("malloc: %s", strerror(errno));
+        goto compact_quit;
+    }
+
+    fp = fopen(new_path, "w+");
+    if (!fp) {
+        err("fopen: %s", strerror(errno));
+        goto compact_quit;
+    }
+
+    lists_fd = dup(fileno(fp));
+    if (lists_fd < 0) {
+        err("dup: %s", strerror(errno));
+        goto compact_fail;
+    }
+
+    for (size_t uid = 0; uid < store_refs_len; uid++) {
+        for (int l = 0; l < ROBIN_STORE_LISTS; l++) {
+            refs[uid].off[l] = off;
+            refs[uid].len[l] = store_refs[uid].len[l];
+
+            if (refs[uid].len[l] > cap) {
+                new_buf = realloc(buf, refs[uid].len[l] * sizeof(uint32_t));
+                if (!new_buf) {
+                    err("realloc: %s", strerror(errno));
+                    goto compact_fail;
+                }
+                buf = new_buf;
+                cap = refs[uid].len[l];
+            }
+
+            if (rs_pread_all(store_lists_fd, buf,
+                             refs[uid].len[l] * sizeof(uint32_t),
+                             store_refs[uid].off[l]) < 0)
+                goto compact_fail;
+
+            if (refs[uid].len[l] && fwrite(buf, sizeof(uint32_t),
+                                           refs[uid].len[l], fp)
+                                    != refs[uid].len[l]) {
+                err("fwrite: %s", strerror(errno));
+                goto compact_fail;
+            }
+
+            off += refs[uid].len[l] * sizeof(uint32_t);
+        }
+    }
+
+    if (fflush(fp) || fsync(fileno(fp)) < 0) {
+        err("compact: cannot write %s: %s", new_path, strerror(errno));
+        goto compact_fail;
+    }
+    fclose(fp);
+    fp = NULL;
+
+    /* the new index commits the new generation */
+    fd = rs_index_write(&hdr, refs);
+    if (fd < 0)
+        goto compact_fail;
+
+    close(store_fd);
+    store_fd = fd;
+    close(store_lists_fd);
+    store_lists_fd = lists_fd;
+    lists_fd = -1;
+    unlink(old_path);
+
+    info("compact: lists file shrunk from %llu to %llu bytes",
+         (unsigned long long) store_lists_len, (unsigned long long) off);
+
+    free(store_refs);
+    store_refs = refs;
+    refs = NULL;
+    store_hdr = hdr;
+    store_lists_len = off;
+    memset(store_dirty, 0, store_refs_cap / ROBIN_STORE_CHUNK_LEN);
+
+    ret = 0;
+    goto compact_quit;
+
+compact_fail:
+    if (fp)
+        fclose(fp);
+    if (lists_fd >= 0)
+        close(lists_fd);
+    unlink(new_path);
+
+compact_quit:
+    free(buf);
+    free(refs);
+    free(old_path);
+    free(new_path);
+
+    return ret;
+}
+
+static void rs_compact_maybe(void)
+{
+    if (store_lists_len - store_live > store_live + ROBIN_STORE_COMPACT_SLACK)
+        rs_compact();
+}
+
+static int rs_create(void)
+{
+    char *path;
+    int ret = -1;
+
+    memset(&store_hdr, 0, sizeof(store_hdr));
+    store_hdr.magic = ROBIN_STORE_MAGIC;
+    store_hdr.version = ROBIN_STORE_VERSION;
+
+    path = rs_lists_path(store_hdr.gen);
+    if (!path)
+        return -1;
+
+    store_lists_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (store_lists_fd < 0) {
+        err("open: %s", strerror(errno));
+        goto create_quit;
+    }
+
+    store_fd = rs_index_write(&store_hdr, NULL);
+    if (store_fd < 0)
+        goto create_quit;
+
+    info("open: store %s created", store_path);
+
+    ret = 1;
+
+create_quit:
+    free(path);
+
+    return ret;
+}
+
+static int rs_load(void)
+{
+    struct stat st;
+    uint64_t end = 0, ref_end;
+    char *path;
+    int ret = -1;
+
+    if (rs_pread_all(store_fd, &store_hdr, sizeof(store_hdr), 0) < 0)
+        return -1;
+
+    if (fstat(store_fd, &st) < 0) {
+        err("fstat: %s", strerror(errno));
+        return -1;
+    }
+
+    /* a checkpoint may have saved more entries than the header knows */
+    if (store_hdr.magic != ROBIN_STORE_MAGIC
+        || store_hdr.version != ROBIN_STORE_VERSION
+        || store_hdr.users > ((uint64_t) st.st_size - sizeof(store_hdr))
+                             / sizeof(robin_store_ref_t)) {
+        err("load: store %s is corrupted", store_path);
+        return -1;
+    }
+
+    if (rs_refs_reserve_unsafe(store_hdr.users) < 0)
+        return -1;
+
+    if (rs_pread_all(store_fd, store_refs,
+                     store_hdr.users * sizeof(robin_store_ref_t),
+                     sizeof(store_hdr)) < 0)
+        return -1;
+
+    path = rs_lists_path(store_hdr.gen);
+    if (!path)
+        return -1;
+
+    store_lists_fd = open(path, O_RDWR);
+    if (store_lists_fd < 0) {
+        err("open: %s: %s", path, strerror(errno));
+        goto load_quit;
+    }
+
+    if (fstat(store_lists_fd, &st) < 0) {
+        err("fstat: %s", strerror(errno));
+        goto load_quit;
+    }
+
+    for (size_t uid = 0; uid < store_refs_len; uid++) {
+        for (int l = 0; l < ROBIN_STORE_LISTS; l++) {
+            ref_end = store_refs[uid].off[l]
+                      + (uint64_t) store_refs[uid].len[l] * sizeof(uint32_t);
+
+            if (ref_end < store_refs[uid].off[l]
+                || ref_end > (uint64_t) st.st_size) {
+                err("load: store %s has invalid lists", store_path);
+                goto load_quit;
+            }
+
+            if (ref_end > end)
+                end = ref_end;
+            store_live += ref_end - store_refs[uid].off[l];
+        }
+    }
+
+    /* drop the lists written after the last checkpoint */
+    if ((uint64_t) st.st_size > end && ftruncate(store_lists_fd, end) < 0) {
+        err("ftruncate: %s", strerror(errno));
+        goto load_quit;
+    }
+    store_lists_len = end;
+
+    info("load: %zu users, %llu bytes of lists", store_refs_len,
+         (unsigned long long) store_live);
+
+    rs_compact_maybe();
+
+    ret = 0;
+
+load_quit:
+    free(path);
+
+    return ret;
+}
+
+
+/*
+ * Exported functions
+ */
+
+int robin_store_open(const char *path, uint64_t *journal_off)
+{
+    int ret;
+
+    store_path = malloc(strlen(path) + 1);
+    if (!store_path) {
+        err("malloc: %s", strerror(errno));
+        return -1;
+    }
+    strcpy(store_path, path);
+
+    store_fd = open(path, O_RDWR);
+    if (store_fd < 0 && errno != ENOENT) {
+        err("open: %s", strerror(errno));
+        ret = -1;
+    } else if (store_fd < 0) {
+        ret = rs_create();
+    } else {
+        ret = rs_load();
+    }
+
+    if (ret < 0) {
+        robin_store_close();
+        return -1;
+    }
+
+    *journal_off = store_hdr.journal_off;
+
+    return ret;
+}
+
+ssize_t robin_store_read(uint32_t uid, robin_store_list_t list,
+                         uint32_t **buf, size_t *cap)
+{
+    uint32_t *new_buf;
+    uint64_t off = 0;
+    size_t n = 0;
+
+    pthread_mutex_lock(&store_mutex);
+    if (uid < store_refs_len) {
+        off = store_refs[uid].off[list];
+        n = store_refs[uid].len[list];
+    }
+    pthread_mutex_unlock(&store_mutex);
+
+    if (n > *cap) {
+        new_buf = realloc(*buf, n * sizeof(uint32_t));
+        if (!new_buf) {
+            err("realloc: %s", strerror(errno));
+            return -1;
+        }
+        *buf = new_buf;
+        *cap = n;
+    }
+
+    /* lists are never overwritten, no need to hold the lock */
+    if (rs_pread_all(store_lists_fd, *buf, n * sizeof(uint32_t), off) < 0)
+        return -1;
+
+    return n;
+}
+
+int robin_store_write(uint32_t uid, robin_store_list_t list,
+                      const uint32_t *uids, size_t n)
+{
+    uint64_t off = 0;
+    int ret;
+
+    if (n) {
+        off = __atomic_fetch_add(&store_lists_len, n * sizeof(uint32_t),
+                                 __ATOMIC_RELAXED);
+        if (rs_pwrite_all(store_lists_fd, uids, n * sizeof(uint32_t), off) < 0)
+            return -1;
+    }
+
+    pthread_mutex_lock(&store_mutex);
+
+    ret = rs_refs_reserve_unsafe(uid + 1);
+    if (!ret) {
+        store_live -= store_refs[uid].len[list] * sizeof(uint32_t);
+        store_live += n * sizeof(uint32_t);
+        store_refs[uid].off[list] = off;
+        store_refs[uid].len[list] = n;
+        store_dirty[uid / ROBIN_STORE_CHUNK_LEN] = 1;
+    }
+
+    pthread_mutex_unlock(&store_mutex);
+
+    return ret;
+}
+
+int robin_store_checkpoint(uint64_t journal_off)
+{
+    size_t first, n, saved = 0;
+    int ret = -1;
+
+    /* writers wait here: the saved index must reference synced lists only */
+    pthread_mutex_lock(&store_mutex);
+
+    if (fdatasync(store_lists_fd) < 0) {
+        err("fdatasync: %s", strerror(errno));
+        goto checkpoint_quit;
+    }
+
+    for (size_t c = 0; c * ROBIN_STORE_CHUNK_LEN < store_refs_len; c++) {
+        if (!store_dirty[c])
+            continue;
+
+        first = c * ROBIN_STORE_CHUNK_LEN;
+        n = store_refs_len - first;
+        if (n > ROBIN_STORE_CHUNK_LEN)
+            n = ROBIN_STORE_CHUNK_LEN;
+
+        if (rs_pwrite_all(store_fd, &store_refs[first],
+                          n * sizeof(robin_store_ref_t),
+                          sizeof(store_hdr)
+                          + first * sizeof(robin_store_ref_t)) < 0)
+            goto checkpoint_quit;
+
+        store_dirty[c] = 0;
+        saved += n;
+    }
+
+    /* the header goes last, it commits the entries */
+    if (fdatasync(store_fd) < 0) {
+        err("fdatasync: %s", strerror(errno));
+        goto checkpoint_quit;
+    }
+
+    store_hdr.journal_off = journal_off;
+    store_hdr.users = store_refs_len;
+
+    if (rs_pwrite_all(store_fd, &store_hdr, sizeof(store_hdr), 0) < 0)
+        goto checkpoint_quit;
+
+    if (fdatasync(store_fd) < 0) {
+        err("fdatasync: %s", strerror(errno));
+        goto checkpoint_quit;
+    }
+
+    dbg("checkpoint: %zu index entries saved", saved);
+
+    ret = 0;
+
+checkpoint_quit:
+    pthread_mutex_unlock(&store_mutex);
+
+    return ret;
+}
+
+void robin_store_close(void)
+{
+    if (store_fd >= 0 && store_lists_fd >= 0)
+        rs_compact_maybe();
+
+    if (store_lists_fd >= 0) {
+        close(store_lists_fd);
+        store_lists_fd = -1;
+    }
+
+    if (store_fd >= 0) {
+        close(store_fd);
+        store_fd = -1;
+    }
+
+    free(store_refs);
+    store_refs = NULL;
+    free(store_dirty);
+    store_dirty = NULL;
+    store_refs_len = 0;
+    store_refs_cap = 0;
+    store_live = 0;
+    store_lists_len = 0;
+
+    free(store_path);
+    store_path = NULL;
+}
@@ -7,15 +7,27 @@
  * Luca Zulberti <l.zulberti@studenti.unipi.it>
  */
 
+#include <fcntl.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
-#include <crypt.h>
 #include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "robin.h"
+#include "robin_crypt.h"
+#include "robin_graph.h"
+#include "robin_journal.h"
+#include "robin_store.h"
 #include "robin_user.h"
-#include "lib/password.h"
+#include "lib/ebr.h"
+#include "lib/hash.h"
+#include "lib/intersect.h"
+#include "lib/uidset.h"
 
 /*
  * Log shortcut
@@ -34,280 +46,1882 @@
 #define ROBIN_USER_EMAIL_LEN 64
 #define ROBIN_USER_PSW_LEN   64
 
-typedef struct robin_user_data {
-    /* Login information */
+/*
+ * Users are split by access pattern in two tables indexed by uid:
+ *
+ *  - robin_user_t, hot: graph and login state, touched by follows and
+ *    timelines. Two cache lines, each one holding fields used together;
+ *  - robin_user_cred_t, cold: credentials, touched only at login and when
+ *    emails are printed.
+ *
+ * In disk mode the sets of the users are kept in the store and only loaded
+ * (hydrated) for the users in use, at most users_cache_max of them besides
+ * the acquired ones; the credentials are mapped from a file, so the kernel can
+ * drop them from memory when cold.
+ */
+
+/*
+ * Adjacency snapshot: immutable copy of a set, published in the user and
+ * shared by reference. A change of the set only unpublishes the snapshot, the
+ * first reader after it builds a new one; snapshots are freed through EBR
+ * when their last reference is dropped, as readers take references without
+ * locks.
+ */
+typedef struct robin_user_snap {
+    robin_user_adj_t adj; /* exported view, must be the first field */
+    ebr_node_t node;
+    uint32_t refs;        /* one for the publication, one per reader */
+    /* followed by char *emails[adj.len] and uint32_t uids[adj.len] */
+} robin_user_snap_t;
+
+/*
+ * Who-to-follow suggestions: the users followed by the followed ones, ranked
+ * by how many of them follow each. The work is bounded by sampling: at most
+ * ROBIN_USER_SUGGEST_FANOUT followed users are visited, and at most
+ * ROBIN_USER_SUGGEST_SAMPLE of the users followed by each of them.
+ *
+ * The last suggestions are cached in the user while its following snapshot
+ * is still the published one, i.e. it did not follow or unfollow anybody,
+ * and for ROBIN_USER_SUGGEST_TTL_MS to catch up the changes two hops away.
+ */
+
+#define ROBIN_USER_SUGGEST_FANOUT 64
+#define ROBIN_USER_SUGGEST_SAMPLE 256
+#define ROBIN_USER_SUGGEST_TTL_MS 10000
+
+typedef struct robin_user_sugg_entry {
+    robin_user_sugg_t sugg;   /* exported view, must be the first field */
+    uint32_t refs;            /* one for the cache, one per reader */
+    size_t k;
+    robin_user_snap_t *basis; /* following snapshot it was computed from */
+    uint64_t expire;          /* CLOCK_MONOTONIC, in ms */
+    /* followed by char *emails[len], uint32_t uids[len] and shared[len] */
+} robin_user_sugg_entry_t;
+
+typedef struct robin_user_sugg_cand {
+    uint32_t uid;
+    uint32_t shared;
+} robin_user_sugg_cand_t;
+
+typedef struct robin_user {
+    /* Followers (uids), set by other users; mutex guards both sets */
+    uidset_t followers;
+    pthread_mutex_t mutex;
+
+    /* Published snapshots of the sets, NULL if not built yet */
+    robin_user_snap_t *followers_snap;
+    robin_user_snap_t *following_snap;
+
+    /* Following (uids), set only by the owner of the acquired user */
+    uidset_t following;
+    int acquired; /* exclusive access to the user */
+
+    /* Disk mode: flags guarded by mutex, links by users_cache_mutex */
+    uint8_t hydrated;   /* sets loaded from the store, always in memory mode */
+    uint8_t dirty;      /* ROBIN_USER_DIRTY() of the sets changed since */
+    uint8_t referenced; /* used since the CLOCK hand last passed */
+    int cache_prev;
+    int cache_next;
+
+    /* Last suggestions, NULL if none; mutex guards it */
+    robin_user_sugg_entry_t *sugg;
+} __attribute__((aligned(64))) robin_user_t;
+
+#define ROBIN_USER_DIRTY(list) (1 << (list))
+
+typedef struct robin_user_cred {
     char email[ROBIN_USER_EMAIL_LEN + 1];
     char psw[ROBIN_USER_PSW_LEN + 1];  /* hashed password */
+} robin_user_cred_t;
+
+/*
+ * User tables: fixed-size blocks of entries plus a static block directory
+ * per table.
+ *
+ * Blocks are never moved or freed until shutdown, so entries keep their
+ * address for the whole life of the server and readers can index the tables
+ * without users_mutex: users_len is published (release) only after the new
+ * entries are fully initialized.
+ */
+
+#define ROBIN_USER_BLOCK_SHIFT 10
+#define ROBIN_USER_BLOCK_LEN   (1 << ROBIN_USER_BLOCK_SHIFT)
+#define ROBIN_USER_BLOCK_MASK  (ROBIN_USER_BLOCK_LEN - 1)
+#define ROBIN_USER_DIR_LEN     16384 /* up to 16M users */
+
+/* credentials blocks are whole pages, to be mapped from the file */
+#define ROBIN_USER_CRED_BLOCK_SIZE \
+    ((ROBIN_USER_BLOCK_LEN * sizeof(robin_user_cred_t) + 4095) & ~4095UL)
+
+/*
+ * Hydrated users of the disk mode, in a ring visited by a CLOCK hand that
+ * evicts the first one not referenced since its last visit: an approximated
+ * LRU which costs no lock to the users in use. Acquired users are not
+ * evicted, neither busy ones: the hand gives up after ROBIN_USER_CACHE_SCAN
+ * users, until the next change.
+ */
+
+#define ROBIN_USER_CACHE_SCAN 64
+
+/*
+ * Email index: ROBIN_USER_SHARD_NUM shards selected by the top bits of the
+ * email hash, each one behind its own rwlock so that lookups (login, follow)
+ * run in parallel and a registration only excludes lookups of its shard.
+ *
+ * Each shard is an open addressing table with linear probing, the capacity is
+ * always a power of two and the load factor is kept below 1/2.
+ */
+
+#define ROBIN_USER_SHARD_BITS    6
+#define ROBIN_USER_SHARD_NUM     (1 << ROBIN_USER_SHARD_BITS)
+#define ROBIN_USER_INDEX_MIN_CAP 64
+
+typedef struct robin_user_index_slot {
+    uint32_t hash; /* hash of the email, avoids most strcmp on collisions */
+    int uid;       /* -1 if the slot is empty */
+} robin_user_index_slot_t;
+
+typedef struct robin_user_lookup_req {
+    uint32_t hash;
+    size_t len;
+    int idx; /* position of the email in the batch */
+} robin_user_lookup_req_t;
+
+typedef struct robin_user_shard {
+    pthread_rwlock_t lock;
+    robin_user_index_slot_t *index;
+    size_t cap;
+    size_t len;
+} __attribute__((aligned(64))) robin_user_shard_t;
+
+/*
+ * Users file loader: the mapped file is split on line boundaries among up to
+ * ROBIN_USER_LOAD_THREADS_MAX threads which parse their chunk into records;
+ * records are then deduplicated and appended to the table in file order.
+ */
+
+#define ROBIN_USER_LOAD_THREADS_MAX 8
+#define ROBIN_USER_LOAD_CHUNK_MIN   (1 << 20) /* bytes per parsing thread */
+
+typedef struct robin_user_record {
+    const char *email; /* not NUL-terminated, points into the mapped file */
+    const char *psw;
+    size_t email_len;
+    size_t psw_len;
+    uint32_t hash;
+} robin_user_record_t;
+
+typedef struct robin_user_loader {
+    pthread_t thread;
+    int spawned;
+    const char *start; /* chunk of whole lines: [start, end) */
+    const char *end;
+    robin_user_record_t *records;
+    size_t len;
+    int ret;
+} robin_user_loader_t;
+
+/*
+ * New registrations are appended to the users file through a journal:
+ * records are copied in memory under users_mutex, together with the uid
+ * allocation, so they reach the file in uid order, and a writer thread
+ * flushes them in batches. Build with -DROBIN_USER_FILE_SYNC=1 to also
+ * fdatasync every batch.
+ */
+
+#ifndef ROBIN_USER_FILE_SYNC
+#define ROBIN_USER_FILE_SYNC 0
+#endif
+
+#define ROBIN_USER_FILE_FLUSH_SIZE (64 * 1024)
+#define ROBIN_USER_FILE_FLUSH_MS   100
+
+
+/*
+ * Local data
+ */
+
+static robin_journal_t *users_journal = NULL;
+static robin_user_t *users[ROBIN_USER_DIR_LEN];
+static robin_user_cred_t *users_cred[ROBIN_USER_DIR_LEN];
+static int users_len = 0;
+/* serializes the table appends only, lock order: shard, then users_mutex */
+static pthread_mutex_t users_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static robin_user_shard_t users_shards[ROBIN_USER_SHARD_NUM] = {
+    [0 ... ROBIN_USER_SHARD_NUM - 1] = { .lock = PTHREAD_RWLOCK_INITIALIZER }
+};
+
+/* disk mode, if users_store is set */
+static char *users_store = NULL;
+static int users_cred_fd = -1;
+static size_t users_cache_max = 0;
+/* lock order: user mutex, then users_cache_mutex */
+static pthread_mutex_t users_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int users_cache_hand = -1;
+static size_t users_cache_len = 0;
+
+
+/*
+ * Local functions
+ */
+
+static inline robin_user_t *robin_user_at(int uid)
+{
+    return &users[uid >> ROBIN_USER_BLOCK_SHIFT][uid & ROBIN_USER_BLOCK_MASK];
+}
+
+static inline robin_user_cred_t *robin_user_cred_at(int uid)
+{
+    return &users_cred[uid >> ROBIN_USER_BLOCK_SHIFT]
+                      [uid & ROBIN_USER_BLOCK_MASK];
+}
+
+static inline int robin_user_len(void)
+{
+    return __atomic_load_n(&users_len, __ATOMIC_ACQUIRE);
+}
+
+static inline int robin_user_valid(int uid)
+{
+    return uid >= 0 && uid < robin_user_len();
+}
+
+static inline robin_user_shard_t *robin_user_shard_of(uint32_t hash)
+{
+    /* the index slot is picked by the low bits */
+    return &users_shards[hash >> (32 - ROBIN_USER_SHARD_BITS)];
+}
+
+static int robin_user_index_lookup_unsafe(robin_user_shard_t *shard,
+                                          const char *email, size_t len,
+                                          uint32_t hash)
+{
+    size_t mask, i;
+    robin_user_index_slot_t *slot;
+    const char *found;
+
+    if (!shard->index)
+        return -1;
+
+    mask = shard->cap - 1;
+    for (i = hash & mask; ; i = (i + 1) & mask) {
+        slot = &shard->index[i];
+
+        if (slot->uid < 0)
+            return -1;
+
+        if (slot->hash != hash)
+            continue;
+
+        found = robin_user_cred_at(slot->uid)->email;
+        if (!memcmp(email, found, len) && found[len] == '\0')
+            return slot->uid;
+    }
+}
+
+static void robin_user_index_put_unsafe(robin_user_index_slot_t *index,
+                                        size_t cap, uint32_t hash, int uid)
+{
+    size_t mask = cap - 1, i;
+
+    for (i = hash & mask; index[i].uid >= 0; i = (i + 1) & mask)
+        ;
+
+    index[i].hash = hash;
+    index[i].uid = uid;
+}
+
+/* make room for n users in the shard keeping the load factor below 1/2 */
+static int robin_user_index_reserve_unsafe(robin_user_shard_t *shard, size_t n)
+{
+    robin_user_index_slot_t *new_index;
+    size_t new_cap;
+
+    if (2 * n <= shard->cap)
+        return 0;
+
+    new_cap = shard->cap ? shard->cap : ROBIN_USER_INDEX_MIN_CAP;
+    while (2 * n > new_cap)
+        new_cap *= 2;
+
+    new_index = malloc(new_cap * sizeof(robin_user_index_slot_t));
+    if (!new_index) {
+        err("malloc: %s", strerror(errno));
+        return -1;
+    }
+
+    for (size_t i = 0; i < new_cap; i++)
+        new_index[i].uid = -1;
+
+    for (size_t i = 0; i < shard->cap; i++)
+        if (shard->index[i].uid >= 0)
+            robin_user_index_put_unsafe(new_index, new_cap,
+                                        shard->index[i].hash,
+                                        shard->index[i].uid);
+
+    dbg("index: shard %td grown from %zu to %zu slots",
+        shard - users_shards, shard->cap, new_cap);
+
+    free(shard->index);
+    shard->index = new_index;
+    shard->cap = new_cap;
+
+    return 0;
+}
+
+/* the room must have been reserved */
+static void robin_user_index_insert_unsafe(robin_user_shard_t *shard,
+                                           uint32_t hash, int uid)
+{
+    robin_user_index_put_unsafe(shard->index, shard->cap, hash, uid);
+    shard->len++;
+}
+
+/* anonymous memory, or pages of the credentials file in disk mode */
+static robin_user_cred_t *robin_user_cred_block_alloc(int b)
+{
+    void *block;
+
+    if (users_cred_fd < 0) {
+        block = malloc(ROBIN_USER_CRED_BLOCK_SIZE);
+        if (!block)
+            err("malloc: %s", strerror(errno));
+        return block;
+    }
+
+    if (ftruncate(users_cred_fd, (off_t) (b + 1)
+                                 * ROBIN_USER_CRED_BLOCK_SIZE) < 0) {
+        err("ftruncate: %s", strerror(errno));
+        return NULL;
+    }
+
+    block = mmap(NULL, ROBIN_USER_CRED_BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_SHARED, users_cred_fd,
+                 (off_t) b * ROBIN_USER_CRED_BLOCK_SIZE);
+    if (block == MAP_FAILED) {
+        err("mmap: %s", strerror(errno));
+        return NULL;
+    }
+
+    return block;
+}
+
+/* append a new, validated and not yet registered, user to the table */
+static int robin_user_append_unsafe(const char *email, size_t email_len,
+                                    const char *psw, size_t psw_len)
+{
+    robin_user_t *user;
+    robin_user_cred_t *cred;
+    int uid, b;
+
+    uid = users_len;
+    if (uid == ROBIN_USER_DIR_LEN * ROBIN_USER_BLOCK_LEN) {
+        err("add: user table is full");
+        return -1;
+    }
+
+    /* first user of a block: allocate the blocks */
+    b = uid >> ROBIN_USER_BLOCK_SHIFT;
+    if (!users[b]) {
+        users[b] = aligned_alloc(sizeof(robin_user_t),
+                                 ROBIN_USER_BLOCK_LEN * sizeof(robin_user_t));
+        if (!users[b]) {
+            err("aligned_alloc: %s", strerror(errno));
+            return -1;
+        }
+        dbg("add: allocated block #%d", b);
+    }
+
+    if (!users_cred[b]) {
+        users_cred[b] = robin_user_cred_block_alloc(b);
+        if (!users_cred[b])
+            return -1;
+    }
+
+    cred = robin_user_cred_at(uid);
+    memcpy(cred->email, email, email_len);
+    cred->email[email_len] = '\0';
+    memcpy(cred->psw, psw, psw_len);
+    cred->psw[psw_len] = '\0';
+
+    user = robin_user_at(uid);
+    user->following = (uidset_t) UIDSET_INIT;
+    user->followers = (uidset_t) UIDSET_INIT;
+    user->followers_snap = NULL;
+    user->following_snap = NULL;
+    pthread_mutex_init(&user->mutex, NULL);
+    user->acquired = 0;
+    /* in disk mode the sets are loaded from the store on first use */
+    user->hydrated = !users_store;
+    user->dirty = 0;
+    user->referenced = 0;
+    user->cache_prev = -1;
+    user->cache_next = -1;
+    user->sugg = NULL;
+
+    /* publish the new entry to lock-free readers */
+    __atomic_store_n(&users_len, uid + 1, __ATOMIC_RELEASE);
+
+    return uid;
+}
+
+static int robin_user_add_hashed(const char *email, const char *psw)
+{
+    char line[ROBIN_USER_EMAIL_LEN + ROBIN_USER_PSW_LEN + 1];
+    robin_user_shard_t *shard;
+    int uid, ret = 0;
+    uint32_t hash;
+    size_t email_len, psw_len;
+
+    dbg("add: email=%s psw=%s", email, psw);
+
+    email_len = strlen(email);
+    if (email_len > ROBIN_USER_EMAIL_LEN - 1) {
+        warn("add: email is longer than " STR(ROBIN_USER_EMAIL_LEN)
+             " characters");
+        return 1;
+    }
+
+    psw_len = strlen(psw);
+    if (psw_len > ROBIN_USER_PSW_LEN - 1) {
+        warn("add: password is longer than " STR(ROBIN_USER_PSW_LEN)
+             " characters");
+        return 1;
+    }
+
+    hash = hash_mem(email, email_len);
+    shard = robin_user_shard_of(hash);
+
+    pthread_rwlock_wrlock(&shard->lock);
+
+    if (robin_user_index_lookup_unsafe(shard, email, email_len, hash) >= 0) {
+        /* email already used */
+        warn("add: user %s already registered", email);
+        ret = 2;
+        goto add_quit;
+    }
+
+    if (robin_user_index_reserve_unsafe(shard, shard->len + 1) < 0) {
+        ret = -1;
+        goto add_quit;
+    }
+
+    dbg("add: user not existing, allocating data...");
+
+    pthread_mutex_lock(&users_mutex);
+
+    uid = robin_user_append_unsafe(email, email_len, psw, psw_len);
+
+    /* do not add user on file system if the journal is not opened */
+    if (uid >= 0 && users_journal) {
+        memcpy(line, email, email_len);
+        line[email_len] = ':';
+        memcpy(line + email_len + 1, psw, psw_len);
+        line[email_len + 1 + psw_len] = '\n';
+
+        ret = robin_journal_append(users_journal, line,
+                                   email_len + psw_len + 2);
+    }
+
+    pthread_mutex_unlock(&users_mutex);
+
+    if (uid < 0) {
+        ret = -1;
+        goto add_quit;
+    }
+
+    dbg("add: new user uid=%d", uid);
+
+    robin_user_index_insert_unsafe(shard, hash, uid);
+
+add_quit:
+    pthread_rwlock_unlock(&shard->lock);
+
+    return ret;
+}
+
+/* resolve the uid of a registered email, -1 if not registered */
+static int robin_user_lookup(const char *email)
+{
+    size_t len = strlen(email);
+    uint32_t hash = hash_mem(email, len);
+    robin_user_shard_t *shard = robin_user_shard_of(hash);
+    int uid;
+
+    pthread_rwlock_rdlock(&shard->lock);
+    uid = robin_user_index_lookup_unsafe(shard, email, len, hash);
+    pthread_rwlock_unlock(&shard->lock);
+
+    return uid;
+}
+
+static int robin_user_shard_cmp(const void *a, const void *b)
+{
+    uint32_t x = ((const robin_user_lookup_req_t *) a)->hash
+                 >> (32 - ROBIN_USER_SHARD_BITS);
+    uint32_t y = ((const robin_user_lookup_req_t *) b)->hash
+                 >> (32 - ROBIN_USER_SHARD_BITS);
+
+    return (x > y) - (x < y);
+}
+
+/* resolve n emails (-1 if not registered), locking each shard only once */
+static int robin_user_lookup_many(const char **emails, int n, int *uids)
+{
+    robin_user_lookup_req_t *reqs;
+    robin_user_shard_t *shard;
+    int i, j;
+
+    reqs = malloc(n * sizeof(robin_user_lookup_req_t));
+    if (!reqs) {
+        err("malloc: %s", strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        reqs[i].idx = i;
+        reqs[i].len = strlen(emails[i]);
+        reqs[i].hash = hash_mem(emails[i], reqs[i].len);
+    }
+
+    qsort(reqs, n, sizeof(robin_user_lookup_req_t), robin_user_shard_cmp);
+
+    for (i = 0; i < n; i = j) {
+        shard = robin_user_shard_of(reqs[i].hash);
+
+        pthread_rwlock_rdlock(&shard->lock);
+        for (j = i; j < n && robin_user_shard_of(reqs[j].hash) == shard; j++)
+            uids[reqs[j].idx] =
+                robin_user_index_lookup_unsafe(shard, emails[reqs[j].idx],
+                                               reqs[j].len, reqs[j].hash);
+        pthread_rwlock_unlock(&shard->lock);
+    }
+
+    free(reqs);
+
+    return 0;
+}
+
+/* parse the lines of a chunk of the users file into records */
+static void *robin_user_load_parse(void *ctx)
+{
+    robin_user_loader_t *ld = (robin_user_loader_t *) ctx;
+    robin_user_record_t *rec;
+    const char *line, *eol, *colon;
+    size_t n = 0;
+
+    /* count the lines to allocate the records at once */
+    for (line = ld->start; line < ld->end; line = eol + 1, n++) {
+        eol = memchr(line, '\n', ld->end - line);
+        if (!eol)
+            eol = ld->end;
+    }
+
+    ld->records = malloc((n ? n : 1) * sizeof(robin_user_record_t));
+    if (!ld->records) {
+        err("malloc: %s", strerror(errno));
+        ld->ret = -1;
+        return NULL;
+    }
+
+    for (line = ld->start; line < ld->end; line = eol + 1) {
+        eol = memchr(line, '\n', ld->end - line);
+        if (!eol)
+            eol = ld->end;
+
+        /* skip blank lines */
+        if (eol == line)
+            continue;
+
+        /* separate email and password */
+        colon = memchr(line, ':', eol - line);
+        if (!colon) {
+            err("load: invalid format of user file");
+            ld->ret = -1;
+            return NULL;
+        }
+
+        rec = &ld->records[ld->len++];
+        rec->email = line;
+        rec->email_len = colon - line;
+        rec->psw = colon + 1;
+        rec->psw_len = eol - colon - 1;
+        rec->hash = hash_mem(rec->email, rec->email_len);
+    }
+
+    ld->ret = 0;
+
+    return NULL;
+}
+
+static inline int robin_user_is_acquired(robin_user_t *user)
+{
+    return __atomic_load_n(&user->acquired, __ATOMIC_ACQUIRE);
+}
+
+/* 0 on success, 1 if already acquired */
+static inline int robin_user_try_acquire(robin_user_t *user)
+{
+    return __atomic_exchange_n(&user->acquired, 1, __ATOMIC_ACQ_REL);
+}
+
+static void robin_user_snap_free(ebr_node_t *node)
+{
+    free((char *) node - offsetof(robin_user_snap_t, node));
+}
+
+static void robin_user_snap_put(robin_user_snap_t *snap)
+{
+    /* readers may still be loading the pointer, wait for them */
+    if (!__atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL))
+        ebr_retire(&snap->node, robin_user_snap_free);
+}
+
+static void robin_user_sugg_put_entry(robin_user_sugg_entry_t *entry)
+{
+    /* readers do not load the cache without the user mutex, no EBR needed */
+    if (!__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL)) {
+        robin_user_snap_put(entry->basis);
+        free(entry);
+    }
+}
+
+/* drop the cached suggestions, user mutex held */
+static void robin_user_sugg_invalidate_unsafe(robin_user_t *user)
+{
+    if (user->sugg) {
+        robin_user_sugg_put_entry(user->sugg);
+        user->sugg = NULL;
+    }
+}
+
+static int robin_user_uid_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* snapshot with room for n users, the caller fills it */
+static robin_user_snap_t *robin_user_snap_alloc(size_t n)
+{
+    robin_user_snap_t *snap;
+    char **emails;
 
-    /* Social data */
-    clist_t *following;
-    size_t   following_len;
-    clist_t *followers;
-    size_t   followers_len;
-    /* Synchronization needed because other threads can set the followers */
-    pthread_mutex_t followers_mutex;
-} robin_user_data_t;
+    snap = malloc(sizeof(robin_user_snap_t)
+                  + n * (sizeof(char *) + sizeof(uint32_t)));
+    if (!snap) {
+        err("malloc: %s", strerror(errno));
+        return NULL;
+    }
+
+    emails = (char **) (snap + 1);
+
+    snap->adj.len = n;
+    snap->adj.uids = (uint32_t *) (emails + n);
+    snap->adj.emails = emails;
+    snap->refs = 1;
+
+    return snap;
+}
+
+static robin_user_snap_t *robin_user_snap_build(const uidset_t *set)
+{
+    robin_user_snap_t *snap;
+    uint32_t *uids;
+    size_t n = set->len;
+
+    snap = robin_user_snap_alloc(n);
+    if (!snap)
+        return NULL;
+
+    uids = (uint32_t *) snap->adj.uids;
+
+    uidset_copy(set, uids);
+    if (set->hashed)
+        qsort(uids, n, sizeof(uint32_t), robin_user_uid_cmp);
+
+    for (size_t i = 0; i < n; i++)
+        snap->adj.emails[i] = robin_user_cred_at(uids[i])->email;
+
+    return snap;
+}
+
+/* unpublished snapshot of the users in both snapshots */
+static robin_user_snap_t *robin_user_snap_intersect(const robin_user_snap_t *a,
+                                                    const robin_user_snap_t *b)
+{
+    robin_user_snap_t *snap;
+    size_t n = a->adj.len < b->adj.len ? a->adj.len : b->adj.len;
+
+    snap = robin_user_snap_alloc(n);
+    if (!snap)
+        return NULL;
+
+    /* only the common users get their emails */
+    n = intersect_u32(a->adj.uids, a->adj.len, b->adj.uids, b->adj.len,
+                      (uint32_t *) snap->adj.uids);
+
+    for (size_t i = 0; i < n; i++)
+        snap->adj.emails[i] = robin_user_cred_at(snap->adj.uids[i])->email;
+    snap->adj.len = n;
+
+    return snap;
+}
+
+/* unpublish the snapshot of a set that changed, user mutex held */
+static void robin_user_snap_invalidate_unsafe(robin_user_snap_t **slot)
+{
+    robin_user_snap_t *old;
+
+    old = __atomic_exchange_n(slot, NULL, __ATOMIC_ACQ_REL);
+    if (old)
+        robin_user_snap_put(old);
+}
+
+/* a set of the user changed, user mutex held */
+static void robin_user_changed_unsafe(robin_user_t *user,
+                                      robin_store_list_t list)
+{
+    user->dirty |= ROBIN_USER_DIRTY(list);
+
+    if (list == ROBIN_STORE_FOLLOWING)
+        robin_user_snap_invalidate_unsafe(&user->following_snap);
+    else
+        robin_user_snap_invalidate_unsafe(&user->followers_snap);
+}
+
+/* insert behind the hand, the last user it visits */
+static void robin_user_cache_link_unsafe(int uid)
+{
+    robin_user_t *user = robin_user_at(uid), *hand;
+
+    if (users_cache_hand < 0) {
+        user->cache_prev = uid;
+        user->cache_next = uid;
+        users_cache_hand = uid;
+    } else {
+        hand = robin_user_at(users_cache_hand);
+        user->cache_prev = hand->cache_prev;
+        user->cache_next = users_cache_hand;
+        robin_user_at(hand->cache_prev)->cache_next = uid;
+        hand->cache_prev = uid;
+    }
+
+    users_cache_len++;
+}
+
+static void robin_user_cache_unlink_unsafe(int uid)
+{
+    robin_user_t *user = robin_user_at(uid);
+
+    if (user->cache_next == uid) {
+        users_cache_hand = -1;
+    } else {
+        robin_user_at(user->cache_prev)->cache_next = user->cache_next;
+        robin_user_at(user->cache_next)->cache_prev = user->cache_prev;
+        if (users_cache_hand == uid)
+            users_cache_hand = user->cache_next;
+    }
+
+    user->cache_prev = -1;
+    user->cache_next = -1;
+    users_cache_len--;
+}
+
+/* load the sets of the user from the store if needed, user mutex held */
+static int robin_user_hydrate_unsafe(int uid)
+{
+    robin_user_t *user = robin_user_at(uid);
+    uidset_t *sets[ROBIN_STORE_LISTS] = { &user->following, &user->followers };
+    uint32_t *buf = NULL, len = robin_user_len();
+    size_t cap = 0;
+    ssize_t n;
+
+    __atomic_store_n(&user->referenced, 1, __ATOMIC_RELAXED);
+
+    if (user->hydrated)
+        return 0;
+
+    for (int l = 0; l < ROBIN_STORE_LISTS; l++) {
+        n = robin_store_read(uid, l, &buf, &cap);
+        if (n < 0)
+            goto hydrate_fail;
+
+        /* sorted lists, appended to the vectors */
+        for (ssize_t i = 0; i < n; i++) {
+            /* the users file may have lost registrations the store knows */
+            if (buf[i] >= len || buf[i] == (uint32_t) uid)
+                continue;
+
+            if (uidset_add(sets[l], buf[i]) < 0)
+                goto hydrate_fail;
+        }
+    }
+
+    free(buf);
+
+    user->hydrated = 1;
+    user->dirty = 0;
+
+    pthread_mutex_lock(&users_cache_mutex);
+    robin_user_cache_link_unsafe(uid);
+    pthread_mutex_unlock(&users_cache_mutex);
+
+    return 0;
+
+hydrate_fail:
+    err("hydrate: cannot load the sets of user %d", uid);
+    free(buf);
+    uidset_free(&user->following);
+    uidset_free(&user->followers);
+
+    return -1;
+}
+
+/* save the changed sets of an hydrated user to the store, user mutex held */
+static int robin_user_writeback_unsafe(int uid)
+{
+    robin_user_t *user = robin_user_at(uid);
+    const uidset_t *sets[ROBIN_STORE_LISTS] = {
+        &user->following, &user->followers
+    };
+    uint32_t *buf;
+    size_t n;
+    int ret;
+
+    for (int l = 0; l < ROBIN_STORE_LISTS; l++) {
+        if (!(user->dirty & ROBIN_USER_DIRTY(l)))
+            continue;
+
+        buf = malloc((sets[l]->len ? sets[l]->len : 1) * sizeof(uint32_t));
+        if (!buf) {
+            err("malloc: %s", strerror(errno));
+            return -1;
+        }
+
+        n = uidset_copy(sets[l], buf);
+        if (sets[l]->hashed)
+            qsort(buf, n, sizeof(uint32_t), robin_user_uid_cmp);
+
+        ret = robin_store_write(uid, l, buf, n);
+        free(buf);
+        if (ret < 0)
+            return -1;
+
+        user->dirty &= ~ROBIN_USER_DIRTY(l);
+    }
+
+    return 0;
+}
+
+/* drop the sets of an user unlinked from the cache, user mutex held */
+static int robin_user_evict_unsafe(int uid)
+{
+    robin_user_t *user = robin_user_at(uid);
+
+    if (robin_user_writeback_unsafe(uid) < 0)
+        return -1;
+
+    robin_user_snap_invalidate_unsafe(&user->following_snap);
+    robin_user_snap_invalidate_unsafe(&user->followers_snap);
+    robin_user_sugg_invalidate_unsafe(user);
+    uidset_free(&user->following);
+    uidset_free(&user->followers);
+    user->hydrated = 0;
+
+    return 0;
+}
+
+/* evict users until the cache fits, no user mutex held */
+static void robin_user_cache_trim(void)
+{
+    robin_user_t *user;
+    int uid, scan, ret;
+
+    if (!users_store)
+        return;
+
+    pthread_mutex_lock(&users_cache_mutex);
+
+    while (users_cache_len > users_cache_max) {
+        for (scan = 0; scan < ROBIN_USER_CACHE_SCAN; scan++) {
+            uid = users_cache_hand;
+            user = robin_user_at(uid);
+            users_cache_hand = user->cache_next;
+
+            /* second chance, then skip pinned and busy users */
+            if (!__atomic_exchange_n(&user->referenced, 0, __ATOMIC_RELAXED)
+                && !robin_user_is_acquired(user)
+                && !pthread_mutex_trylock(&user->mutex))
+                break;
+        }
+
+        if (scan == ROBIN_USER_CACHE_SCAN)
+            break;
+
+        robin_user_cache_unlink_unsafe(uid);
+        pthread_mutex_unlock(&users_cache_mutex);
+
+        ret = robin_user_evict_unsafe(uid);
+
+        pthread_mutex_lock(&users_cache_mutex);
+
+        /* keep the changes in memory, the store is failing */
+        if (ret < 0) {
+            robin_user_cache_link_unsafe(uid);
+            pthread_mutex_unlock(&user->mutex);
+            break;
+        }
+
+        pthread_mutex_unlock(&user->mutex);
+    }
+
+    pthread_mutex_unlock(&users_cache_mutex);
+}
+
+/* get a reference to the snapshot of one of the sets of the user */
+static robin_user_snap_t *robin_user_snap_get(int uid,
+                                              robin_user_snap_t **slot,
+                                              const uidset_t *set)
+{
+    robin_user_t *user = robin_user_at(uid);
+    robin_user_snap_t *snap;
+    uint32_t refs = 0;
+
+    /* fast path: take a reference to the published snapshot, if still alive */
+    ebr_enter();
+    snap = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (snap) {
+        refs = __atomic_load_n(&snap->refs, __ATOMIC_RELAXED);
+        while (refs && !__atomic_compare_exchange_n(&snap->refs, &refs,
+                                                    refs + 1, 0,
+                                                    __ATOMIC_ACQUIRE,
+                                                    __ATOMIC_RELAXED))
+            ;
+    }
+    ebr_exit();
+
+    if (refs)
+        return snap;
+
+    /* slow path: the set changed since the last build */
+    pthread_mutex_lock(&user->mutex);
+
+    snap = __atomic_load_n(slot, __ATOMIC_RELAXED);
+    if (!snap && !robin_user_hydrate_unsafe(uid)) {
+        snap = robin_user_snap_build(set);
+        if (snap)
+            __atomic_store_n(slot, snap, __ATOMIC_RELEASE);
+    }
+
+    if (snap)
+        __atomic_add_fetch(&snap->refs, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&user->mutex);
+
+    robin_user_cache_trim();
+
+    return snap;
+}
+
+static inline uint64_t robin_user_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int robin_user_uids_contains(const uint32_t *uids, size_t n,
+                                    uint32_t uid)
+{
+    size_t lo = 0, hi = n, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (uids[mid] < uid)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo < n && uids[lo] == uid;
+}
+
+/* more shared users first, then lower uids */
+static inline int robin_user_sugg_better(const robin_user_sugg_cand_t *a,
+                                         const robin_user_sugg_cand_t *b)
+{
+    return a->shared > b->shared || (a->shared == b->shared && a->uid < b->uid);
+}
+
+static int robin_user_sugg_cmp(const void *a, const void *b)
+{
+    if (robin_user_sugg_better(a, b))
+        return -1;
+
+    return robin_user_sugg_better(b, a);
+}
+
+/* restore the heap of the k best candidates, the worst one on top */
+static void robin_user_sugg_sift_down(robin_user_sugg_cand_t *heap, size_t n,
+                                      size_t i)
+{
+    robin_user_sugg_cand_t tmp;
+    size_t worst, c;
+
+    for (;;) {
+        worst = i;
+        for (c = 2 * i + 1; c <= 2 * i + 2 && c < n; c++)
+            if (robin_user_sugg_better(&heap[worst], &heap[c]))
+                worst = c;
+
+        if (worst == i)
+            return;
+
+        tmp = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = tmp;
+        i = worst;
+    }
+}
+
+static robin_user_sugg_entry_t *
+robin_user_sugg_build(int uid, const robin_user_adj_t *following, size_t k)
+{
+    robin_user_snap_t *snaps[ROBIN_USER_SUGGEST_FANOUT];
+    robin_user_sugg_cand_t *slots = NULL, *heap = NULL, cand;
+    robin_user_sugg_entry_t *entry = NULL;
+    const robin_user_adj_t *adj;
+    size_t nv, ns, total = 0, cap, mask, n = 0, h;
+    uint32_t w, *uids, *shared;
+    char **emails;
+    robin_user_t *v;
+
+    /* visit the followed users evenly spread along the list */
+    nv = following->len;
+    if (nv > ROBIN_USER_SUGGEST_FANOUT)
+        nv = ROBIN_USER_SUGGEST_FANOUT;
+
+    for (size_t i = 0; i < nv; i++) {
+        w = following->uids[i * following->len / nv];
+        v = robin_user_at(w);
+
+        snaps[i] = robin_user_snap_get(w, &v->following_snap, &v->following);
+        if (!snaps[i]) {
+            nv = i;
+            goto build_quit;
+        }
+
+        total += snaps[i]->adj.len < ROBIN_USER_SUGGEST_SAMPLE
+                 ? snaps[i]->adj.len : ROBIN_USER_SUGGEST_SAMPLE;
+    }
+
+    /* count the candidates in an open addressing table, load below 1/2 */
+    for (cap = 16; cap < 2 * total; cap *= 2)
+        ;
+    mask = cap - 1;
+
+    slots = malloc(cap * sizeof(robin_user_sugg_cand_t));
+    heap = malloc((k ? k : 1) * sizeof(robin_user_sugg_cand_t));
+    if (!slots || !heap) {
+        err("malloc: %s", strerror(errno));
+        goto build_quit;
+    }
+
+    for (size_t i = 0; i < cap; i++)
+        slots[i].uid = UINT32_MAX;
+
+    for (size_t i = 0; i < nv; i++) {
+        adj = &snaps[i]->adj;
+
+        ns = adj->len;
+        if (ns > ROBIN_USER_SUGGEST_SAMPLE)
+            ns = ROBIN_USER_SUGGEST_SAMPLE;
+
+        for (size_t j = 0; j < ns; j++) {
+            w = adj->uids[j * adj->len / ns];
+
+            if (w == (uint32_t) uid
+                || robin_user_uids_contains(following->uids, following->len,
+                                            w))
+                continue;
+
+            for (h = hash_u32(w) & mask; slots[h].uid != UINT32_MAX
+                                         && slots[h].uid != w;
+                 h = (h + 1) & mask)
+                ;
+
+            if (slots[h].uid == UINT32_MAX) {
+                slots[h].uid = w;
+                slots[h].shared = 0;
+            }
+            slots[h].shared++;
+        }
+    }
+
+    /* keep the k best candidates */
+    for (size_t i = 0; i < cap && k; i++) {
+        if (slots[i].uid == UINT32_MAX)
+            continue;
+
+        cand = slots[i];
+
+        if (n < k) {
+            /* sift up */
+            for (h = n++; h && robin_user_sugg_better(&heap[(h - 1) / 2],
+                                                      &cand);
+                 h = (h - 1) / 2)
+                heap[h] = heap[(h - 1) / 2];
+            heap[h] = cand;
+        } else if (robin_user_sugg_better(&cand, &heap[0])) {
+            heap[0] = cand;
+            robin_user_sugg_sift_down(heap, n, 0);
+        }
+    }
+
+    qsort(heap, n, sizeof(robin_user_sugg_cand_t), robin_user_sugg_cmp);
+
+    entry = malloc(sizeof(robin_user_sugg_entry_t)
+                   + n * (sizeof(char *) + 2 * sizeof(uint32_t)));
+    if (!entry) {
+        err("malloc: %s", strerror(errno));
+        goto build_quit;
+    }
+
+    emails = (char **) (entry + 1);
+    uids = (uint32_t *) (emails + n);
+    shared = uids + n;
+
+    for (size_t i = 0; i < n; i++) {
+        uids[i] = heap[i].uid;
+        shared[i] = heap[i].shared;
+        emails[i] = robin_user_cred_at(uids[i])->email;
+    }
+
+    entry->sugg.len = n;
+    entry->sugg.uids = uids;
+    entry->sugg.emails = emails;
+    entry->sugg.shared = shared;
+    entry->k = k;
+
+build_quit:
+    for (size_t i = 0; i < nv; i++)
+        robin_user_snap_put(snaps[i]);
+    free(slots);
+    free(heap);
+
+    return entry;
+}
+
+/* add the edge follower -> followee: 0 on success, 1 if present, -1 on error */
+static int robin_user_edge_add(int follower, int followee)
+{
+    robin_user_t *me = robin_user_at(follower);
+    robin_user_t *found = robin_user_at(followee);
+    int ret;
+
+    pthread_mutex_lock(&me->mutex);
+    ret = robin_user_hydrate_unsafe(follower);
+    if (!ret)
+        ret = uidset_add(&me->following, followee);
+    if (!ret)
+        robin_user_changed_unsafe(me, ROBIN_STORE_FOLLOWING);
+    pthread_mutex_unlock(&me->mutex);
+
+    if (ret)
+        goto edge_add_quit;
+
+    pthread_mutex_lock(&found->mutex);
+    ret = robin_user_hydrate_unsafe(followee);
+    if (!ret)
+        ret = uidset_add(&found->followers, follower);
+    if (!ret)
+        robin_user_changed_unsafe(found, ROBIN_STORE_FOLLOWERS);
+    pthread_mutex_unlock(&found->mutex);
+
+    if (ret < 0) {
+        /* the follower may have been evicted meanwhile */
+        pthread_mutex_lock(&me->mutex);
+        if (!robin_user_hydrate_unsafe(follower)) {
+            uidset_remove(&me->following, followee);
+            robin_user_changed_unsafe(me, ROBIN_STORE_FOLLOWING);
+        }
+        pthread_mutex_unlock(&me->mutex);
+
+        goto edge_add_quit;
+    }
+
+    ret = 0;
+
+edge_add_quit:
+    robin_user_cache_trim();
+
+    return ret;
+}
+
+/* remove the edge follower -> followee: 0 on success, 1 if not present,
+ * -1 on error */
+static int robin_user_edge_remove(int follower, int followee)
+{
+    robin_user_t *me = robin_user_at(follower);
+    robin_user_t *found = robin_user_at(followee);
+    int ret;
+
+    pthread_mutex_lock(&me->mutex);
+    ret = robin_user_hydrate_unsafe(follower);
+    if (!ret)
+        ret = uidset_remove(&me->following, followee);
+    if (!ret)
+        robin_user_changed_unsafe(me, ROBIN_STORE_FOLLOWING);
+    pthread_mutex_unlock(&me->mutex);
+
+    if (ret)
+        goto edge_remove_quit;
+
+    pthread_mutex_lock(&found->mutex);
+    ret = robin_user_hydrate_unsafe(followee);
+    if (!ret)
+        ret = uidset_remove(&found->followers, follower);
+    if (!ret)
+        robin_user_changed_unsafe(found, ROBIN_STORE_FOLLOWERS);
+    pthread_mutex_unlock(&found->mutex);
+
+    if (ret < 0) {
+        /* the follower may have been evicted meanwhile */
+        pthread_mutex_lock(&me->mutex);
+        if (!robin_user_hydrate_unsafe(follower)) {
+            uidset_add(&me->following, followee);
+            robin_user_changed_unsafe(me, ROBIN_STORE_FOLLOWING);
+        }
+        pthread_mutex_unlock(&me->mutex);
+
+        goto edge_remove_quit;
+    }
+
+    if (ret)
+        warn("edge_remove: user %d was not a follower of user %d",
+             follower, followee);
+
+    ret = 0;
+
+edge_remove_quit:
+    robin_user_cache_trim();
+
+    return ret;
+}
+
+/* one edge of a set: 0 if changed, 1 if already so, -1 on error */
+static inline int robin_user_set_change(uidset_t *set, robin_graph_op_t op,
+                                        uint32_t uid)
+{
+    if (op == ROBIN_GRAPH_FOLLOW)
+        return uidset_add(set, uid);
+
+    return uidset_remove(set, uid);
+}
+
+/*
+ * Change the edges from follower to the uids whose result is 0: the
+ * following set in one pass under the follower mutex, then the followers set
+ * of each followee under its own mutex. The result of each edge becomes 0 if
+ * changed, 1 if already so (duplicates of the batch too), -1 on error; the
+ * edges whose followee failed are undone under the follower mutex again.
+ */
+static int robin_user_edges_change(robin_graph_op_t op, int follower,
+                                   const int *uids, int n, int *results)
+{
+    robin_user_t *me = robin_user_at(follower), *found;
+    robin_graph_op_t undo = op == ROBIN_GRAPH_FOLLOW ? ROBIN_GRAPH_UNFOLLOW
+                                                     : ROBIN_GRAPH_FOLLOW;
+    int changed = 0, failed = 0, ret;
+
+    pthread_mutex_lock(&me->mutex);
+
+    ret = robin_user_hydrate_unsafe(follower);
+    for (int i = 0; i < n; i++) {
+        if (results[i])
+            continue;
+
+        results[i] = ret < 0 ? -1
+                             : robin_user_set_change(&me->following, op,
+                                                     uids[i]);
+        changed |= !results[i];
+    }
+
+    if (changed)
+        robin_user_changed_unsafe(me, ROBIN_STORE_FOLLOWING);
+
+    pthread_mutex_unlock(&me->mutex);
+
+    for (int i = 0; i < n; i++) {
+        if (results[i])
+            continue;
+
+        found = robin_user_at(uids[i]);
+
+        pthread_mutex_lock(&found->mutex);
+        ret = robin_user_hydrate_unsafe(uids[i]);
+        if (!ret)
+            ret = robin_user_set_change(&found->followers, op, follower);
+        if (!ret)
+            robin_user_changed_unsafe(found, ROBIN_STORE_FOLLOWERS);
+        pthread_mutex_unlock(&found->mutex);
+
+        if (ret < 0) {
+            /* undone below, marked apart from the edges never changed */
+            results[i] = -2;
+            failed = 1;
+        } else if (ret) {
+            warn("edges_change: followers of user %d out of sync with user %d",
+                 uids[i], follower);
+        }
+    }
+
+    if (failed) {
+        /* acquired users are not evicted, the follower is still hydrated */
+        pthread_mutex_lock(&me->mutex);
+        for (int i = 0; i < n; i++) {
+            if (results[i] != -2)
+                continue;
+
+            robin_user_set_change(&me->following, undo, uids[i]);
+            results[i] = -1;
+        }
+        robin_user_changed_unsafe(me, ROBIN_STORE_FOLLOWING);
+        pthread_mutex_unlock(&me->mutex);
+    }
+
+    robin_user_cache_trim();
+
+    for (int i = 0; i < n; i++) {
+        if (results[i] < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* resolve, apply and record a batch of follows or unfollows of a user */
+static int robin_user_change_many(robin_graph_op_t op, int uid,
+                                  const char **emails, int n, int *results)
+{
+    robin_graph_op_t undo = op == ROBIN_GRAPH_FOLLOW ? ROBIN_GRAPH_UNFOLLOW
+                                                     : ROBIN_GRAPH_FOLLOW;
+    uint32_t *applied;
+    int *uids, napplied = 0, ret;
+
+    for (int i = 0; i < n; i++)
+        results[i] = -1;
+
+    if (!robin_user_is_acquired(robin_user_at(uid))) {
+        err("follow: user %d (%s) is not acquired", uid,
+            robin_user_cred_at(uid)->email);
+        return -1;
+    }
+
+    uids = calloc(n, sizeof(int));
+    applied = malloc(n * sizeof(uint32_t));
+    if (!uids || !applied) {
+        err("calloc: %s", strerror(errno));
+        free(uids);
+        free(applied);
+        return -1;
+    }
+
+    if (robin_user_lookup_many(emails, n, uids) < 0) {
+        free(uids);
+        free(applied);
+        return -1;
+    }
+
+    /* an user cannot follow himself */
+    for (int i = 0; i < n; i++) {
+        results[i] = uids[i] < 0 || uids[i] == uid;
+        if (results[i])
+            warn("follow: user %s does not exist", emails[i]);
+    }
+
+    /*
+     * Users cannot be deleted at run time and table entries never move,
+     * the per-user mutexes are enough.
+     */
+    ret = robin_user_edges_change(op, uid, uids, n, results);
+
+    for (int i = 0; i < n; i++) {
+        if (!results[i])
+            applied[napplied++] = uids[i];
+    }
+
+    /* record the whole batch at once, or undo it */
+    if (robin_graph_log(op, uid, applied, napplied) < 0) {
+        robin_user_edges_change(undo, uid, uids, n, results);
+
+        for (int i = 0; i < n; i++) {
+            if (results[i] <= 0)
+                results[i] = -1;
+        }
+        ret = -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (results[i] != 1 || uids[i] < 0 || uids[i] == uid)
+            continue;
+
+        if (op == ROBIN_GRAPH_FOLLOW) {
+            warn("follow: user %s is already followed", emails[i]);
+            results[i] = 2;
+        } else {
+            warn("follow: user %s is not followed", emails[i]);
+        }
+    }
+
+    free(uids);
+    free(applied);
+
+    return ret;
+}
+
+static void robin_user_free_unsafe(robin_user_t *user)
+{
+    /* the basis, unless still published, goes through EBR */
+    if (user->sugg) {
+        if (user->sugg->basis != user->following_snap)
+            robin_user_snap_put(user->sugg->basis);
+        free(user->sugg);
+    }
+
+    /* no reader is left, snapshots can be freed right away */
+    if (user->followers_snap)
+        free(user->followers_snap);
+    if (user->following_snap)
+        free(user->following_snap);
+
+    dbg("user_free: following=%p", user->following.v);
+    uidset_free(&user->following);
+
+    dbg("user_free: followers=%p", user->followers.v);
+    uidset_free(&user->followers);
+
+    pthread_mutex_destroy(&user->mutex);
+}
+
+
+/*
+ * Follow graph persistence callbacks
+ */
+
+static uint32_t robin_user_graph_users(void)
+{
+    return robin_user_len();
+}
+
+static ssize_t robin_user_graph_followers(uint32_t uid, uint32_t **buf,
+                                          size_t *cap)
+{
+    robin_user_t *user = robin_user_at(uid);
+    uint32_t *new_buf, len;
+    ssize_t m;
+    size_t n;
+
+    pthread_mutex_lock(&user->mutex);
+
+    /* disk mode: users not in memory are read as stored, not hydrated */
+    if (!user->hydrated) {
+        m = robin_store_read(uid, ROBIN_STORE_FOLLOWERS, buf, cap);
+        pthread_mutex_unlock(&user->mutex);
+        if (m < 0)
+            return -1;
+
+        /* as in hydration, uids unknown to the users file are dropped */
+        len = robin_user_len();
+        n = 0;
+        for (ssize_t i = 0; i < m; i++) {
+            if ((*buf)[i] < len && (*buf)[i] != uid)
+                (*buf)[n++] = (*buf)[i];
+        }
+
+        return n;
+    }
+
+    n = user->followers.len;
+    if (n > *cap) {
+        new_buf = realloc(*buf, n * sizeof(uint32_t));
+        if (!new_buf) {
+            err("realloc: %s", strerror(errno));
+            pthread_mutex_unlock(&user->mutex);
+            return -1;
+        }
+        *buf = new_buf;
+        *cap = n;
+    }
 
-typedef struct robin_user {
-    robin_user_data_t *data; /* user data */
-    pthread_mutex_t acquired; /* exclusive access to user data */
-} robin_user_t;
+    uidset_copy(&user->followers, *buf);
 
+    pthread_mutex_unlock(&user->mutex);
 
-/*
- * Local data
- */
+    return n;
+}
 
-static char *users_file = NULL;
-static robin_user_t *users = NULL;
-static int users_len = 0;
-static pthread_mutex_t users_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* set the edge follower -> followee, without recording it */
+static int robin_user_graph_apply(robin_graph_op_t op, uint32_t follower,
+                                  uint32_t followee)
+{
+    if (op == ROBIN_GRAPH_UNFOLLOW)
+        return robin_user_edge_remove(follower, followee) < 0 ? -1 : 0;
 
+    return robin_user_edge_add(follower, followee) < 0 ? -1 : 0;
+}
 
-/*
- * Local functions
- */
+/* disk mode: only the lists are loaded, users are hydrated on first use */
+static int robin_user_graph_restore(uint64_t *journal_off)
+{
+    return robin_store_open(users_store, journal_off);
+}
 
-static int robin_user_add_unsafe(const char * email, const char * psw)
+/* disk mode: write back the hydrated users, then checkpoint the store */
+static int robin_user_graph_save(uint64_t journal_off)
 {
-    int i, uid;
-    FILE *fp;
-    size_t email_len, psw_len;
+    robin_user_t *user;
+    int *uids, n = 0, ret = 0;
 
-    dbg("add: email=%s psw=%s", email, psw);
+    pthread_mutex_lock(&users_cache_mutex);
 
-    email_len = strlen(email);
-    if (email_len > ROBIN_USER_EMAIL_LEN - 1) {
-        warn("add: email is longer than " STR(ROBIN_USER_EMAIL_LEN)
-             " characters");
-        return 1;
+    uids = malloc((users_cache_len ? users_cache_len : 1) * sizeof(int));
+    if (uids) {
+        for (int uid = users_cache_hand; n < (int) users_cache_len;
+             uid = robin_user_at(uid)->cache_next)
+            uids[n++] = uid;
     }
 
-    psw_len = strlen(psw);
-    if (psw_len > ROBIN_USER_PSW_LEN - 1) {
-        warn("add: password is longer than " STR(ROBIN_USER_PSW_LEN)
-             " characters");
-        return 1;
+    pthread_mutex_unlock(&users_cache_mutex);
+
+    if (!uids) {
+        err("malloc: %s", strerror(errno));
+        return -1;
     }
 
-    for (i = 0; i < users_len; i++)
-        if (!strncmp(email, users[i].data->email, ROBIN_USER_EMAIL_LEN))
-            break;
+    /* users evicted meanwhile were written back by the eviction */
+    for (int i = 0; i < n && !ret; i++) {
+        user = robin_user_at(uids[i]);
 
-    if (i < users_len) {  /* email already used */
-        warn("add: user %s already registered", email);
-        return 2;
+        pthread_mutex_lock(&user->mutex);
+        if (user->hydrated)
+            ret = robin_user_writeback_unsafe(uids[i]);
+        pthread_mutex_unlock(&user->mutex);
     }
 
-    dbg("add: user not existing, allocating data...");
+    free(uids);
 
-    users = realloc(users, (users_len + 1) * sizeof(robin_user_t));
-    if (!users) {
-        err("realloc: %s", strerror(errno));
+    if (ret < 0)
         return -1;
-    }
-    uid = users_len++;
 
-    users[uid].data = malloc(sizeof(robin_user_data_t));
-    if (!users[uid].data) {
+    return robin_store_checkpoint(journal_off);
+}
+
+static const robin_graph_ops_t robin_user_graph_ops = {
+    .users = robin_user_graph_users,
+    .followers = robin_user_graph_followers,
+    .apply = robin_user_graph_apply
+};
+
+static const robin_graph_ops_t robin_user_graph_disk_ops = {
+    .users = robin_user_graph_users,
+    .followers = robin_user_graph_followers,
+    .apply = robin_user_graph_apply,
+    .restore = robin_user_graph_restore,
+    .save = robin_user_graph_save
+};
+
+
+/*
+ * Exported functions
+ */
+
+int robin_user_store_init(const char *path, size_t cache_max)
+{
+    size_t len = strlen(path);
+
+    users_store = malloc(len + sizeof(".cred"));
+    if (!users_store) {
         err("malloc: %s", strerror(errno));
         return -1;
     }
 
-    strcpy(users[uid].data->email, email);
-    strcpy(users[uid].data->psw, psw);
-    users[uid].data->following = NULL;
-    users[uid].data->following_len = 0;
-    users[uid].data->followers = NULL;
-    users[uid].data->followers_len = 0;
-    if (pthread_mutex_init(&users[uid].data->followers_mutex, NULL) < 0) {
-        err("pthread_mutex_init: %s", strerror(errno));
+    /* credentials are rebuilt from the users file at each start */
+    snprintf(users_store, len + sizeof(".cred"), "%s.cred", path);
+    users_cred_fd = open(users_store, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (users_cred_fd < 0) {
+        err("open: %s", strerror(errno));
+        free(users_store);
+        users_store = NULL;
         return -1;
     }
-    dbg("add: data allocated and initialized");
-
-    pthread_mutex_init(&users[uid].acquired, NULL);
-
-    dbg("add: new user uid=%d", uid);
 
-    /* do not add user on file system if file pointer is not initialized */
-    if (!users_file)
-        return 0;
+    users_store[len] = '\0';
+    users_cache_max = cache_max;
 
-    fp = fopen(users_file, "a+");
-    if (!fp) {
-        err("fopen: %s", strerror(errno));
-        return -1;
-    }
-    fprintf(fp, "%s:%s\n", email, psw);
-    fclose(fp);
+    info("store: follow graph in %s, up to %zu users in memory", path,
+         cache_max);
 
     return 0;
 }
 
-static int robin_user_is_acquired(robin_user_t *user)
+int robin_users_load(const char *filename)
 {
-    int ret;
+    robin_user_loader_t loaders[ROBIN_USER_LOAD_THREADS_MAX];
+    size_t shard_len[ROBIN_USER_SHARD_NUM] = { 0 };
+    robin_user_shard_t *shard;
+    robin_user_record_t *rec;
+    struct stat st;
+    char *map = NULL;
+    const char *cut;
+    robin_journal_opts_t opts = {
+        .flush_size = ROBIN_USER_FILE_FLUSH_SIZE,
+        .flush_ms = ROBIN_USER_FILE_FLUSH_MS,
+        .sync = ROBIN_USER_FILE_SYNC
+    };
+    size_t size, loaded = 0;
+    long nprocs;
+    int fd, nthreads, uid, ret = 0;
 
-    ret = pthread_mutex_trylock(&user->acquired);
-    dbg("is_acquired: trylock: ret=%d", ret);
-    if (ret == 0) {
-        pthread_mutex_unlock(&user->acquired);
-        return 0;
-    } else if (ret == EBUSY) {
-        return 1;
-    } else {
-        err("pthread_mutex_trylock: ret=%d", ret);
+    dbg("load: open file %s", filename);
+
+    fd = open(filename, O_RDONLY | O_CREAT, 0644);
+    if (fd < 0) {
+        err("open: %s", strerror(errno));
         return -1;
     }
-}
 
-static void robin_user_data_free_unsafe(robin_user_data_t *data)
-{
-    clist_t *cur, *next;
+    if (fstat(fd, &st) < 0) {
+        err("fstat: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    size = st.st_size;
 
-    if (data) {
-        if (data->following) {
-            cur = data->following;
+    if (size > 0) {
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            err("mmap: %s", strerror(errno));
+            close(fd);
+            return -1;
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+    }
 
-            while (cur != NULL) {
-                next = cur->next;
-                dbg("data_free: following=%p", cur);
-                free(cur);
-                cur = next;
-            }
+    /* one thread per ROBIN_USER_LOAD_CHUNK_MIN bytes, at most one per cpu */
+    nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = size / ROBIN_USER_LOAD_CHUNK_MIN + 1;
+    if (nthreads > nprocs)
+        nthreads = nprocs > 0 ? nprocs : 1;
+    if (nthreads > ROBIN_USER_LOAD_THREADS_MAX)
+        nthreads = ROBIN_USER_LOAD_THREADS_MAX;
+
+    /* split the file in chunks of whole lines */
+    for (int i = 0; i < nthreads; i++) {
+        memset(&loaders[i], 0, sizeof(robin_user_loader_t));
+
+        loaders[i].start = i ? loaders[i - 1].end : map;
+
+        cut = map + size * (i + 1) / nthreads;
+        if (i < nthreads - 1 && cut > loaders[i].start) {
+            cut = memchr(cut - 1, '\n', map + size - (cut - 1));
+            cut = cut ? cut + 1 : map + size;
+        } else if (i == nthreads - 1) {
+            cut = map + size;
+        } else {
+            cut = loaders[i].start;
         }
+        loaders[i].end = cut;
+    }
 
-        if (data->followers) {
-            cur = data->followers;
+    dbg("load: %zu bytes, %d parsing threads", size, nthreads);
 
-            while (cur != NULL) {
-                next = cur->next;
-                dbg("data_free: followers=%p", cur);
-                free(cur);
-                cur = next;
-            }
+    /* parse the chunks in parallel, the first one on this thread */
+    for (int i = 1; i < nthreads; i++) {
+        loaders[i].spawned = !pthread_create(&loaders[i].thread, NULL,
+                                             robin_user_load_parse,
+                                             &loaders[i]);
+        if (!loaders[i].spawned)
+            robin_user_load_parse(&loaders[i]);
+    }
+    robin_user_load_parse(&loaders[0]);
+    for (int i = 1; i < nthreads; i++)
+        if (loaders[i].spawned)
+            pthread_join(loaders[i].thread, NULL);
+
+    /* deduplicate and build the user table in file order */
+    for (int i = 0; i < ROBIN_USER_SHARD_NUM; i++)
+        pthread_rwlock_wrlock(&users_shards[i].lock);
+    pthread_mutex_lock(&users_mutex);
+
+    for (int i = 0; i < nthreads && !ret; i++) {
+        if (loaders[i].ret < 0) {
+            ret = -1;
+            break;
         }
 
-        dbg("data_free: data=%p", data);
-        free(data);
+        for (size_t j = 0; j < loaders[i].len; j++)
+            shard_len[loaders[i].records[j].hash
+                      >> (32 - ROBIN_USER_SHARD_BITS)]++;
     }
-}
 
+    for (int i = 0; i < ROBIN_USER_SHARD_NUM && !ret; i++)
+        if (robin_user_index_reserve_unsafe(&users_shards[i],
+                                            users_shards[i].len
+                                            + shard_len[i]) < 0)
+            ret = -1;
 
-/*
- * Exported functions
- */
-
-int robin_users_load(const char *filename)
-{
-    FILE *fp;
-    char *buf = NULL, *ptr;
-    size_t filename_len, buf_len = 0;
-    ssize_t nread;
+    for (int i = 0; i < nthreads && !ret; i++) {
+        for (size_t j = 0; j < loaders[i].len; j++) {
+            rec = &loaders[i].records[j];
 
-    dbg("load: open file %s", filename);
+            if (rec->email_len > ROBIN_USER_EMAIL_LEN - 1 ||
+                rec->psw_len > ROBIN_USER_PSW_LEN - 1) {
+                warn("load: invalid email/password for %.*s",
+                     (int) rec->email_len, rec->email);
+                continue;
+            }
 
-    fp = fopen(filename, "a+");
-    if (!fp) {
-        err("fopen: %s", strerror(errno));
-        return -1;
-    }
+            shard = robin_user_shard_of(rec->hash);
 
-    while ((nread = getline(&buf, &buf_len, fp)) != -1) {
-        /* remove new line from buffer if present */
-        ptr = strchr(buf, '\n');
-        if (ptr)
-            *ptr = '\0';
+            if (robin_user_index_lookup_unsafe(shard, rec->email,
+                                               rec->email_len,
+                                               rec->hash) >= 0) {
+                warn("load: user %.*s already registered",
+                     (int) rec->email_len, rec->email);
+                continue;
+            }
 
-        /* separate email and password */
-        ptr = strchr(buf, ':');
-        if (!ptr) {
-            err("load: invalid format of user file");
-            return -1;
-        }
-        *(ptr++) = '\0';
+            uid = robin_user_append_unsafe(rec->email, rec->email_len,
+                                           rec->psw, rec->psw_len);
+            if (uid < 0) {
+                err("load: failed to add the user %.*s to the system",
+                    (int) rec->email_len, rec->email);
+                ret = -1;
+                break;
+            }
 
-        /* actually add the user */
-        if (robin_user_add_unsafe(buf, ptr) < 0) {
-            err("load: failed to add the user %s to the system", buf);
-            return -1;
+            robin_user_index_insert_unsafe(shard, rec->hash, uid);
+            loaded++;
         }
     }
 
-    free(buf);
-    fclose(fp);
+    pthread_mutex_unlock(&users_mutex);
+    for (int i = 0; i < ROBIN_USER_SHARD_NUM; i++)
+        pthread_rwlock_unlock(&users_shards[i].lock);
 
-    dbg("load: all users have been register into the system");
+    for (int i = 0; i < nthreads; i++)
+        free(loaders[i].records);
 
-    /* save filename for successive user registrations */
-    filename_len = strlen(filename) + 1;
-    users_file = malloc(filename_len * sizeof(char));
-    if (!users_file) {
-        err("malloc: %s", strerror(errno));
+    if (map)
+        munmap(map, size);
+    close(fd);
+
+    if (ret)
+        return ret;
+
+    info("load: %zu users registered into the system", loaded);
+
+    /* successive user registrations are appended to the same file */
+    users_journal = robin_journal_open(filename, &opts);
+    if (!users_journal)
         return -1;
-    }
-    strcpy(users_file, filename);
 
     return 0;
 }
 
+int robin_user_graph_load(const char *snapshot, const char *journal)
+{
+    struct stat st_store, st_snap;
+
+    /*
+     * On close in disk mode the store is saved after the snapshot: a newer
+     * snapshot comes from a run in memory mode, whose changes the store misses.
+     */
+    if (users_store && !stat(users_store, &st_store)
+        && !stat(snapshot, &st_snap)
+        && (st_snap.st_mtim.tv_sec > st_store.st_mtim.tv_sec
+            || (st_snap.st_mtim.tv_sec == st_store.st_mtim.tv_sec
+                && st_snap.st_mtim.tv_nsec > st_store.st_mtim.tv_nsec))) {
+        err("graph_load: %s is newer than %s, remove %s* to rebuild the store "
+            "from it", snapshot, users_store, users_store);
+        return -1;
+    }
+
+    return robin_graph_open(snapshot, journal,
+                            users_store ? &robin_user_graph_disk_ops
+                                        : &robin_user_graph_ops);
+}
+
 int robin_user_acquire(const char *email, const char *psw, int *uid)
 {
-    char psw_hashed[512];
-    int ret;
+    char psw_stored[ROBIN_USER_PSW_LEN + 1], psw_hashed[512];
+    int i, ret;
 
     dbg("acquire_data: email=%s psw=%s", email, psw);
 
-    pthread_mutex_lock(&users_mutex);
+    /* resolve the user, its credentials never change */
+    i = robin_user_lookup(email);
 
-    /* default return value: invalid email */
-    ret = 2;
-    for (int i = 0; i < users_len; i++) {
-        if (strcmp(email, users[i].data->email))
-            continue;
+    if (i >= 0)
+        strcpy(psw_stored, robin_user_cred_at(i)->psw);
 
-        ret = password_hash(psw_hashed, psw, users[i].data->psw);
-        if (ret < 0) {
-            err("acquire: failed to hash the password");
-            return -1;
-        }
+    if (i < 0) {
+        /* invalid email */
+        ret = 2;
+        goto acquire_quit;
+    }
 
-        if (strcmp(psw_hashed, users[i].data->psw)) {
-            /* invalid password */
-            ret = 3;
-            break;
-        }
+    /* verify the password without holding any lock */
+    if (robin_crypt_hash(psw_hashed, psw, psw_stored) < 0) {
+        err("acquire: failed to hash the password");
+        ret = -1;
+        goto acquire_quit;
+    }
 
-        ret = pthread_mutex_trylock(&users[i].acquired);
-        if (ret == 0) {
-            *uid = i;
-            break;
-        } else if (ret == EBUSY) {
-            warn("acquire: user data already acquired by someone else");
-            ret = 1;
-            break;
-        } else {
-            err("acquire: failed to acquire the user data");
-            ret = -1;
-            break;
-        }
+    if (strcmp(psw_hashed, psw_stored)) {
+        /* invalid password */
+        ret = 3;
+        goto acquire_quit;
     }
 
+    /* credentials are valid, claim the session */
+    ret = robin_user_try_acquire(robin_user_at(i));
+
+    if (ret == 0)
+        *uid = i;
+    else
+        warn("acquire: user data already acquired by someone else");
+
+acquire_quit:
     dbg("acquire_data: ret=%d", ret);
 
-    pthread_mutex_unlock(&users_mutex);
     return ret;
 }
 
-void robin_user_release(int uid)
+int robin_user_acquire_uid(int uid)
 {
-    pthread_mutex_lock(&users_mutex);
+    if (!robin_user_valid(uid)) {
+        err("acquire_uid: invalid uid %d", uid);
+        return -1;
+    }
 
-    if (robin_user_is_acquired(&users[uid]) > 0)
-        pthread_mutex_unlock(&users[uid].acquired);
+    if (robin_user_try_acquire(robin_user_at(uid))) {
+        warn("acquire_uid: user data already acquired by someone else");
+        return 1;
+    }
 
-    pthread_mutex_unlock(&users_mutex);
+    return 0;
+}
+
+void robin_user_release(int uid)
+{
+    __atomic_store_n(&robin_user_at(uid)->acquired, 0, __ATOMIC_RELEASE);
 }
 
 
@@ -316,299 +1930,270 @@ int robin_user_add(const char *email, const char *psw)
     char psw_hashed[512];
     int ret;
 
-    ret = password_hash(psw_hashed, psw, NULL);
+    ret = robin_crypt_hash(psw_hashed, psw, NULL);
     if (ret < 0) {
         err("add: could not hash the password");
         return -1;
     }
 
-    pthread_mutex_lock(&users_mutex);
-    ret = robin_user_add_unsafe(email, psw_hashed);
-    pthread_mutex_unlock(&users_mutex);
-
-    return ret;
+    return robin_user_add_hashed(email, psw_hashed);
 }
 
 const char *robin_user_email_get(int uid)
 {
     const char *ret = NULL;
 
-    pthread_mutex_lock(&users_mutex);
-
-    if (robin_user_is_acquired(&users[uid]))
-        ret = users[uid].data->email;
+    if (robin_user_is_acquired(robin_user_at(uid)))
+        ret = robin_user_cred_at(uid)->email;
 
-    pthread_mutex_unlock(&users_mutex);
     return ret;
 }
 
-int robin_user_following_get(int uid, char ***following, size_t *len)
+const robin_user_adj_t *robin_user_following_snap(int uid)
 {
-    robin_user_data_t *data;
-    clist_t *tmp;
-    char **following_vec;
-    int ret = 0;
-
-    pthread_mutex_lock(&users_mutex);
-    if (robin_user_is_acquired(&users[uid]))
-        data = users[uid].data;
-    else
-        ret = -1;
-    pthread_mutex_unlock(&users_mutex);
+    robin_user_t *user = robin_user_at(uid);
+    robin_user_snap_t *snap;
 
-    if (ret)
-        return ret;
-
-    following_vec = malloc(data->following_len * sizeof(char *));
-    if (!following_vec) {
-        err("malloc: %s", strerror(errno));
-        return -1;
-    }
-
-    tmp = data->following;
-    for (int i = 0; i < data->following_len; i++) {
-        following_vec[i] = ((robin_user_data_t *) tmp->ptr)->email;
-        tmp = tmp->next;
-    }
+    if (!robin_user_is_acquired(user))
+        return NULL;
 
-    *following = following_vec;
-    *len = data->following_len;
+    snap = robin_user_snap_get(uid, &user->following_snap, &user->following);
 
-    return 0;
+    return snap ? &snap->adj : NULL;
 }
 
-int robin_user_followers_get(int uid, char ***followers, size_t *len)
+const robin_user_adj_t *robin_user_followers_snap(int uid)
 {
-    robin_user_data_t *data;
-    clist_t *tmp;
-    char **followers_vec;
-    int ret = 0;
-
-    pthread_mutex_lock(&users_mutex);
+    robin_user_t *user = robin_user_at(uid);
+    robin_user_snap_t *snap;
 
-    if (robin_user_is_acquired(&users[uid]))
-        data = users[uid].data;
-    else
-        ret = -1;
+    if (!robin_user_is_acquired(user))
+        return NULL;
 
-    pthread_mutex_unlock(&users_mutex);
+    snap = robin_user_snap_get(uid, &user->followers_snap, &user->followers);
 
-    if (ret)
-        return ret;
+    return snap ? &snap->adj : NULL;
+}
 
-    pthread_mutex_lock(&data->followers_mutex);
+const robin_user_adj_t *robin_user_mutuals(int uid)
+{
+    robin_user_t *user = robin_user_at(uid);
+    robin_user_snap_t *following, *followers, *mutuals = NULL;
 
-    followers_vec = malloc(data->followers_len * sizeof(char *));
-    if (!followers_vec) {
-        err("malloc: %s", strerror(errno));
-        return -1;
-    }
+    if (!robin_user_is_acquired(user))
+        return NULL;
 
-    tmp = data->followers;
-    for (int i = 0; i < data->followers_len; i++) {
-        char *email = ((robin_user_data_t *) tmp->ptr)->email;
-        dbg("followers_get: vec[%d] = %s", i, email);
-        followers_vec[i] = email;
-        tmp = tmp->next;
-    }
+    following = robin_user_snap_get(uid, &user->following_snap,
+                                    &user->following);
+    followers = robin_user_snap_get(uid, &user->followers_snap,
+                                    &user->followers);
 
-    pthread_mutex_unlock(&data->followers_mutex);
+    if (following && followers)
+        mutuals = robin_user_snap_intersect(following, followers);
 
-    *followers = followers_vec;
-    *len = data->followers_len;
+    if (following)
+        robin_user_snap_put(following);
+    if (followers)
+        robin_user_snap_put(followers);
 
-    return ret;
+    return mutuals ? &mutuals->adj : NULL;
 }
 
-int robin_user_follow(int uid, const char *email)
+int robin_user_common(int uid, const char *email, int followers,
+                      const robin_user_adj_t **common)
 {
-    robin_user_data_t *me, *found = NULL;
-    clist_t *el, *new_follow;
+    robin_user_t *user = robin_user_at(uid), *other;
+    robin_user_snap_t *mine, *theirs, *snap = NULL;
+    int other_uid;
 
-    /* exclusive access for retrieve data pointers */
-    pthread_mutex_lock(&users_mutex);
+    *common = NULL;
 
-    if (!robin_user_is_acquired(&users[uid])) {
-        err("follow: user %d (%s) is not acquired", uid,
-            users[uid].data->email);
+    if (!robin_user_is_acquired(user)) {
+        err("common: user %d is not acquired", uid);
         return -1;
     }
 
-    me = users[uid].data;
-
-    for (int i = 0; i < users_len; i++) {
-        /* an user cannot follow himself */
-        if (i == uid)
-            continue;
-
-        if (!strcmp(email, users[i].data->email)) {
-            found = users[i].data;
-            break;
-        }
-    }
-
-    pthread_mutex_unlock(&users_mutex);
-
-    /*
-     * Users cannot be deleted at run time, exclusive access
-     * is not needed anymore.
-     */
-
-    if (!found) {
-        warn("follow: user %s does not exist", email);
+    other_uid = robin_user_lookup(email);
+    if (other_uid < 0)
         return 1;
-    }
-
-    /* search for already followed user */
-    el = me->following;
-    while (el != NULL) {
-        const char *el_email = ((robin_user_data_t *) el->ptr)->email;
+    other = robin_user_at(other_uid);
 
-        if (!strcmp(el_email, email))
-            break;
-
-        el = el->next;
+    if (followers) {
+        mine = robin_user_snap_get(uid, &user->followers_snap,
+                                   &user->followers);
+        theirs = robin_user_snap_get(other_uid, &other->followers_snap,
+                                     &other->followers);
+    } else {
+        mine = robin_user_snap_get(uid, &user->following_snap,
+                                   &user->following);
+        theirs = robin_user_snap_get(other_uid, &other->following_snap,
+                                     &other->following);
     }
 
-    if (el) {
-        warn("follow: user %s is already followed", found->email);
-        return 2;
-    }
+    if (mine && theirs)
+        snap = robin_user_snap_intersect(mine, theirs);
 
-    /* add following user */
-    new_follow = malloc(sizeof(clist_t));
-    if (!new_follow) {
-        err("malloc: %s", strerror(errno));
-        return -1;
-    }
-    new_follow->ptr = found;
-    new_follow->next = me->following;
-    me->following = new_follow;
-    me->following_len++;
-    dbg("follow: following=%s, len=%d", found->email, me->following_len);
+    if (mine)
+        robin_user_snap_put(mine);
+    if (theirs)
+        robin_user_snap_put(theirs);
 
-    /* add me as follower in following user */
-    new_follow = malloc(sizeof(clist_t));
-    if (!new_follow) {
-        err("malloc: %s", strerror(errno));
+    if (!snap)
         return -1;
-    }
-    new_follow->ptr = me;
-    pthread_mutex_lock(&found->followers_mutex);
-    new_follow->next = found->followers;
-    found->followers = new_follow;
-    found->followers_len++;
-    dbg("follow: follower=%s, len=%d", me->email, found->followers_len);
-    pthread_mutex_unlock(&found->followers_mutex);
+
+    *common = &snap->adj;
 
     return 0;
 }
 
-int robin_user_unfollow(int uid, const char *email)
+void robin_user_adj_put(const robin_user_adj_t *adj)
 {
-    robin_user_data_t *me, *unfollowed;
-    clist_t *el, *prev, *tmp;
+    if (adj)
+        robin_user_snap_put((robin_user_snap_t *) adj);
+}
 
-    /* exclusive access for retrieve data pointers */
-    pthread_mutex_lock(&users_mutex);
+const robin_user_sugg_t *robin_user_suggest(int uid, size_t k)
+{
+    robin_user_t *user = robin_user_at(uid);
+    robin_user_snap_t *following;
+    robin_user_sugg_entry_t *entry, *old;
+    uint64_t now;
 
-    if (!robin_user_is_acquired(&users[uid])) {
-        err("follow: user %d (%s) is not acquired", uid,
-            users[uid].data->email);
-        return -1;
-    }
+    if (!robin_user_is_acquired(user))
+        return NULL;
 
-    me = users[uid].data;
+    following = robin_user_snap_get(uid, &user->following_snap,
+                                    &user->following);
+    if (!following)
+        return NULL;
 
-    pthread_mutex_unlock(&users_mutex);
+    now = robin_user_now_ms();
 
-    /*
-     * Users cannot be deleted at run time, exclusive access
-     * is not needed anymore.
-     */
+    pthread_mutex_lock(&user->mutex);
 
-    /* search for followed user */
-    prev = NULL;
-    tmp = me->following;
-    while (tmp != NULL) {
-        const char *el_mail = ((robin_user_data_t *) tmp->ptr)->email;
+    /* the basis is referenced by the entry, it cannot be a new snapshot */
+    entry = user->sugg;
+    if (entry && entry->basis == following && entry->k == k
+        && now < entry->expire)
+        __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+    else
+        entry = NULL;
 
-        if (!strcmp(el_mail, email))
-            break;
+    pthread_mutex_unlock(&user->mutex);
 
-        prev = tmp;
-        tmp = tmp->next;
+    if (entry) {
+        robin_user_snap_put(following);
+        return &entry->sugg;
     }
 
-    if (!tmp) {
-        warn("follow: user %s is not followed", email);
-        return 1;
+    entry = robin_user_sugg_build(uid, &following->adj, k);
+    if (!entry) {
+        robin_user_snap_put(following);
+        return NULL;
     }
 
-    if (prev)
-        prev->next = tmp->next;
-    else
-        me->following = tmp->next;
+    /* the reference to the following snapshot goes to the entry */
+    entry->basis = following;
+    entry->expire = now + ROBIN_USER_SUGGEST_TTL_MS;
+    entry->refs = 2;
 
-    me->following_len--;
-    el = tmp;
-    unfollowed = (robin_user_data_t *) el->ptr;
+    pthread_mutex_lock(&user->mutex);
+    old = user->sugg;
+    user->sugg = entry;
+    pthread_mutex_unlock(&user->mutex);
 
-    pthread_mutex_lock(&unfollowed->followers_mutex);
+    if (old)
+        robin_user_sugg_put_entry(old);
 
-    prev = NULL;
-    tmp = unfollowed->followers;
-    while (tmp) {
-        const char *el_email = ((robin_user_data_t *) tmp->ptr)->email;
-        if (!strcmp(el_email, me->email))
-            break;
+    return &entry->sugg;
+}
 
-        prev = tmp;
-        tmp = tmp->next;
-    }
+void robin_user_sugg_put(const robin_user_sugg_t *sugg)
+{
+    if (sugg)
+        robin_user_sugg_put_entry((robin_user_sugg_entry_t *) sugg);
+}
 
-    if (!tmp) {
-        warn("follow: user %s is not a follower of user %s",
-             email, unfollowed->email);
-        return 1;
-    }
+int robin_user_follow_many(int uid, const char **emails, int n, int *results)
+{
+    return robin_user_change_many(ROBIN_GRAPH_FOLLOW, uid, emails, n,
+                                  results);
+}
 
-    if (prev)
-        prev->next = tmp->next;
-    else
-        unfollowed->followers = tmp->next;
+int robin_user_follow(int uid, const char *email)
+{
+    int ret;
+
+    if (robin_user_follow_many(uid, &email, 1, &ret) < 0)
+        return -1;
+
+    return ret;
+}
 
-    unfollowed->followers_len--;
+int robin_user_unfollow_many(int uid, const char **emails, int n,
+                             int *results)
+{
+    return robin_user_change_many(ROBIN_GRAPH_UNFOLLOW, uid, emails, n,
+                                  results);
+}
 
-    pthread_mutex_unlock(&unfollowed->followers_mutex);
+int robin_user_unfollow(int uid, const char *email)
+{
+    int ret;
 
-    free(el);
+    if (robin_user_unfollow_many(uid, &email, 1, &ret) < 0)
+        return -1;
 
-    return 0;
+    return ret;
 }
 
 void robin_user_free_all(void)
 {
-    pthread_mutex_lock(&users_mutex);
+    /* save the follow graph while it is still in memory */
+    robin_graph_close();
 
-    if (users) {
-        for (int i = 0; i < users_len; i++) {
-            /* skip acquired resources */
-            if (robin_user_is_acquired(&users[i]))
-                continue;
+    pthread_mutex_lock(&users_mutex);
 
-            pthread_mutex_lock(&users[i].acquired);
-            robin_user_data_free_unsafe(users[i].data);
-            pthread_mutex_unlock(&users[i].acquired);
-        }
+    /* connections are closed, nobody holds users or snapshots anymore */
+    for (int i = 0; i < users_len; i++)
+        robin_user_free_unsafe(robin_user_at(i));
+    ebr_free_all();
+
+    for (int b = 0; b < ROBIN_USER_DIR_LEN && users[b]; b++) {
+        dbg("free_all: users[%d]=%p", b, users[b]);
+        free(users[b]);
+        users[b] = NULL;
+        if (users_cred_fd < 0)
+            free(users_cred[b]);
+        else if (users_cred[b])
+            munmap(users_cred[b], ROBIN_USER_CRED_BLOCK_SIZE);
+        users_cred[b] = NULL;
+    }
+    users_len = 0;
+
+    if (users_store) {
+        robin_store_close();
+        close(users_cred_fd);
+        users_cred_fd = -1;
+        free(users_store);
+        users_store = NULL;
+        users_cache_hand = -1;
+        users_cache_len = 0;
+    }
 
-        dbg("free_all: users=%p", users);
-        free(users);
+    for (int i = 0; i < ROBIN_USER_SHARD_NUM; i++) {
+        pthread_rwlock_wrlock(&users_shards[i].lock);
+        free(users_shards[i].index);
+        users_shards[i].index = NULL;
+        users_shards[i].cap = 0;
+        users_shards[i].len = 0;
+        pthread_rwlock_unlock(&users_shards[i].lock);
     }
 
-    if (users_file) {
-        dbg("free_all: users_file=%p", users_file);
-        free(users_file);
+    if (users_journal) {
+        dbg("free_all: users_journal=%p", users_journal);
+        robin_journal_close(users_journal);
+        users_journal = NULL;
     }
 
     pthread_mutex_unlock(&users_mutex);